@@ -27,11 +27,21 @@
 
 
 
+//  For posix_memalign (frozen snapshots, and the blocks of tagged nodes),
+//  which strict C (-std=c99, -std=c11) does not declare otherwise:
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "avl.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
 
 
 //  
-//  These methods operate on the flag field 'f'.
+//  These methods operate on the flag field 'f', or with AVL_TAGGED_NODE on
+//  the low bits of the 'l' and 'r' pointers (see below).  All take the node.
 //
 //  A note on balance:  balance is stored as a positive number, and should never be more
 //  than -1, 0, or +1.  However, during deletion operations, it may become -2 or +2, in
@@ -41,26 +51,110 @@
 //  Bits:     Mask:       Field:
 //    7         0x80         unused (technically the 'sign' bit, which messes with shifting)
 //    6-4       0x70         Balance+2 (to avoid shifting signed), must be -2, -1, 0, +1, +2  (maps to 0, 1, 2, 3, 4)
-//    3         0x08         1st in alloc (base address of allocation, used for free())
+//    3         0x08         Available
 //    2         0x04         Currently free vs. used
-//    1         0x02         Cleanup: marked for freeing up y/n
+//    1         0x02         Available
 //    0         0x01         Available
+//
+//  Tagged nodes are 8 byte aligned, which leaves 3 bits at the bottom of
+//  each pointer:  those of 'l' hold the balance+2, and bit 2 of 'r' holds
+//  the used flag.  Everything that reads a child goes through 'AVL_left'
+//  and 'AVL_right' (in avl.h), and everything that writes one through
+//  'setLeft' and 'setRight', which keep the bits.  'clrflags' clears
+//  both pointers along with the bits.
+//
+
+//  The pointers that concurrent readers load ('top', and the 'l', 'r' and
+//  'd' of a node) are all stored through 'AVL_store', from the moment the
+//  node is taken from its block.  A release store (a plain 'mov' on x86):
+//  a reader that loads a pointer with acquire also sees everything stored
+//  to the node it points to before, such as the fields of a new node that
+//  a rotation links in:
+#define AVL_store(x,v)      __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
 
+#define AVL_FLG_USD     2           //  Used as a shift amount.
+
+#ifndef AVL_TAGGED_NODE
 #define AVL_FLG_BAL     0x70        //  Used as a mask, upper nibble.
-#define AVL_FLG_1ST     3           //  Used as a shift amount.
-#define AVL_FLG_USD     2           //  idem
-#define AVL_FLG_CLN     1           //  idem
 
 //  Balance specific:
-#define AVL_getbal(f)       (((int8_t)((f&AVL_FLG_BAL)>>4))-2)
-#define AVL_setbal(f,b)     f=((f&(~AVL_FLG_BAL))|((((int8_t)b)+2)<<4))
-#define AVL_incbal(f)       (f+=(int8_t)0x10)
-#define AVL_decbal(f)       (f-=(int8_t)0x10)
+#define AVL_getbal(n)       (((int8_t)(((*(n)).f&AVL_FLG_BAL)>>4))-2)
+#define AVL_setbal(n,b)     (*(n)).f=(((*(n)).f&(~AVL_FLG_BAL))|((((int8_t)b)+2)<<4))
+#define AVL_incbal(n)       ((*(n)).f+=(int8_t)0x10)
+#define AVL_decbal(n)       ((*(n)).f-=(int8_t)0x10)
+
+//  Genefic for flags:
+#define AVL_getbit(n,b)     ((*(n)).f&(((int8_t)0x1<<b)))
+#define AVL_setbit(n,b)     (*(n)).f|=((int8_t)0x1<<b)
+#define AVL_clrbit(n,b)     (*(n)).f&=(~(((int8_t)0x1)<<b))
+#define AVL_clrflags(n)     ((*(n)).f=0)
+
+//  Children, stored as they are:
+#define AVL_tagged(p,x)     (x)
+#define AVL_setLeft(n,x)    AVL_store((*(n)).l, (x))
+#define AVL_setRight(n,x)   AVL_store((*(n)).r, (x))
+#else
+//  The tag bits are the low 3 bits of a node's address, free only if
+//  every node is 8-byte aligned.  The blocks come from posix_memalign
+//  (see the top of the file), aligned to their size.  The alignment of
+//  the node is taken with offsetof, as _Alignof is not in C99:
+_Static_assert(sizeof(AVL_NODE)%8==0 && offsetof(struct { char c; AVL_NODE n; }, n)>=8, "tagged nodes must be 8-byte aligned");
+
+#define AVL_tagOf(p)        ((uintptr_t)(p)&AVL_TAG_BITS)
+#define AVL_retag(p,v)      AVL_store((p), (AVL_NODE*)(((uintptr_t)(p)&~AVL_TAG_BITS)|(uintptr_t)(v)))
+
+//  Balance specific:
+#define AVL_getbal(n)       ((int)AVL_tagOf((*(n)).l)-2)
+#define AVL_setbal(n,b)     AVL_retag((*(n)).l, (b)+2)
+#define AVL_incbal(n)       AVL_store((*(n)).l, (AVL_NODE*)((uintptr_t)(*(n)).l+1))
+#define AVL_decbal(n)       AVL_store((*(n)).l, (AVL_NODE*)((uintptr_t)(*(n)).l-1))
 
 //  Genefic for flags:
-#define AVL_getbit(f,b)     (f&(((int8_t)0x1<<b)))
-#define AVL_setbit(f,b)     f|=((int8_t)0x1<<b)
-#define AVL_clrbit(f,b)     f&=(~(((int8_t)0x1)<<b))
+#define AVL_getbit(n,b)     ((uintptr_t)(*(n)).r&((uintptr_t)0x1<<b))
+#define AVL_setbit(n,b)     AVL_store((*(n)).r, (AVL_NODE*)((uintptr_t)(*(n)).r|((uintptr_t)0x1<<b)))
+#define AVL_clrbit(n,b)     AVL_store((*(n)).r, (AVL_NODE*)((uintptr_t)(*(n)).r&~((uintptr_t)0x1<<b)))
+#define AVL_clrflags(n)     (AVL_store((*(n)).l, NULL), AVL_store((*(n)).r, NULL))
+
+//  Children:  'x' with the tag bits of the pointer 'p' it replaces
+#define AVL_tagged(p,x)     ((AVL_NODE*)((uintptr_t)(x)|AVL_tagOf(p)))
+#define AVL_setLeft(n,x)    AVL_store((*(n)).l, AVL_tagged((*(n)).l,(x)))
+#define AVL_setRight(n,x)   AVL_store((*(n)).r, AVL_tagged((*(n)).r,(x)))
+#endif
+
+//  Subtree node counts, for the order statistics.  'recount' must be
+//  applied bottom-up to every node whose subtrees changed:
+#ifdef AVL_ORDER_STAT
+#define AVL_count(n)        ((n)?(*(n)).s:0)
+#define AVL_recount(n)      ((*(n)).s=AVL_count(AVL_left((n)))+AVL_count(AVL_right((n)))+1)
+#else
+#define AVL_recount(n)
+#endif
+
+//  Compares node 'n' to key 'x' the way 'eval' does, but with key prefixes
+//  on, the prefixes of the node and of 'x' ('px', from 'prefixOf' in
+//  avl.h) first:
+#ifdef AVL_KEY_PREFIX
+#define AVL_setPrefix(n,pk) ((*(n)).k=(pk))
+#define AVL_cmp(t,n,x,px)   ((*(t)).prefix==NULL || (*(n)).k==(px) ? (*(t)).eval((*(n)).d, (x), (*(t)).user) : ((*(n)).k<(px) ? 1 : -1))
+#else
+#define AVL_setPrefix(n,pk)
+#define AVL_cmp(t,n,x,px)   ((void)(px), (*(t)).eval((*(n)).d, (x), (*(t)).user))
+#endif
+
+//  The block a node belongs to, in allocation set 'a', found through its
+//  index, or with tagged nodes by rounding down to the size of the blocks:
+#ifndef AVL_TAGGED_NODE
+#define AVL_blockOf(a,x)    ((void)(a), (AVL_BLOCK*)((char*)((x)-(*(x)).b)-offsetof(AVL_BLOCK, n)))
+#else
+#define AVL_blockOf(a,x)    ((AVL_BLOCK*)((uintptr_t)(x)&~((uintptr_t)(*(a)).blockSize-1)))
+#endif
+
+//  Trees that can exchange nodes:  the same allocation set, or the same pool
+#define AVL_sameSet(a,b)    ((*(a)).alloc==(*(b)).alloc || ((*(a)).pool!=NULL && (*(a)).pool==(*(b)).pool))
+
+//  Stores a pointer that makes a node reachable for concurrent readers,
+//  everything written to the node before becomes visible along with it:
+#define AVL_publish(x,v)    __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
 
 
 
@@ -88,733 +182,2575 @@ AVL_TREE *AVL_newTree(int allocAtOnce, int (*eval)(void *d1, void *d2, void *use
     {
         memset(t, 0, sizeof(AVL_TREE));
         if (allocAtOnce<1) allocAtOnce=1;
+        if (allocAtOnce>AVL_MAX_ALLOC) allocAtOnce=AVL_MAX_ALLOC;
+#ifdef AVL_TAGGED_NODE
+        //  Blocks are a power of 2 in size, and aligned to it, to be found
+        //  from their nodes.  The nodes fill the whole block:
+        (*t).blockSize=64;
+        while ((*t).blockSize<sizeof(AVL_BLOCK)+allocAtOnce*sizeof(AVL_NODE))
+            (*t).blockSize*=2;
+        allocAtOnce=((*t).blockSize-sizeof(AVL_BLOCK))/sizeof(AVL_NODE);
+#endif
         (*t).allocAtOnce=allocAtOnce;
+        (*t).releaseHigh=-1;
         (*t).eval=eval;
         (*t).user=user;
+        (*t).alloc=t;
     }
     return(t);
 }
 
+
 //
-//  Internal method to get a new node.  Sometimes we need a new node
-//  and there are none, and we need to allocate a pile.
-//  Note:  this is an internal method, and always expects 't' to exist
+//  A tree that shares the allocation set of 't', so that nodes can move
+//  between the two.  The owner of the set must be destroyed last.
 //
-AVL_NODE *AVL_newNode(AVL_TREE *t)
+AVL_TREE *AVL_newShared(AVL_TREE *t)
 {
-    AVL_NODE *n;
-    if ((*t).freeStack==NULL)
-    { 
-        //  Allocation:
-        int i;
-        n=(AVL_NODE*)malloc((*t).allocAtOnce*sizeof(AVL_NODE));
-        if (n)
-        {
-            AVL_NODE *f=n;
-            //fprintf(stderr, "ALLOC: %llx\n", (long long int) n);
-            //  Push them onto the stack.
-            for (i=0; i<(*t).allocAtOnce; i+=1)
-            {
-                n[i].f=0;
-                n[i].r=(*t).freeStack;
-                (*t).freeStack=&(n[i]);
-            }
-            //  Mark which one was first
-            //  This is the allocation address of the sequence.
-            AVL_setbit((*f).f,AVL_FLG_1ST);
-        }
-    } 
-    
-    //  Note:  if allocation failed, n will be NULL 
-    n=(*t).freeStack;
-    if (n)
+    AVL_TREE *s;
+
+    //  Pooled trees all share the pool, and have no owner:
+    if ((*t).pool)
     {
-        (*t).freeStack=(*n).r;
-        (*n).l=NULL;
-        (*n).r=NULL;
-        (*n).d=NULL;
-        AVL_setbal((*n).f,0);
-        AVL_setbit((*n).f,AVL_FLG_USD);
-        (*t).size+=1;
+        s=AVL_newPooled((*t).pool, (*t).eval, (*t).user);
+#ifdef AVL_KEY_PREFIX
+        if (s)
+            (*s).prefix=(*t).prefix;
+#endif
+        return(s);
     }
-    return(n);
+
+    s=AVL_newTree((*t).allocAtOnce, (*t).eval, (*t).user);
+    if (s)
+    {
+        (*s).alloc=(*t).alloc;
+#ifdef AVL_KEY_PREFIX
+        (*s).prefix=(*t).prefix;
+#endif
+    }
+    return(s);
 }
 
 
+void AVL_poolExit(void *x);
+
 //
-//  Breaks down the tree and returns all of them to the freeStack:
+//  A node pool, with no nodes yet.  Blocks of 'allocAtOnce' nodes
+//  are allocated as the threads run out.
 //
-void AVL_flush(AVL_TREE *t)
+AVL_POOL *AVL_newPool(int allocAtOnce)
 {
-    AVL_NODE *n;
-    AVL_NODE *stack[AVL_MAX_DEPTH];
-    int top;
-
-        //  Obvious empty tree case:
-    if ((*t).top==NULL) return;
-
-        //  Top goes on the stack:
-    n=(*t).top;
-    stack[0]=n;
-    top=1;
-    while (top>0)
+    AVL_POOL *p=(AVL_POOL*)malloc(sizeof(AVL_POOL));
+    if (p)
     {
-        if ((*n).l)
-        {
-            //  If there's a left, cut it, recurse left.
-            stack[top]=n;
-            top+=1;
-            n=(*n).l;
-        }
-        else if ((*n).r)
+        memset(p, 0, sizeof(AVL_POOL));
+        if (allocAtOnce<1) allocAtOnce=1;
+        (*p).allocAtOnce=allocAtOnce;
+        if (pthread_key_create(&((*p).key), AVL_poolExit)!=0)
         {
-            //  If there's no more left, cut it, recurse right.
-            stack[top]=n;
-            top+=1;
-            n=(*n).r;
+            free(p);
+            return(NULL);
         }
-        else
-        {
-            //  There is no left, and no right.
-            //  Delete the node, and pop from stack:
-            top-=1;
-            AVL_NODE *m=stack[top];
-            //  Did we come from left or right?
-            if ((*m).l==n)
-                (*m).l=NULL;
-            else if ((*m).r==n)
-                (*m).r=NULL;
-            (*n).r=(*t).freeStack;
-            (*t).freeStack=n;
-            AVL_clrbit((*n).f, AVL_FLG_USD);
-            n=m;
-        }
-    }
-    (*t).top=NULL;
-    (*t).height=0;
-    (*t).size=0;
-    return;
+        pthread_mutex_init(&((*p).lock), NULL);
+    }
+    return(p);
 }
 
 
 //
-//  Runs the free list twice and sees how much can be cleaned up.
-//  Returns the number of records freed.
+//  A tree that takes its nodes from pool 'p'.
 //
-//  NOTE:  this method is NOT re-entreable
+AVL_TREE *AVL_newPooled(AVL_POOL *p, int (*eval)(void *d1, void *d2, void *user), void *user)
+{
+    AVL_TREE *t=AVL_newTree((*p).allocAtOnce, eval, user);
+    if (t)
+        (*t).pool=p;
+    return(t);
+}
+
+
 //
-int AVL_dealloc(AVL_TREE *t)
+//  Internal method:  an empty magazine from the depot, or a new one.
+//  Called with the depot lock held, returns NULL if out of memory.
+//
+AVL_MAGAZINE *AVL_poolMagazine(AVL_POOL *p)
 {
-    int c=0;
-    AVL_NODE *n=(*t).freeStack;
-    AVL_NODE *l=NULL;               //  The 'to-be-freed' list, using (*n).l
-    
-        //  
-        //  Note:  there is a special case where (*top)=NULL and we
-        //  only need to 'collect' the AVL_FLG_1ST nodes for calling 'free'
-        //
-    while (n)
-    {
-        //  Is this one of a sequence?
-        if (AVL_getbit((*n).f, AVL_FLG_1ST))
-        {
-            int i, j;
+    AVL_MAGAZINE *m=(*p).empty;
+    if (m)
+        (*p).empty=(*m).next;
+    else
+        m=(AVL_MAGAZINE*)calloc(1, sizeof(AVL_MAGAZINE));
+    return(m);
+}
 
-                //
-                //  Step 1:  check if all of the nodes in this sequence
-                //  can be de-allocated (they're not in the tree).
-                //
-            j=0;
-            for (i=0; i<(*t).allocAtOnce; i+=1)
-            {
-                //  If this node is NOT in the tree, set a bit
-                //  indicating it can potentially be freed.
-                if (AVL_getbit(n[i].f, AVL_FLG_USD)==0)
-                {
-                    j+=1;
-                    AVL_setbit(n[i].f, AVL_FLG_CLN);
-                }
-                else
-                    i=(*t).allocAtOnce;  // Bail
-            }
-            //  Can all be freed?
-            if (j==(*t).allocAtOnce)
-            {
-                //  Schedule this entire sequence for cleansing.
-                //  It leaves the 'cln' bit set, and sticks the 1st
-                //  allocated node 'n' in the free list, using the 'left'
-                (*n).l=l;
-                l=n;
-                c+=(*t).allocAtOnce;
-            }
-            else
-            {
-                for (i=0; i<(*t).allocAtOnce; i+=1)
-                    AVL_clrbit(n[i].f, AVL_FLG_CLN);
-            }
-        }
-        //  Next one:
-        n=(*n).r;
-    }
 
-        //
-        //  IF there's any that can be cleaned, run the list again, and
-        //  take all the nodes out:
-        //
-    if (l)
+//
+//  Internal method:  puts magazine 'm' back in the depot.
+//  Called with the depot lock held.
+//
+void AVL_poolDeposit(AVL_POOL *p, AVL_MAGAZINE *m)
+{
+    if ((*m).n>0)
     {
-        //  Start by taking the nodes of each sequence out:
-        AVL_NODE *p=NULL;
-        n=(*t).freeStack;
-        while (n)
-        {
-            if (AVL_getbit((*n).f, AVL_FLG_CLN))
-            {
-                if (p)
-                    (*p).r=(*n).r;
-                else
-                    (*t).freeStack=(*n).r;
-            }
-            else
-            {
-                //  Go to the next one:
-                p=n;
-            }
-            n=(*n).r;
-        }
-        //  Now run the free's:
-        while (l)
-        {
-            AVL_NODE *q=l;
-            l=(*l).l;
-            //fprintf(stderr, "DE-ALLOC: %llx\n", (long long int) q);
-            free(q);
-        }
+        (*m).next=(*p).full;
+        (*p).full=m;
     }
-    //fprintf(stderr, "Top: %llx   freeStack:  %llx\n", (*t).top, (*t).freeStack);
-
-    return(c);
+    else
+    {
+        (*m).next=(*p).empty;
+        (*p).empty=m;
+    }
+    return;
 }
 
 
-
 //
-//  Flush the tree, de-alloc, and done.
+//  Internal method:  called when a thread exits, its magazines
+//  go back to the depot, and the record can be reused.
 //
-void AVL_destroy(AVL_TREE *t)
+void AVL_poolExit(void *x)
 {
-    AVL_flush(t);
-    AVL_dealloc(t);
-    free(t);
+    AVL_POOL_CACHE *c=(AVL_POOL_CACHE*)x;
+    AVL_POOL *p=(*c).pool;
+
+    pthread_mutex_lock(&((*p).lock));
+    AVL_poolDeposit(p, (*c).loaded);
+    AVL_poolDeposit(p, (*c).previous);
+    (*c).loaded=NULL;
+    (*c).previous=NULL;
+    (*c).used=0;
+    pthread_mutex_unlock(&((*p).lock));
     return;
 }
 
 
-
-
-/************************************************************************
- *                                                                      *
- *   Tree operations                                                    *
- *                                                                      *
- ************************************************************************/
-
-
-
 //
-//  Finding an item, based on a key, 'k'
-//  Returns pointer 'p' if found.
+//  Internal method:  the cache of the calling thread, which is set up
+//  on first use.  Returns NULL if out of memory.
 //
-void *AVL_find(AVL_TREE *t, void *k)
+AVL_POOL_CACHE *AVL_poolCache(AVL_POOL *p)
 {
-    void *d=NULL;
-    AVL_NODE *c=(*t).top;
+    AVL_POOL_CACHE *c=(AVL_POOL_CACHE*)pthread_getspecific((*p).key);
+    if (c)
+        return(c);
 
-    while (d==NULL && c!=NULL)
+    pthread_mutex_lock(&((*p).lock));
+    for (c=(*p).caches; c && (*c).used; c=(*c).next);
+    if (c==NULL)
     {
-        int e=(*t).eval((*c).d, k, (*t).user);
-        if (e==0)
-        {
-            d=(*c).d;
-            c=NULL;
-        }
-        else if (e<0)
+        c=(AVL_POOL_CACHE*)calloc(1, sizeof(AVL_POOL_CACHE));
+        if (c)
         {
-            //  Left
-            c=(*c).l;
+            (*c).pool=p;
+            (*c).next=(*p).caches;
+            (*p).caches=c;
         }
+    }
+    if (c)
+    {
+        if ((*c).loaded==NULL)
+            (*c).loaded=AVL_poolMagazine(p);
+        if ((*c).previous==NULL)
+            (*c).previous=AVL_poolMagazine(p);
+        if ((*c).loaded==NULL || (*c).previous==NULL || pthread_setspecific((*p).key, c)!=0)
+            c=NULL;
         else
-        {
-            //  Right
-            c=(*c).r;
-        }
+            (*c).used=1;
     }
-    return(d);
+    pthread_mutex_unlock(&((*p).lock));
+    return(c);
 }
 
 
 //
-//  Insertion (vol 3, pg 462, 3rd ed.)
-//  RC:
-//    0  on success
-//    1  already in tree
-//    2  unable to allocate memory
+//  Internal method:  allocates a new block for the pool.  The nodes
+//  go into full magazines in the depot, and the remainder into 'm',
+//  which is the empty, loaded magazine of the calling thread.
+//  Returns 0 on success, or 2 if out of memory.
 //
-int AVL_insert(AVL_TREE *t, void *d)
+int AVL_poolGrow(AVL_POOL *p, AVL_MAGAZINE *m)
 {
-    int rc=-1;
-    AVL_NODE *c=(*t).top;   //  Current node we're working on  (P)
-    AVL_NODE *b=(*t).top;   //  Balance node  (S)
-    AVL_NODE *p=NULL;       //  Parent of balance node  (T)
-    AVL_NODE *n=NULL;       //  The new node, if it was added.  (Q)
-
+    AVL_NODE *b=(AVL_NODE*)malloc((*p).allocAtOnce*sizeof(AVL_NODE));
+    int i=(*p).allocAtOnce;
 
-        //  Simplest case is the tree is empty:
-    if (c==NULL)
+    if (b==NULL)
+        return(2);
+    pthread_mutex_lock(&((*p).lock));
+    if ((*p).nblocks==(*p).maxBlocks)
     {
-        c=AVL_newNode(t);
-        if (c)
+        int max=((*p).maxBlocks>0 ? 2*(*p).maxBlocks : 16);
+        AVL_NODE **x=(AVL_NODE**)realloc((*p).blocks, max*sizeof(AVL_NODE*));
+        if (x==NULL)
         {
-            (*c).d=d;
-            (*t).top=c;
-            (*t).height=1;
-            rc=0;
+            pthread_mutex_unlock(&((*p).lock));
+            free(b);
+            return(2);
         }
-        else
-            rc=2;
+        (*p).blocks=x;
+        (*p).maxBlocks=max;
     }
+    (*p).blocks[(*p).nblocks]=b;
+    (*p).nblocks+=1;
 
-        //  If the tree is not empty, search for a spot
-        //  (Note that rc!=-1 if the tree was empty)
-    while (rc==-1/* && c!=NULL*/)
+    //  Pushing from the back hands out the nodes in address order:
+    while (i>AVL_POOL_MAG)
     {
-        //  Compare (A2)
-        int e=(*t).eval((*c).d, d, (*t).user);
-        if (e==0)
+        AVL_MAGAZINE *x=AVL_poolMagazine(p);
+        if (x==NULL)
+            break;
+        while ((*x).n<AVL_POOL_MAG)
         {
-            rc=1;
+            i-=1;
+            AVL_clrflags(&(b[i]));
+            b[i].r=(*x).nodes;
+            (*x).nodes=&(b[i]);
+            (*x).n+=1;
         }
-        else if (e<0)
+        AVL_poolDeposit(p, x);
+    }
+    pthread_mutex_unlock(&((*p).lock));
+
+    //  Without spare magazines, 'm' simply holds more:
+    while (i>0)
+    {
+        i-=1;
+        AVL_clrflags(&(b[i]));
+        b[i].r=(*m).nodes;
+        (*m).nodes=&(b[i]);
+        (*m).n+=1;
+    }
+    return(0);
+}
+
+
+//
+//  Internal method:  takes a free node from the pool.  Only goes to
+//  the depot when both magazines of the thread are empty.
+//  Returns NULL if out of memory.
+//
+AVL_NODE *AVL_poolGet(AVL_POOL *p)
+{
+    AVL_POOL_CACHE *c=AVL_poolCache(p);
+    AVL_MAGAZINE *m;
+    AVL_NODE *n;
+
+    if (c==NULL)
+        return(NULL);
+    if ((*(*c).loaded).n==0)
+    {
+        if ((*(*c).previous).n>0)
         {
-            //  Left (A3):  if there's a node, we traverse down
-            //  If there's nothing there, we add:
-            if ((*c).l)
-            {
-                //  Move left, record the balance info
-                if (AVL_getbal((*(*c).l).f)!=0)
-                {
-                    b=(*c).l;
-                    p=c;
-                }
-                c=(*c).l;
-            }
-            else
-            {
-                //  Add a node to the left. (A5)
-                n=AVL_newNode(t);
-                if (n)
-                {
-                    //  Successfully added:
-                    (*n).d=d;
-                    (*c).l=n;
-                    rc=0;
-                }
-                else
-                    rc=2;
-            }
+            m=(*c).loaded;
+            (*c).loaded=(*c).previous;
+            (*c).previous=m;
         }
         else
         {
-            //  Right (A4):  same deal.
-            if ((*c).r)
-            {
-                //  Move right, record the balance info
-                if (AVL_getbal((*(*c).r).f)!=0)
-                {
-                    b=(*c).r;
-                    p=c;
-                }
-                c=(*c).r;
-            }
-            else
+            //  Trade the empty one for a full one from the depot:
+            pthread_mutex_lock(&((*p).lock));
+            m=(*p).full;
+            if (m)
             {
-                //  Add a node to the right. (A5)
-                n=AVL_newNode(t);
-                if (n)
-                {
-                    //  Successfully added:
-                    (*n).d=d;
-                    (*c).r=n;
-                    rc=0;
-                }
-                else
-                    rc=2;
+                (*p).full=(*m).next;
+                AVL_poolDeposit(p, (*c).previous);
+                (*c).previous=(*c).loaded;
+                (*c).loaded=m;
             }
+            pthread_mutex_unlock(&((*p).lock));
+            if (m==NULL && AVL_poolGrow(p, (*c).loaded)!=0)
+                return(NULL);
         }
     }
+    m=(*c).loaded;
+    n=(*m).nodes;
+    (*m).nodes=AVL_right(n);
+    (*m).n-=1;
+    return(n);
+}
 
-        //  If a new node was added, now the balance
-        //  must be checked and corrected
-    if (n)
-    {
-        AVL_NODE *r=NULL;       //  Rebalance point (R)
-        int a;                  //  Off-balance angle
-        int e;
 
-        // Setting the balance factors (A6)
-        e=(*t).eval((*b).d, d, (*t).user);
-        if (e<0) 
+//
+//  Internal method:  returns a free node to the pool.  Only goes to
+//  the depot when both magazines of the thread are full.
+//
+void AVL_poolPut(AVL_POOL *p, AVL_NODE *n)
+{
+    AVL_POOL_CACHE *c=AVL_poolCache(p);
+    AVL_MAGAZINE *m;
+
+    if (c==NULL)
+    {
+        //  Out of memory for a cache:  the node stays
+        //  unused in its block until the pool is destroyed.
+        return;
+    }
+    if ((*(*c).loaded).n>=AVL_POOL_MAG)
+    {
+        if ((*(*c).previous).n==0)
         {
-            a=-1;
-            r=(*b).l;
+            m=(*c).loaded;
+            (*c).loaded=(*c).previous;
+            (*c).previous=m;
         }
         else
         {
-            a=1;
-            r=(*b).r;
-        }
-        c=r;
-
-        //  Run down from the rotate node to the new one 'n',
-        //  updating all balances (currently all 'in-balance'):
-        while (c!=n)
-        {
-            //  These duplicate prior eval calls, unfortunately:
-            //  (Optionally, these evaluations could be made 16 bit and
-            //   temporarily stored in the free bits in AVL_NODE)
-            e=(*t).eval((*c).d, d, (*t).user);
-            if (e<0)
-            {
-                AVL_setbal((*c).f,-1);
-                c=(*c).l;
-            }
-            else
+            //  Trade the full one for an empty one from the depot:
+            pthread_mutex_lock(&((*p).lock));
+            m=AVL_poolMagazine(p);
+            if (m)
             {
-                AVL_setbal((*c).f,+1);
-                c=(*c).r;
+                AVL_poolDeposit(p, (*c).previous);
+                (*c).previous=(*c).loaded;
+                (*c).loaded=m;
             }
+            pthread_mutex_unlock(&((*p).lock));
         }
+    }
+    m=(*c).loaded;
+    AVL_setRight(n, (*m).nodes);
+    (*m).nodes=n;
+    (*m).n+=1;
+    return;
+}
 
-        //  Test the condition of the tree:
-        if (AVL_getbal((*b).f)==0)
-        {
-            //  (A7.i) Tree is now 1 level deeper/higher
-            AVL_setbal((*b).f,a);
-            (*t).height+=1;
-            //  Done.
-        }
-        else if (AVL_getbal((*b).f)==-a)
-        {
-            //  (A7.ii) Now the tree is more balanced:
-            AVL_setbal((*b).f,0);
-            //  Done.
-        }
-        else  //  (AVL_getbal((*b).f)==a)
-        {
-            //  (A7.iii) Rebalancing is required:
-            if (AVL_getbal((*r).f)==a)
-            {
-                //  This is a single rotation (A8)
-                c=r;
-                if (a==-1)
-                {
-                    (*b).l=(*r).r;
-                    (*r).r=b;
-                }
-                else
-                {
-                    (*b).r=(*r).l;
-                    (*r).l=b;
-                }
-
-                //  Balances:
-                AVL_setbal((*b).f,0);
-                AVL_setbal((*r).f,0);
-            }
-            else    //  balance of rotate node is -a
-            {
-                //  This is the double rotation (A9)
-                if (a==-1)
-                {
-                    c=(*r).r;
-                    (*r).r=(*c).l;
-                    (*c).l=r;
-                    (*b).l=(*c).r;
-                    (*c).r=b;
-                }
-                else
-                {
-                    c=(*r).l;
-                    (*r).l=(*c).r;
-                    (*c).r=r;
-                    (*b).r=(*c).l;
-                    (*c).l=b;
-                }
 
-                //  Balances:
-                if (AVL_getbal((*c).f)==a)
-                {
-                    AVL_setbal((*b).f,-a);
-                    AVL_setbal((*r).f,0);
-                }
-                else if (AVL_getbal((*c).f)==0)
-                {
-                    AVL_setbal((*b).f,0);
-                    AVL_setbal((*r).f,0);
-                }
-                else  //  AVL_getbal((*c).f)==-a
-                {
-                    AVL_setbal((*b).f,0);
-                    AVL_setbal((*r).f,a);
-                }
-                AVL_setbal((*c).f,0);
-             }
+//
+//  Frees all of the pool.  No tree may be left, and no
+//  other thread may be using it.
+//
+void AVL_destroyPool(AVL_POOL *p)
+{
+    AVL_POOL_CACHE *c;
+    AVL_MAGAZINE *m;
+    int i;
 
-            //  Finally, touch up the top of the tree (A10)
-            if (p)
-            {
-                if ((*p).l==b)
-                    (*p).l=c;
-                else
-                    (*p).r=c;
-            }
-            else
-            {
-                (*t).top=c;
-            }
-        }
+    pthread_key_delete((*p).key);
+    while ((c=(*p).caches)!=NULL)
+    {
+        (*p).caches=(*c).next;
+        if ((*c).loaded)
+            free((*c).loaded);
+        if ((*c).previous)
+            free((*c).previous);
+        free(c);
+    }
+    while ((m=(*p).full)!=NULL)
+    {
+        (*p).full=(*m).next;
+        free(m);
+    }
+    while ((m=(*p).empty)!=NULL)
+    {
+        (*p).empty=(*m).next;
+        free(m);
     }
+    for (i=0; i<(*p).nblocks; i+=1)
+        free((*p).blocks[i]);
+    if ((*p).blocks)
+        free((*p).blocks);
+    pthread_mutex_destroy(&((*p).lock));
+    free(p);
+    return;
+}
 
-    return(rc);
+//
+//  Internal methods for the block lists of an allocation set,
+//  which are doubly linked so a block can leave from anywhere.
+//
+void AVL_blockUnlink(AVL_BLOCK **list, AVL_BLOCK *b)
+{
+    if ((*b).prev)
+        (*(*b).prev).next=(*b).next;
+    else
+        *list=(*b).next;
+    if ((*b).next)
+        (*(*b).next).prev=(*b).prev;
+    (*b).prev=NULL;
+    (*b).next=NULL;
+    return;
 }
 
+void AVL_blockPush(AVL_BLOCK **list, AVL_BLOCK *b)
+{
+    (*b).prev=NULL;
+    (*b).next=*list;
+    if (*list)
+        (**list).prev=b;
+    *list=b;
+    return;
+}
 
 
 //
-//  Deletion.
-//  Rebalances the tree after deleting a node.
-//  Returns:
-//    NULL - node was not found in the tree.
-//    data - the data pointer originally given upon insert.
+//  Internal method:  the list a block with 'u' nodes in use belongs on.
+//  Empty blocks are on 'empty', partly used ones on the 'partial' list of
+//  their occupancy, and full ones on none (NULL).
 //
-//  Notes on general algorithm:
-//   Find the node that needs to be deleted, if it has 2 children, then  
-//   recurse down and find the closest in-order successor/predecessor.  This is
-//   necessarily a node all the way down, but _might_ have a single child. 
-//   Swap this node from the bottom of the tree into the slot of the node that
-//   is about to be deleted.
-//   At this point an inbalance may have occurred, that needs to be rectified.
-//   Unfortunately, it might completely unbalance the tree to the root, and
-//   all balances must be checked, rotating until the root is balanced.  Rotations
-//   are analogous to the insertion case.
-//   Identical to the 'walk' method below a stack is kept of the path in the
-//   tree from the root to the node to be deleted.
-//   Delete returns the 'data' pointer '(*n).d', or NULL if not found.
-//   
-void *AVL_delete(AVL_TREE *t, void *k)
+AVL_BLOCK **AVL_blockList(AVL_TREE *a, int u)
 {
-    AVL_NODE *c, *p;
-    AVL_NODE *stack[AVL_MAX_DEPTH];
-    void *d;
-    int top;
-    int h=0;        //  Tracks if the tree is getting shorter.
-
-    //  No root, no need:
-    if ((*t).top==NULL)
+    if (u==0)
+        return(&((*a).empty));
+    if (u==(*a).allocAtOnce)
         return(NULL);
+    return(&((*a).partial[(long)u*AVL_ALLOC_BUCKETS/(*a).allocAtOnce]));
+}
 
 
-    //
-    //  Record the path to the node to be deleted:
-    //
-    top=0;
-    c=(*t).top;
-    d=NULL;     //  The 'data' pointer
-    p=NULL;     //  Parent
+//
+//  Internal method:  moves block 'b', that had 'u' nodes in use,
+//  to the list of its current occupancy.
+//
+void AVL_blockMove(AVL_TREE *a, AVL_BLOCK *b, int u)
+{
+    AVL_BLOCK **from=AVL_blockList(a, u);
+    AVL_BLOCK **to=AVL_blockList(a, (*b).used);
 
-    while (d==NULL && c!=NULL && top<AVL_MAX_DEPTH)
-    {
-        int e;
+    if (from==to)
+        return;
+    if (from)
+        AVL_blockUnlink(from, b);
+    if (to)
+        AVL_blockPush(to, b);
+    if (u==0)
+        (*a).emptyBlocks-=1;
+    if ((*b).used==0)
+        (*a).emptyBlocks+=1;
+    return;
+}
 
-        //  This way the last item on the stack can never be NULL
-        //  'top' is only updated in case e!=0, so that the deleted
-        //  node 'c' is technically never top-of-stack.
-        stack[top]=c;
 
-        //  Left, right, or found.
-        e=(*t).eval((*c).d, k, (*t).user);
-        if (e==0)
-            d=(*c).d;
-        else if (e<0)
-        {
-            p=c;
-            c=(*c).l;
-            top+=1;
-        }
-        else
+//
+//  Internal method:  allocates a block for allocation set 'a', with its
+//  free list in address order, and puts it on the 'empty' list.
+//  Returns NULL if out of memory.
+//
+AVL_BLOCK *AVL_newBlock(AVL_TREE *a)
+{
+    AVL_BLOCK *b;
+    int i;
+
+#ifndef AVL_TAGGED_NODE
+    b=(AVL_BLOCK*)malloc(sizeof(AVL_BLOCK)+(*a).allocAtOnce*sizeof(AVL_NODE));
+#else
+    if (posix_memalign((void**)&b, (*a).blockSize, (*a).blockSize)!=0)
+        b=NULL;
+#endif
+
+    if (b)
+    {
+        //fprintf(stderr, "ALLOC: %llx\n", (long long int) b);
+        (*b).free=NULL;
+        (*b).used=0;
+        (*b).run=0;
+        for (i=(*a).allocAtOnce-1; i>=0; i-=1)
         {
-            p=c;
-            c=(*c).r;
-            top+=1;
+            AVL_clrflags(&((*b).n[i]));
+#ifndef AVL_TAGGED_NODE
+            (*b).n[i].b=i;
+#endif
+            (*b).n[i].r=(*b).free;
+            (*b).free=&((*b).n[i]);
         }
+        AVL_blockPush(&((*a).empty), b);
+        (*a).emptyBlocks+=1;
+        (*a).blocks+=1;
     }
+    return(b);
+}
 
-    //  At this point, if no 'd' was found, the item is not in the tree:
-    if (d==NULL)
-        return(d);
 
-    //
-    //  At this point, 'c' points to the node that is to be deleted.
-    //  If there is only a single subtree, replace 'c' with that tree,
-    //  no replacement node needs to be found:
-    //
-    if ((*c).l==NULL || (*c).r==NULL)
+//
+//  Internal method:  takes the next free node of block 'b', which must
+//  have one, and moves the block to the list of its new occupancy.
+//
+AVL_NODE *AVL_blockTake(AVL_TREE *a, AVL_BLOCK *b)
+{
+    AVL_NODE *n=(*b).free;
+
+    (*b).free=AVL_right(n);
+    (*b).used+=1;
+    (*a).used+=1;
+    AVL_blockMove(a, b, (*b).used-1);
+    return(n);
+}
+
+
+//
+//  Internal method:  picks the block with a free node that the policy of
+//  allocation set 'a' prefers, for a new node under 'near' (may be NULL).
+//  Falls back to the fullest block, and then an empty one.  Returns NULL if
+//  every block is full.
+//
+AVL_BLOCK *AVL_blockPick(AVL_TREE *a, AVL_NODE *near)
+{
+    AVL_BLOCK *b=NULL;
+    int i;
+
+    if ((*a).policy==AVL_ALLOC_PARENT && near)
+        b=AVL_blockOf(a, near);
+    else if ((*a).policy==AVL_ALLOC_RECENT)
+        b=(*a).recent;
+    if (b && (*b).free)
+        return(b);
+
+    for (i=AVL_ALLOC_BUCKETS-1; i>=0; i-=1)
     {
-        AVL_NODE *s=(*c).l;     //  Left subtree.
-        if (s==NULL)
-            s=(*c).r;           //  Right subtree.
+        if ((*a).partial[i])
+            return((*a).partial[i]);
+    }
+    return((*a).empty);
+}
 
-        //  If there is a previous
-        if (p)
-        {
-            //  Was 'c' the left or right child?
-            if ((*p).l==c)
-            {
-                //  The tree is getting shorter on the left:
-                (*p).l=s;
-                AVL_incbal((*p).f);
-            }
-            else
-            {
-                //  The tree is getting shorter on the right:
-                (*p).r=s;
-                AVL_decbal((*p).f);
-            }
-            //  Important, did the total tree get shorter?
-            //  This happens when the tree is now balanced (from -1 or +1):
-            if (AVL_getbal((*p).f)==0)
-                h=-1;
-        }
-        else
-        {
-            //  'c' is the top
-            //  Remember that the tree has become less tall, but
-            //  the balance under 's' is already correct:
-            (*t).top=s;
-            h=-1;
-        }
+
+//
+//  Internal method:  frees empty blocks of allocation set 'a' until
+//  'keep' are left.  Returns the number of nodes freed.
+//
+int AVL_releaseBlocks(AVL_TREE *a, int keep)
+{
+    int c=0;
+    while ((*a).emptyBlocks>keep)
+    {
+        AVL_BLOCK *b=(*a).empty;
+        AVL_blockUnlink(&((*a).empty), b);
+        if ((*a).recent==b)
+            (*a).recent=NULL;
+        (*a).emptyBlocks-=1;
+        (*a).blocks-=1;
+        c+=(*a).allocAtOnce;
+        //fprintf(stderr, "DE-ALLOC: %llx\n", (long long int) b);
+        free(b);
     }
+    return(c);
+}
+
+
+//
+//  Internal method:  applies the automatic release thresholds of 'a',
+//  unless they are on hold.
+//
+void AVL_trimBlocks(AVL_TREE *a)
+{
+    if ((*a).releaseHigh>=0 && (*a).emptyBlocks>(*a).releaseHigh && (*a).hold==0)
+        AVL_releaseBlocks(a, (*a).releaseLow);
+    return;
+}
+
+
+//
+//  Internal method:  puts a free node back in its block, which moves to
+//  the list of its new occupancy.  A block that empties goes on the
+//  'empty' list, where automatic release may pick it up.
+//
+void AVL_blockFree(AVL_TREE *a, AVL_NODE *n)
+{
+    AVL_BLOCK *b=AVL_blockOf(a, n);
+
+    AVL_setRight(n, (*b).free);
+    (*b).free=n;
+    (*b).used-=1;
+    (*a).used-=1;
+    AVL_blockMove(a, b, (*b).used+1);
+    (*a).recent=b;
+    if ((*b).used==0)
+        AVL_trimBlocks(a);
+    return;
+}
+
+
+//
+//  Internal method:  returns node 'n' to its block, or to the pool.
+//
+void AVL_releaseNode(AVL_TREE *t, AVL_NODE *n)
+{
+    AVL_TREE *a=(*t).alloc;
+
+    AVL_clrbit(n, AVL_FLG_USD);
+    AVL_store((*n).d, NULL);
+    AVL_store((*n).l, NULL);
+    if ((*a).pool)
+        AVL_poolPut((*a).pool, n);
     else
-    {
-        //
-        //  Find the in-order predecessor or successor.
-        //  Make the decision based on where the balance sits, so
-        //  the tree becomes 'more' balanced, potentially avoiding
-        //  additional balancing rotations.
-        //  
-        //  The process is straight forward: if the balance is positive
-        //  ((*c).r is deeper), then go right once, and continue going left
-        //  until there is no further left.  At this point the in-order
-        //  successor has been found, but might have a right subnode still.
-        //
-        int cpos=top;       //  Remember where in the stack 'c' is located
-        AVL_NODE *sc=c;     //  This is the actual node we're going to delete, saved.
-        AVL_NODE *sp=p;     //  And the parent, also saved.
-        AVL_NODE *s=NULL;   //  The in-order neighbor may still have a subtree on the other side.
+        AVL_blockFree(a, n);
+    return;
+}
 
-        //  'c' is already saved at 'stack[top]', move one up:
-        top+=1;
-        p=c;
 
-        if (AVL_getbal((*c).f)>0)
-        {
-            //  Right-hand side is taller, grab the in-order successor
-            c=(*c).r;
-            while ((*c).l && top<AVL_MAX_DEPTH)
-            {
-                stack[top]=c;
-                p=c;
-                c=(*c).l;
-                top+=1;
-            }
-            //  Save potentially a subtree still on the right:
-            s=(*c).r;
-        }
-        else
-        {
-            //  Left-hand side is taller, grab the in-order precursor
-            c=(*c).l;
-            while ((*c).r && top<AVL_MAX_DEPTH)
-            {
-                stack[top]=c;
-                p=c;
-                c=(*c).r;
-                top+=1;
-            }
-            //  Save potentially a subtree still on the left:
-            s=(*c).l;
-        }
+//
+//  Internal method:  moves the global epoch forward if every reader inside
+//  the tree has seen the current one.  The limbo of two epochs ago can
+//  then no longer be reached by anyone, and goes back to the blocks.
+//  Returns 1 if the epoch advanced.
+//
+int AVL_epochAdvance(AVL_TREE *t)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    AVL_READER *r;
+    unsigned long g=(*e).epoch;
+    int i=(g+2)%3;
 
-        //  At this point 'c' points to the inorder sucessor/precursor, and is
-        //  the node that is going to be put in position of 'sc'.  Any eventual
-        //  subtrees (in 's') can be put in place of 'c', carving 'c' out of the
-        //  tree.  Now 'p' again points to the parent of 'c', and needs a balance
-        //  update:  specifically, if 'c' was on the left of the parent, then the
-        //  balance is now more to the right, so it is incremented, and vice versa.
-        //
-        //  In this case, 'p' always exists, because the case where the deleted node
-        //  was at the top of the tree was already handled above.  It is possible that
-        //  'p' is pointing at 'sc', which is not a problem.  Note that 's' is 50/50
-        //  change of being NULL, which does not matter.
-        if ((*p).l==c)
-        {
-            (*p).l=s;
-            AVL_incbal((*p).f);   //  Tree under 'p' got shorter on the left
-        }
-        else
-        {
-            (*p).r=s;
-            AVL_decbal((*p).f);   //  Tree under 'p' got shorter on the right
-        }
-        //  If 'p' became 'more' balanced (ie. went to 0), then the tree actually
-        //  got shorter:
-        if (AVL_getbal((*p).f)==0)
-            h=-1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r=__atomic_load_n(&((*e).readers), __ATOMIC_ACQUIRE); r; r=(*r).next)
+    {
+        unsigned long v=__atomic_load_n(&((*r).epoch), __ATOMIC_SEQ_CST);
+        if (v!=0 && v!=g)
+            return(0);
+    }
+    __atomic_store_n(&((*e).epoch), g+1, __ATOMIC_SEQ_CST);
 
-        //  'c' is going to be swapped into place of 'sc', before 'sc' is discarded.
-        //  The balance is copied, and the pointers connected.
-        (*c).l=(*sc).l;
-        (*c).r=(*sc).r;
-        AVL_setbal((*c).f, AVL_getbal((*sc).f));
-        //  Parent connections:
-        if (sp==NULL)
-            (*t).top=c;
-        else if ((*sp).l==sc)
-            (*sp).l=c;
-        else
-            (*sp).r=c;
-        //  Ensure that 'c' is in the path instead of 'sc':
-        stack[cpos]=c;
+    while ((*e).count[i]>0)
+    {
+        (*e).count[i]-=1;
+        AVL_releaseNode(t, (*e).limbo[i][(*e).count[i]]);
+        (*e).pending-=1;
+    }
+    return(1);
+}
+
+
+//
+//  Internal method to get a new node.  Sometimes we need a new node
+//  and there are none, and we need to allocate a pile.
+//  Note:  this is an internal method, and always expects 't' to exist
+//
+//  'near' is the node the new one will hang under, if known, for
+//  the AVL_ALLOC_PARENT policy.
+//
+AVL_NODE *AVL_newNodeNear(AVL_TREE *t, AVL_NODE *near)
+{
+    AVL_NODE *n;
+    AVL_TREE *a=(*t).alloc;     //  Owner of the allocation set
 
-        //  Make sure that 'c' (which is to be deleted), is now again correctly
-        //  pointing to the node that was taken out of the tree, ie. 'sc'
-        c=sc;
+    //  Pooled trees take their nodes from the cache of the thread:
+    if ((*a).pool)
+        n=AVL_poolGet((*a).pool);
+    else
+    {
+        AVL_BLOCK *b;
+
+        //  In concurrent mode, try to recycle what is in limbo
+        //  before allocating a new block:
+        b=AVL_blockPick(a, near);
+        if (b==NULL && (*t).epoch!=NULL && (*(*t).epoch).pending>0 && AVL_epochAdvance(t))
+            b=AVL_blockPick(a, near);
+        if (b==NULL)
+            b=AVL_newBlock(a);
+
+        //  Note:  if allocation failed, n will be NULL 
+        n=NULL;
+        if (b)
+            n=AVL_blockTake(a, b);
+    }
+    if (n)
+    {
+        AVL_store((*n).l, NULL);
+        AVL_store((*n).r, NULL);
+        AVL_store((*n).d, NULL);
+        AVL_setbal(n,0);
+        AVL_setbit(n,AVL_FLG_USD);
+#ifdef AVL_ORDER_STAT
+        (*n).s=1;
+#endif
+        (*t).size+=1;
     }
+    return(n);
+}
 
+AVL_NODE *AVL_newNode(AVL_TREE *t)
+{
+    return(AVL_newNodeNear(t, NULL));
+}
 
-    //
-    //  At this point 'c' is out of the tree, and 'd' has been saved.
-    //
-    AVL_clrbit((*c).f, AVL_FLG_USD);
-    (*c).d=NULL;
-    (*c).l=NULL;
-    (*c).r=(*t).freeStack;
-    (*t).freeStack=c;
-    (*t).size-=1;
-    c=NULL;
 
-    //
-    //  Rebalance:
-    //   The position in the stack points to either: 1) the node that was taken
+//
+//  Internal method to return a node to its block.  The
+//  caller must have taken it out of the tree already.
+//  In concurrent mode a reader may still be on it, so it is retired into
+//  limbo instead, with its data and subtrees left intact.
+//
+void AVL_freeNode(AVL_TREE *t, AVL_NODE *n)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    (*t).size-=1;
+    if (e)
+    {
+        int i=(*e).epoch%3;
+        if ((*e).count[i]==(*e).max[i])
+        {
+            int m=((*e).max[i]>0 ? 2*(*e).max[i] : (*(*t).alloc).allocAtOnce);
+            AVL_NODE **l=(AVL_NODE**)realloc((*e).limbo[i], m*sizeof(AVL_NODE*));
+            if (l==NULL)
+            {
+                //  No room in limbo:  once the readers inside now have
+                //  left, none can reach 'n' anymore.
+                AVL_synchronize(t);
+                AVL_releaseNode(t, n);
+                return;
+            }
+            (*e).limbo[i]=l;
+            (*e).max[i]=m;
+        }
+        (*e).limbo[i][(*e).count[i]]=n;
+        (*e).count[i]+=1;
+        (*e).pending+=1;
+        if ((*e).pending>=(*(*t).alloc).allocAtOnce)
+            AVL_epochAdvance(t);
+        return;
+    }
+    AVL_releaseNode(t, n);
+    return;
+}
+
+
+//
+//  Internal method, concurrent mode:  sets aside nodes for the copies of
+//  a rotation (see 'copyNode'), the two that the largest one needs.
+//  Returns 0 on success, or 2 if out of memory.
+//
+int AVL_reserve(AVL_TREE *t)
+{
+    AVL_EPOCH *e=(*t).epoch;
+
+    while ((*e).spares<2)
+    {
+        AVL_NODE *n=AVL_newNode(t);
+        if (n==NULL)
+            return(2);
+        (*t).size-=1;
+        (*e).spare[(*e).spares]=n;
+        (*e).spares+=1;
+    }
+    return(0);
+}
+
+
+//
+//  Internal method, concurrent mode:  a copy of node 'x', for a rotation
+//  to rewire instead of 'x' itself, which readers may be on.  The copy is
+//  only reached once the rotation links it in, after which the caller
+//  retires 'x'.
+//
+//  Copies come from the spare nodes.  An insert sets two aside before it
+//  starts (a rotation copies one or two nodes), and a delete that runs
+//  out finds that every rotation so far retired as many nodes as it
+//  copied, and the delete retired one more:  once the readers let go of
+//  them, there are always enough.
+//
+AVL_NODE *AVL_copyNode(AVL_TREE *t, AVL_NODE *x)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    AVL_NODE *y;
+
+    if ((*e).spares>0)
+    {
+        (*e).spares-=1;
+        y=(*e).spare[(*e).spares];
+        (*t).size+=1;
+    }
+    else
+    {
+        //  The blocks are kept while the retired nodes go back to them:
+        (*(*t).alloc).hold+=1;
+        while ((y=AVL_newNode(t))==NULL)
+            AVL_synchronize(t);
+        (*(*t).alloc).hold-=1;
+    }
+
+    AVL_store((*y).l, (*x).l);
+    AVL_store((*y).r, (*x).r);
+    AVL_store((*y).d, (*x).d);
+#ifndef AVL_TAGGED_NODE
+    (*y).f=(*x).f;
+#endif
+#ifdef AVL_ORDER_STAT
+    (*y).s=(*x).s;
+#endif
+#ifdef AVL_KEY_PREFIX
+    (*y).k=(*x).k;
+#endif
+    if ((*t).first==x)
+        (*t).first=y;
+    if ((*t).last==x)
+        (*t).last=y;
+    return(y);
+}
+
+
+//
+//  Internal method:  finds 'first' and 'last' again, in O(log n).  Insert
+//  and delete keep them up to date as they go, everything else that
+//  changes the tree calls this before it is done.
+//
+void AVL_resetEnds(AVL_TREE *t)
+{
+    AVL_NODE *c;
+
+    c=(*t).top;
+    while (c && AVL_left(c))
+        c=AVL_left(c);
+    (*t).first=c;
+    c=(*t).top;
+    while (c && AVL_right(c))
+        c=AVL_right(c);
+    (*t).last=c;
+    return;
+}
+
+//
+//  Internal method:  returns all the nodes under 'n' to their blocks.  The
+//  caller must have taken them out of the tree already.  The nodes are
+//  left as they are, as in concurrent mode readers may still be among
+//  them.  Pushing the right and then the left child keeps the stack within
+//  the height.
+//
+void AVL_freeNodes(AVL_TREE *t, AVL_NODE *n)
+{
+    AVL_NODE *stack[AVL_MAX_DEPTH+1];
+    int top=0;
+
+        //  Obvious empty tree case:
+    if (n==NULL) return;
+
+        //  Top goes on the stack:
+    stack[top]=n;
+    top+=1;
+    while (top>0)
+    {
+        //  Take the children before the node goes:
+        top-=1;
+        n=stack[top];
+        if (AVL_right(n))
+        {
+            stack[top]=AVL_right(n);
+            top+=1;
+        }
+        if (AVL_left(n))
+        {
+            stack[top]=AVL_left(n);
+            top+=1;
+        }
+        AVL_freeNode(t, n);
+    }
+    return;
+}
+
+
+//
+//  Breaks down the tree and returns all of them to their blocks:
+//
+void AVL_flush(AVL_TREE *t)
+{
+    AVL_NODE *top=(*t).top;
+
+        //  Obvious empty tree case:
+    if (top==NULL) return;
+
+        //  Readers find the tree empty before the nodes go:
+    AVL_store((*t).top, NULL);
+    AVL_freeNodes(t, top);
+    (*t).height=0;
+    (*t).size=0;
+    (*t).uncounted=0;
+    (*t).mod+=1;
+    AVL_resetEnds(t);
+    return;
+}
+
+
+//
+//  Frees all empty blocks.  Returns the number of records freed.
+//
+//  NOTE:  this method is NOT re-entreable
+//
+int AVL_dealloc(AVL_TREE *t)
+{
+    //  Trees that share an allocation set, work on the set of the owner.
+    //  Pooled nodes are only freed with the pool:
+    t=(*t).alloc;
+    if ((*t).pool)
+        return(0);
+    return(AVL_releaseBlocks(t, 0));
+}
+
+
+//
+//  Sets the thresholds for releasing empty blocks as they empty.
+//
+void AVL_autoRelease(AVL_TREE *t, int high, int low)
+{
+    t=(*t).alloc;
+    if (low<0) low=0;
+    if (high>=0 && low>high) low=high;
+    (*t).releaseHigh=high;
+    (*t).releaseLow=low;
+    AVL_trimBlocks(t);
+    return;
+}
+
+
+//
+//  Sets the block that new nodes come from.
+//
+void AVL_allocPolicy(AVL_TREE *t, int policy)
+{
+    (*(*t).alloc).policy=policy;
+    return;
+}
+
+
+//
+//  Nodes in use over nodes allocated.
+//
+double AVL_occupancy(AVL_TREE *t)
+{
+    t=(*t).alloc;
+    if ((*t).pool)
+        return(-1.0);
+    if ((*t).blocks==0)
+        return(1.0);
+    return((double)(*t).used/((double)(*t).blocks*(*t).allocAtOnce));
+}
+
+
+//
+//  Internal method:  the next block for compaction run 'run' to fill, an
+//  empty one or a new one, with its free list put back in address order so
+//  that nodes are laid out one after the other.  Returns NULL if out of
+//  memory.
+//
+AVL_BLOCK *AVL_compactBlock(AVL_TREE *a, unsigned int run)
+{
+    AVL_BLOCK *b=(*a).empty;
+    int i;
+
+    if (b==NULL)
+        b=AVL_newBlock(a);
+    else
+    {
+        (*b).free=NULL;
+        for (i=(*a).allocAtOnce-1; i>=0; i-=1)
+        {
+            (*b).n[i].r=(*b).free;
+            (*b).free=&((*b).n[i]);
+        }
+    }
+    if (b)
+        (*b).run=run;
+    return(b);
+}
+
+
+//
+//  Internal method:  makes room for 'n' more tasks on the work list.
+//  A queue (BFS) first moves its live part back to the start.
+//  Returns 2 if out of memory.
+//
+int AVL_compactReserve(AVL_COMPACT *c, int n)
+{
+    if ((*c).head>0 && (*c).tail+n>(*c).max)
+    {
+        memmove((*c).work, (*c).work+(*c).head, ((*c).tail-(*c).head)*sizeof(AVL_COMPACT_TASK));
+        (*c).tail-=(*c).head;
+        (*c).head=0;
+    }
+    if ((*c).tail+n>(*c).max)
+    {
+        int max=(*c).max*2;
+        AVL_COMPACT_TASK *w;
+        if (max<(*c).tail+n) max=(*c).tail+n;
+        w=(AVL_COMPACT_TASK*)realloc((*c).work, max*sizeof(AVL_COMPACT_TASK));
+        if (w==NULL)
+            return(2);
+        (*c).work=w;
+        (*c).max=max;
+    }
+    return(0);
+}
+
+
+//
+//  Internal methods:  add a task, and push the left spine from slot 's'
+//  down (for in-order).
+//
+void AVL_compactPush(AVL_COMPACT *c, AVL_NODE **s, int h, int d)
+{
+    AVL_COMPACT_TASK *w=&((*c).work[(*c).tail]);
+    (*w).s=s;
+    (*w).h=h;
+    (*w).d=d;
+    (*c).tail+=1;
+    return;
+}
+
+void AVL_compactSpine(AVL_COMPACT *c, AVL_NODE **s)
+{
+    for (; AVL_untag(*s); s=&((*AVL_untag(*s)).l))
+        AVL_compactPush(c, s, 0, 0);
+    return;
+}
+
+
+//
+//  Internal method:  moves the node in slot 's' to the next free node of
+//  the block being filled, and points the slot at the copy.  The old node
+//  is freed, or retired in concurrent mode.  Returns NULL if out of memory.
+//
+AVL_NODE *AVL_compactMove(AVL_TREE *t, AVL_COMPACT *c, AVL_NODE **s)
+{
+    AVL_TREE *a=(*t).alloc;
+    AVL_NODE *x=AVL_untag(*s);
+    AVL_NODE *y;
+
+    if ((*c).dest==NULL || (*(*c).dest).free==NULL)
+    {
+        (*c).dest=AVL_compactBlock(a, (*c).run);
+        if ((*c).dest==NULL)
+            return(NULL);
+    }
+    y=AVL_blockTake(a, (*c).dest);
+    AVL_store((*y).l, (*x).l);
+    AVL_store((*y).r, (*x).r);
+    AVL_store((*y).d, (*x).d);
+#ifndef AVL_TAGGED_NODE
+    (*y).f=(*x).f;
+#endif
+#ifdef AVL_ORDER_STAT
+    (*y).s=(*x).s;
+#endif
+#ifdef AVL_KEY_PREFIX
+    (*y).k=(*x).k;
+#endif
+    AVL_publish(*s, AVL_tagged(*s, y));
+    if ((*t).first==x)
+        (*t).first=y;
+    if ((*t).last==x)
+        (*t).last=y;
+
+    //  'freeNode' counts the node out of the tree, but its copy is in:
+    (*t).size+=1;
+    AVL_freeNode(t, x);
+    return(y);
+}
+
+
+//
+//  Moves the nodes of the tree into fresh blocks, in the order of
+//  'layout', visiting at most 'max' of them per call.
+//
+int AVL_compactStep(AVL_TREE *t, int layout, int max)
+{
+    AVL_COMPACT *c=(*t).compact;
+    AVL_TREE *a=(*t).alloc;
+    int visited=0;
+    int moved=0;
+    int rc=1;
+
+    if ((*a).pool)
+        return(3);
+    if (c==NULL)
+    {
+        c=(AVL_COMPACT*)calloc(1, sizeof(AVL_COMPACT));
+        if (c==NULL)
+            return(2);
+        (*t).compact=c;
+        (*c).layout=-1;
+    }
+
+    //  A new run, with a new tag for the blocks it fills:
+    if ((*c).layout!=layout)
+    {
+        (*a).runs+=1;
+        if ((*a).runs==0)
+            (*a).runs=1;
+        (*c).run=(*a).runs;
+        (*c).layout=layout;
+        (*c).mod=(*t).mod+1;
+    }
+
+    //  Starting, or starting over because the tree changed since the last
+    //  call, so that the work list may point at nodes that are gone:
+    if ((*c).mod!=(*t).mod)
+    {
+        (*c).head=0;
+        (*c).tail=0;
+        (*c).dest=NULL;
+        if (AVL_compactReserve(c, AVL_MAX_DEPTH+2))
+            return(2);
+        if (layout==AVL_LAYOUT_INORDER)
+            AVL_compactSpine(c, &((*t).top));
+        else
+            AVL_compactPush(c, &((*t).top), (*t).height, -1);
+        (*c).mod=(*t).mod;
+    }
+
+    (*a).hold+=1;
+    while ((*c).tail>(*c).head && (max<=0 || visited<max))
+    {
+        AVL_COMPACT_TASK w;
+        AVL_NODE *y;
+
+        //  Every task adds at most one spine, or two tasks:
+        if (AVL_compactReserve(c, AVL_MAX_DEPTH+2))
+        {
+            rc=2;
+            break;
+        }
+        if (layout==AVL_LAYOUT_BFS)
+        {
+            w=(*c).work[(*c).head];
+            (*c).head+=1;
+        }
+        else
+        {
+            (*c).tail-=1;
+            w=(*c).work[(*c).tail];
+        }
+        if (AVL_untag(*(w.s))==NULL)
+            continue;
+
+        //  van Emde Boas:  the top half of the levels first, then each
+        //  subtree hanging below it, both laid out the same way.  Tasks
+        //  with d>=0 go down d levels to find those subtrees:
+        if (layout==AVL_LAYOUT_VEB && w.d>=0)
+        {
+            if (w.d==0)
+                AVL_compactPush(c, w.s, w.h, -1);
+            else
+            {
+                AVL_compactPush(c, &((*AVL_untag(*(w.s))).r), w.h, w.d-1);
+                AVL_compactPush(c, &((*AVL_untag(*(w.s))).l), w.h, w.d-1);
+            }
+            continue;
+        }
+        if (layout==AVL_LAYOUT_VEB && w.h>1)
+        {
+            AVL_compactPush(c, w.s, w.h-w.h/2, w.h/2);
+            AVL_compactPush(c, w.s, w.h/2, -1);
+            continue;
+        }
+
+        //  Parents move before their children (BFS and vEB), or the left
+        //  subtree before its parent (in-order).  Either way, the slot of a
+        //  node that has yet to move is in a node that stays put until it
+        //  has.  Nodes moved before the run started over stay:
+        y=AVL_untag(*(w.s));
+        if ((*AVL_blockOf(a, y)).run!=(*c).run)
+        {
+            y=AVL_compactMove(t, c, w.s);
+            if (y==NULL)
+            {
+                (*c).tail+=(layout!=AVL_LAYOUT_BFS);
+                (*c).head-=(layout==AVL_LAYOUT_BFS);
+                rc=2;
+                break;
+            }
+            moved+=1;
+        }
+        visited+=1;
+        if (layout==AVL_LAYOUT_BFS)
+        {
+            AVL_compactPush(c, &((*y).l), 0, -1);
+            AVL_compactPush(c, &((*y).r), 0, -1);
+        }
+        else if (layout==AVL_LAYOUT_INORDER)
+            AVL_compactSpine(c, &((*y).r));
+    }
+    if (moved>0)
+        (*t).mod+=1;
+    (*a).hold-=1;
+    (*c).mod=(*t).mod;
+
+    if ((*c).tail>(*c).head)
+    {
+        AVL_trimBlocks(a);
+        return(rc);
+    }
+
+    //  Done, the old blocks are empty now, unless shared or in limbo:
+    free((*c).work);
+    free(c);
+    (*t).compact=NULL;
+    AVL_releaseBlocks(a, 0);
+    return(0);
+}
+
+
+//
+//  Moves all nodes of the tree into fresh blocks, in one go.
+//
+int AVL_compact(AVL_TREE *t, int layout)
+{
+    return(AVL_compactStep(t, layout, 0));
+}
+
+
+
+//
+//  Flush the tree, de-alloc, and done.  A tree that shares the allocation
+//  set of another only returns its nodes, the owner frees the memory.
+//
+void AVL_destroy(AVL_TREE *t)
+{
+    AVL_flush(t);
+    if ((*t).epoch)
+    {
+        //  No reader can be left, so limbo empties after three epochs:
+        AVL_EPOCH *e=(*t).epoch;
+        AVL_READER *r;
+        int i;
+        while ((*e).pending>0)
+            AVL_epochAdvance(t);
+        for (i=0; i<3; i+=1)
+            free((*e).limbo[i]);
+        while ((*e).spares>0)
+        {
+            (*e).spares-=1;
+            AVL_releaseNode(t, (*e).spare[(*e).spares]);
+        }
+        while ((r=(*e).readers)!=NULL)
+        {
+            (*e).readers=(*r).next;
+            free(r);
+        }
+        free(e);
+        (*t).epoch=NULL;
+    }
+    if ((*t).compact)
+    {
+        free((*(*t).compact).work);
+        free((*t).compact);
+    }
+    if ((*t).alloc==t)
+        AVL_dealloc(t);
+    free(t);
+    return;
+}
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Tree operations                                                    *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Finding an item, based on a key, 'k'
+//  Returns pointer 'p' if found.
+//
+void *AVL_find(AVL_TREE *t, void *k)
+{
+    void *d=NULL;
+    AVL_NODE *c=(*t).top;
+    uint32_t pk=AVL_prefixOf(t, k);
+
+    while (d==NULL && c!=NULL)
+    {
+        int e=AVL_cmp(t, c, k, pk);
+        if (e==0)
+        {
+            d=(*c).d;
+            c=NULL;
+        }
+        else if (e<0)
+        {
+            //  Left
+            c=AVL_left(c);
+        }
+        else
+        {
+            //  Right
+            c=AVL_right(c);
+        }
+    }
+    return(d);
+}
+
+
+//
+//  Finding many items at once.  Up to AVL_FIND_GROUP searches are in
+//  flight, and each takes one step in turn:  a step that moves to a child
+//  prefetches it, and goes on to the next search while it comes in.  The
+//  cache misses of the different searches then overlap, instead of each
+//  one waiting for the last.  A search that ends starts on the next key.
+//
+//  'slot[g]' is the index of the key that search 'g' is after, or <0 when
+//  there are no keys left for it.
+//
+#ifndef AVL_FIND_GROUP
+#define AVL_FIND_GROUP 16
+#endif
+int AVL_findMany(AVL_TREE *t, void **keys, int n, void **out)
+{
+    AVL_NODE *c[AVL_FIND_GROUP];
+    uint32_t pk[AVL_FIND_GROUP];
+    int slot[AVL_FIND_GROUP];
+    int next=0;
+    int live=0;
+    int found=0;
+    int g;
+
+    for (g=0; g<AVL_FIND_GROUP; g+=1)
+    {
+        slot[g]=-1;
+        if (next<n)
+        {
+            slot[g]=next;
+            pk[g]=AVL_prefixOf(t, keys[next]);
+            c[g]=(*t).top;
+            next+=1;
+            live+=1;
+        }
+    }
+
+    while (live>0)
+    {
+        for (g=0; g<AVL_FIND_GROUP; g+=1)
+        {
+            int e=1;
+
+            if (slot[g]<0)
+                continue;
+            if (c[g]!=NULL)
+            {
+                e=AVL_cmp(t, c[g], keys[slot[g]], pk[g]);
+                if (e!=0)
+                {
+                    c[g]=(e<0 ? AVL_left(c[g]) : AVL_right(c[g]));
+                    if (c[g]!=NULL)
+                    {
+                        __builtin_prefetch(c[g]);
+                        continue;
+                    }
+                }
+            }
+
+            //  Done, found or not, and on to the next key:
+            out[slot[g]]=(e==0 ? (*(c[g])).d : NULL);
+            found+=(e==0);
+            slot[g]=-1;
+            live-=1;
+            if (next<n)
+            {
+                slot[g]=next;
+                pk[g]=AVL_prefixOf(t, keys[next]);
+                c[g]=(*t).top;
+                next+=1;
+                live+=1;
+            }
+        }
+    }
+    return(found);
+}
+
+
+//
+//  Internal method:  looks up the sorted keys[lo..hi-1] under node 'c'.
+//  A binary search of the keys against 'c' splits them into those that go
+//  left and those that go right, and only the sides with keys left are
+//  searched.  For 'm' keys that is about log2(m)+2 comparisons at a node,
+//  rather than one per key, for O(k log(n/k+1)) over the whole batch.
+//  Returns the number of keys found.
+//
+int AVL_findSortedNodes(AVL_TREE *t, AVL_NODE *c, void **keys, void **out, int lo, int hi)
+{
+    int found=0;
+
+    while (c!=NULL && lo<hi)
+    {
+        int a=lo;
+        int b=hi;
+        int e=-1;
+
+        //  One key left:  an ordinary search from here
+        if (hi-lo==1)
+        {
+            e=(*t).eval((*c).d, keys[lo], (*t).user);
+            if (e==0)
+            {
+                out[lo]=(*c).d;
+                return(found+1);
+            }
+            c=(e<0 ? AVL_left(c) : AVL_right(c));
+            continue;
+        }
+
+        //  The first key that is not smaller than 'c' is 'a':
+        while (a<b)
+        {
+            int m=a+(b-a)/2;
+            if ((*t).eval((*c).d, keys[m], (*t).user)<0)
+                a=m+1;
+            else
+                b=m;
+        }
+        b=a;
+        while (b<hi && (*t).eval((*c).d, keys[b], (*t).user)==0)
+        {
+            out[b]=(*c).d;
+            found+=1;
+            b+=1;
+        }
+
+        //  Recurse on the smaller side, and go on with the other:
+        if (a-lo<hi-b)
+        {
+            found+=AVL_findSortedNodes(t, AVL_left(c), keys, out, lo, a);
+            c=AVL_right(c);
+            lo=b;
+        }
+        else
+        {
+            found+=AVL_findSortedNodes(t, AVL_right(c), keys, out, b, hi);
+            c=AVL_left(c);
+            hi=a;
+        }
+    }
+    return(found);
+}
+
+int AVL_findSorted(AVL_TREE *t, void **keys, int n, void **out)
+{
+    int i;
+
+    for (i=0; i<n; i+=1)
+        out[i]=NULL;
+    return(AVL_findSortedNodes(t, (*t).top, keys, out, 0, n));
+}
+
+
+//
+//  Internal method for the bounded lookups below.  Descends once from the
+//  top, remembering the last node that satisfied the bound on the way down.
+//  'dir' is +1 when looking for the smallest item above 'k', and -1 for the
+//  largest item below 'k'.  'eq' indicates if an exact match satisfies.
+//
+void *AVL_bound(AVL_TREE *t, void *k, int dir, int eq)
+{
+    void *d=NULL;
+    AVL_NODE *c=(*t).top;
+    uint32_t pk=AVL_prefixOf(t, k);
+
+    while (c!=NULL)
+    {
+        int e=AVL_cmp(t, c, k, pk);
+        if (e==0 && eq)
+        {
+            //  Exact match, and that is good enough:
+            d=(*c).d;
+            c=NULL;
+        }
+        else if (dir>0)
+        {
+            //  Anything bigger than 'k' is a candidate, but there
+            //  may be a smaller one still on the left:
+            if (e<0)
+            {
+                d=(*c).d;
+                c=AVL_left(c);
+            }
+            else
+                c=AVL_right(c);
+        }
+        else
+        {
+            //  Mirror image, anything smaller than 'k' is a candidate:
+            if (e>0)
+            {
+                d=(*c).d;
+                c=AVL_right(c);
+            }
+            else
+                c=AVL_left(c);
+        }
+    }
+    return(d);
+}
+
+void *AVL_lowerBound(AVL_TREE *t, void *k)
+{
+    return(AVL_bound(t, k, +1, 1));
+}
+
+void *AVL_upperBound(AVL_TREE *t, void *k)
+{
+    return(AVL_bound(t, k, +1, 0));
+}
+
+void *AVL_floor(AVL_TREE *t, void *k)
+{
+    return(AVL_bound(t, k, -1, 1));
+}
+
+void *AVL_ceiling(AVL_TREE *t, void *k)
+{
+    return(AVL_bound(t, k, +1, 1));
+}
+
+
+void *AVL_min(AVL_TREE *t)
+{
+    return((*t).first ? (*(*t).first).d : NULL);
+}
+
+void *AVL_max(AVL_TREE *t)
+{
+    return((*t).last ? (*(*t).last).d : NULL);
+}
+
+
+//
+//  Walks the items from 'lo' to 'hi' (inclusive) in sorted order.
+//  Only the nodes on the path to 'lo' are pushed on the stack, after which
+//  the walk proceeds in-order until an item beyond 'hi' shows up.  Subtrees
+//  that are entirely outside of the range are never visited.
+//
+void AVL_walkRange(AVL_TREE *t, void *lo, void *hi, void (*callback)(void *d, void *user), void *user)
+{
+    AVL_NODE *c;
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    int top=0;
+    uint32_t plo=(lo ? AVL_prefixOf(t, lo) : 0);
+    uint32_t phi=(hi ? AVL_prefixOf(t, hi) : 0);
+
+    //  Descend to 'lo', stacking every node that is in range on the
+    //  left side of the path, those are visited on the way back up:
+    c=(*t).top;
+    while (c!=NULL && top<AVL_MAX_DEPTH)
+    {
+        if (lo==NULL || AVL_cmp(t, c, lo, plo)<=0)
+        {
+            stack[top]=c;
+            top+=1;
+            c=AVL_left(c);
+        }
+        else
+            c=AVL_right(c);
+    }
+
+    //  In-order from here, every node popped is at least 'lo':
+    while (top>0)
+    {
+        top-=1;
+        c=stack[top];
+        if (hi!=NULL && AVL_cmp(t, c, hi, phi)<0)
+            break;
+        callback((*c).d, user);
+
+        //  Next is the leftmost node of the right subtree:
+        c=AVL_right(c);
+        while (c!=NULL && top<AVL_MAX_DEPTH)
+        {
+            stack[top]=c;
+            top+=1;
+            c=AVL_left(c);
+        }
+    }
+    return;
+}
+
+
+
+//
+//  Cursors keep the full path from the top of the tree to the current
+//  node, identical to the stack in the 'walk' method.  Stepping to the
+//  next node either goes down into the right subtree (to its leftmost node),
+//  or pops up the path for as long as we come from a right child.  Each
+//  node is pushed and popped at most once during a full pass.
+//
+//  Internal method:  returns the current data pointer, or NULL if the cursor
+//  is off the end or stale.  A stale cursor is moved off the end.
+//
+void *AVL_cursorCheck(AVL_CURSOR *c)
+{
+    if ((*c).top>0 && (*c).mod!=(*(*c).t).mod)
+        (*c).top=0;
+    if ((*c).top==0)
+        return(NULL);
+    return((*(*c).path[(*c).top-1]).d);
+}
+
+//
+//  Internal method:  pushes 'n', and then follows 'n' down to the outer
+//  edge of the tree, left-most for 'dir'<0, right-most for 'dir'>0.
+//
+void AVL_cursorDescend(AVL_CURSOR *c, AVL_NODE *n, int dir)
+{
+    while (n!=NULL && (*c).top<AVL_MAX_DEPTH)
+    {
+        (*c).path[(*c).top]=n;
+        (*c).top+=1;
+        if (dir<0)
+            n=AVL_left(n);
+        else
+            n=AVL_right(n);
+    }
+    return;
+}
+
+void *AVL_cursorFirst(AVL_CURSOR *c, AVL_TREE *t)
+{
+    (*c).t=t;
+    (*c).mod=(*t).mod;
+    (*c).top=0;
+    AVL_cursorDescend(c, (*t).top, -1);
+    return(AVL_cursorCheck(c));
+}
+
+void *AVL_cursorLast(AVL_CURSOR *c, AVL_TREE *t)
+{
+    (*c).t=t;
+    (*c).mod=(*t).mod;
+    (*c).top=0;
+    AVL_cursorDescend(c, (*t).top, +1);
+    return(AVL_cursorCheck(c));
+}
+
+//
+//  Positions the cursor on the smallest item >= 'k'.  Records the
+//  whole path, then cuts it back to the last node that qualified.
+//
+void *AVL_cursorSeek(AVL_CURSOR *c, AVL_TREE *t, void *k)
+{
+    AVL_NODE *n=(*t).top;
+    int found=0;
+    uint32_t pk=AVL_prefixOf(t, k);
+
+    (*c).t=t;
+    (*c).mod=(*t).mod;
+    (*c).top=0;
+    while (n!=NULL && (*c).top<AVL_MAX_DEPTH)
+    {
+        int e=AVL_cmp(t, n, k, pk);
+        (*c).path[(*c).top]=n;
+        (*c).top+=1;
+        if (e<=0)
+        {
+            //  'n' qualifies, but there may be a smaller one on the left:
+            found=(*c).top;
+            if (e==0)
+                n=NULL;
+            else
+                n=AVL_left(n);
+        }
+        else
+            n=AVL_right(n);
+    }
+    (*c).top=found;
+    return(AVL_cursorCheck(c));
+}
+
+void *AVL_cursorNext(AVL_CURSOR *c)
+{
+    AVL_NODE *n;
+
+    if (AVL_cursorCheck(c)==NULL)
+        return(NULL);
+
+    n=(*c).path[(*c).top-1];
+    if (AVL_right(n))
+    {
+        //  Down, to the left-most node on the right:
+        AVL_cursorDescend(c, AVL_right(n), -1);
+    }
+    else
+    {
+        //  Up, past all the nodes of which we were the right subtree:
+        do
+        {
+            (*c).top-=1;
+            n=(*c).path[(*c).top];
+        }
+        while ((*c).top>0 && AVL_right((*c).path[(*c).top-1])==n);
+    }
+    return(AVL_cursorCheck(c));
+}
+
+void *AVL_cursorPrev(AVL_CURSOR *c)
+{
+    AVL_NODE *n;
+
+    if (AVL_cursorCheck(c)==NULL)
+        return(NULL);
+
+    n=(*c).path[(*c).top-1];
+    if (AVL_left(n))
+    {
+        //  Down, to the right-most node on the left:
+        AVL_cursorDescend(c, AVL_left(n), +1);
+    }
+    else
+    {
+        //  Up, past all the nodes of which we were the left subtree:
+        do
+        {
+            (*c).top-=1;
+            n=(*c).path[(*c).top];
+        }
+        while ((*c).top>0 && AVL_left((*c).path[(*c).top-1])==n);
+    }
+    return(AVL_cursorCheck(c));
+}
+
+void *AVL_cursorGet(AVL_CURSOR *c)
+{
+    return(AVL_cursorCheck(c));
+}
+
+int AVL_cursorValid(AVL_CURSOR *c)
+{
+    return(AVL_cursorCheck(c)!=NULL);
+}
+
+
+
+#ifdef AVL_ORDER_STAT
+//
+//  Internal method:  counts the items smaller than 'k', or smaller
+//  or equal when 'eq' is set.  Every time the search goes right, the
+//  left subtree and the node itself are all smaller.
+//
+int AVL_rankOf(AVL_TREE *t, void *k, int eq)
+{
+    int r=0;
+    AVL_NODE *c=(*t).top;
+    uint32_t pk=AVL_prefixOf(t, k);
+
+    while (c!=NULL)
+    {
+        int e=AVL_cmp(t, c, k, pk);
+        if (e==0)
+        {
+            r+=AVL_count(AVL_left(c));
+            if (eq)
+                r+=1;
+            c=NULL;
+        }
+        else if (e<0)
+            c=AVL_left(c);
+        else
+        {
+            r+=AVL_count(AVL_left(c))+1;
+            c=AVL_right(c);
+        }
+    }
+    return(r);
+}
+
+int AVL_rank(AVL_TREE *t, void *k)
+{
+    return(AVL_rankOf(t, k, 0));
+}
+
+void *AVL_select(AVL_TREE *t, int i)
+{
+    AVL_NODE *c=(*t).top;
+
+    if (i<0)
+        return(NULL);
+    while (c!=NULL)
+    {
+        int l=AVL_count(AVL_left(c));
+        if (i<l)
+            c=AVL_left(c);
+        else if (i==l)
+            return((*c).d);
+        else
+        {
+            i-=l+1;
+            c=AVL_right(c);
+        }
+    }
+    return(NULL);
+}
+
+int AVL_countRange(AVL_TREE *t, void *lo, void *hi)
+{
+    int l=0;
+    int h=AVL_size(t);
+
+    if (lo)
+        l=AVL_rankOf(t, lo, 0);
+    if (hi)
+        h=AVL_rankOf(t, hi, 1);
+    if (h<l)
+        return(0);
+    return(h-l);
+}
+#endif
+
+
+//
+//  Insertion (vol 3, pg 462, 3rd ed.), once the search is done.  The path
+//  down from the top is in 'stack[0..top-1]', with the direction taken at
+//  each node in 'dir' (-1 left, +1 right), and the new node for 'd' goes
+//  under the last one, on that side.  An empty path means an empty tree.
+//  'pk' is the prefix of 'd', if key prefixes are used.
+//
+//  Internal method, shared with the trees of AVL_DEFINE, that do their
+//  own search.
+//  RC:
+//    0  on success
+//    2  unable to allocate memory
+//
+int AVL_insertAt(AVL_TREE *t, void *d, uint32_t pk, AVL_NODE **stack, int8_t *dir, int top)
+{
+    AVL_NODE *c;
+    AVL_NODE *b;            //  Balance node  (S)
+    AVL_NODE *p=NULL;       //  Parent of balance node  (T)
+    AVL_NODE *n;            //  The new node  (Q)
+    AVL_NODE *x=NULL, *y=NULL;  //  Nodes that a rotation replaced by copies
+    int bpos=0;             //  Position of the balance node on the path
+    int i;
+
+    (void)pk;
+
+        //  In concurrent mode, the nodes for the copies of a rotation are
+        //  set aside first (see 'copyNode'):
+    if ((*t).epoch && AVL_reserve(t))
+        return(2);
+
+        //  Simplest case is the tree is empty:
+    if (top==0)
+    {
+        c=AVL_newNode(t);
+        if (c==NULL)
+            return(2);
+        AVL_store((*c).d, d);
+        AVL_setPrefix(c, pk);
+        AVL_publish((*t).top, c);
+        (*t).height=1;
+        (*t).mod+=1;
+        (*t).first=c;
+        (*t).last=c;
+        return(0);
+    }
+
+        //  Add the node (A5), next to its parent in memory if the policy
+        //  says so:
+    c=stack[top-1];
+    n=AVL_newNodeNear(t, c);
+    if (n==NULL)
+        return(2);
+    AVL_store((*n).d, d);
+    AVL_setPrefix(n, pk);
+    if (dir[top-1]<0)
+        AVL_publish((*c).l, AVL_tagged((*c).l, n));
+    else
+        AVL_publish((*c).r, AVL_tagged((*c).r, n));
+
+        //  The new node is the smallest or largest if it went under the
+        //  old one, on the outside:
+    if (c==(*t).first && dir[top-1]<0)
+        (*t).first=n;
+    if (c==(*t).last && dir[top-1]>0)
+        (*t).last=n;
+
+        //  The balance node is the deepest one on the path that is out of
+        //  balance, or the top if there is none:
+    b=stack[0];
+    for (i=top-1; i>0; i-=1)
+    {
+        if (AVL_getbal(stack[i])!=0)
+        {
+            b=stack[i];
+            p=stack[i-1];
+            bpos=i;
+            break;
+        }
+    }
+
+        //  Now the balance must be checked and corrected:
+    {
+        AVL_NODE *r=NULL;       //  Rebalance point (R)
+        int a;                  //  Off-balance angle
+
+#ifdef AVL_ORDER_STAT
+        //  Every node on the path gained one node in its subtree:
+        for (i=0; i<top; i+=1)
+            (*stack[i]).s+=1;
+#endif
+
+        // Setting the balance factors (A6)
+        a=dir[bpos];
+        if (a<0)
+            r=AVL_left(b);
+        else
+            r=AVL_right(b);
+
+        //  Run down from the rotate node to the new one 'n',
+        //  updating all balances (currently all 'in-balance').
+        //  The directions were recorded on the way down, so
+        //  there is no need to call 'eval' again:
+        for (i=bpos+1; i<top; i+=1)
+            AVL_setbal(stack[i],dir[i]);
+
+        //  Test the condition of the tree:
+        if (AVL_getbal(b)==0)
+        {
+            //  (A7.i) Tree is now 1 level deeper/higher
+            AVL_setbal(b,a);
+            (*t).height+=1;
+            //  Done.
+        }
+        else if (AVL_getbal(b)==-a)
+        {
+            //  (A7.ii) Now the tree is more balanced:
+            AVL_setbal(b,0);
+            //  Done.
+        }
+        else  //  (AVL_getbal(b)==a)
+        {
+            //  (A7.iii) Rebalancing is required.  In concurrent mode, the
+            //  nodes that get new children other than the top of the
+            //  rotated subtree are copies, only reached once it is linked
+            //  in (A10):
+            if (AVL_getbal(r)==a)
+            {
+                //  This is a single rotation (A8)
+                c=r;
+                if ((*t).epoch)
+                {
+                    x=b;
+                    b=AVL_copyNode(t, b);
+                }
+                if (a==-1)
+                {
+                    AVL_setLeft(b, AVL_right(r));
+                    AVL_setRight(r, b);
+                }
+                else
+                {
+                    AVL_setRight(b, AVL_left(r));
+                    AVL_setLeft(r, b);
+                }
+
+                //  Balances:
+                AVL_setbal(b,0);
+                AVL_setbal(r,0);
+                AVL_recount(b);
+                AVL_recount(r);
+            }
+            else    //  balance of rotate node is -a
+            {
+                //  This is the double rotation (A9)
+                if ((*t).epoch)
+                {
+                    x=b;
+                    b=AVL_copyNode(t, b);
+                    y=r;
+                    r=AVL_copyNode(t, r);
+                }
+                if (a==-1)
+                {
+                    c=AVL_right(r);
+                    AVL_setRight(r, AVL_left(c));
+                    AVL_setLeft(c, r);
+                    AVL_setLeft(b, AVL_right(c));
+                    AVL_setRight(c, b);
+                }
+                else
+                {
+                    c=AVL_left(r);
+                    AVL_setLeft(r, AVL_right(c));
+                    AVL_setRight(c, r);
+                    AVL_setRight(b, AVL_left(c));
+                    AVL_setLeft(c, b);
+                }
+
+                //  Balances:
+                if (AVL_getbal(c)==a)
+                {
+                    AVL_setbal(b,-a);
+                    AVL_setbal(r,0);
+                }
+                else if (AVL_getbal(c)==0)
+                {
+                    AVL_setbal(b,0);
+                    AVL_setbal(r,0);
+                }
+                else  //  AVL_getbal(c)==-a
+                {
+                    AVL_setbal(b,0);
+                    AVL_setbal(r,a);
+                }
+                AVL_setbal(c,0);
+                AVL_recount(r);
+                AVL_recount(b);
+                AVL_recount(c);
+             }
+
+            //  Finally, touch up the top of the tree (A10)
+            if (p)
+            {
+                if (AVL_left(p)==stack[bpos])
+                    AVL_setLeft(p, c);
+                else
+                    AVL_setRight(p, c);
+            }
+            else
+            {
+                AVL_store((*t).top, c);
+            }
+            if (x)
+                AVL_freeNode(t, x);
+            if (y)
+                AVL_freeNode(t, y);
+        }
+    }
+
+    //  Any outstanding cursors are now stale:
+    (*t).mod+=1;
+    return(0);
+}
+
+
+//
+//  Insertion:  searches for the spot with 'eval', recording the path.
+//  RC:
+//    0  on success
+//    1  already in tree
+//    2  unable to allocate memory
+//
+//
+//  Internal method:  insert, findOrInsert, and replace.  On a match, the
+//  item in the tree goes in 'found' (if not NULL), and is swapped for 'd'
+//  if 'swap' is set.
+//
+int AVL_insertFind(AVL_TREE *t, void *d, void **found, int swap)
+{
+    AVL_NODE *c=(*t).top;   //  Current node we're working on  (P)
+    AVL_NODE *stack[AVL_MAX_DEPTH];     //  The path down to the new node
+    int8_t dir[AVL_MAX_DEPTH];          //  Left (-1) or right (+1) at each step
+    int top=0;
+    uint32_t pk=AVL_prefixOf(t, d);     //  Prefix of the key, if used
+
+    while (c!=NULL && top<AVL_MAX_DEPTH)
+    {
+        //  Compare (A2), left (A3), or right (A4)
+        int e=AVL_cmp(t, c, d, pk);
+        if (e==0)
+        {
+            if (found)
+                *found=(*c).d;
+            if (swap)
+                AVL_store((*c).d, d);
+            return(1);
+        }
+        stack[top]=c;
+        if (e<0)
+        {
+            dir[top]=-1;
+            c=AVL_left(c);
+        }
+        else
+        {
+            dir[top]=+1;
+            c=AVL_right(c);
+        }
+        top+=1;
+    }
+    return(AVL_insertAt(t, d, pk, stack, dir, top));
+}
+
+
+int AVL_insert(AVL_TREE *t, void *d)
+{
+    return(AVL_insertFind(t, d, NULL, 0));
+}
+
+
+int AVL_findOrInsert(AVL_TREE *t, void *d, void **existing)
+{
+    int rc=AVL_insertFind(t, d, existing, 0);
+    if (existing && rc!=1)
+        *existing=(rc==0 ? d : NULL);
+    return(rc);
+}
+
+
+int AVL_replace(AVL_TREE *t, void *d, void **old)
+{
+    int rc=AVL_insertFind(t, d, old, 1);
+    if (old && rc!=1)
+        *old=NULL;
+    return(rc);
+}
+
+
+//
+//  Internal method:  'insertHint' without a hint, a plain insert that
+//  leaves the cursor on 'd'.
+//
+int AVL_insertSeek(AVL_TREE *t, void *d, AVL_CURSOR *c)
+{
+    int rc=AVL_insert(t, d);
+    AVL_cursorSeek(c, t, d);
+    return(rc);
+}
+
+
+//
+//  Insertion next to the item cursor 'c' is on, a finger search.  The
+//  cursor holds the path down to that item, so 'd' is compared to it, and
+//  then to the ancestors that bound it on the side 'd' is on, nearest
+//  first, for as long as 'd' is past them.  The search goes down again
+//  from the last one 'd' is past, or from the item itself if none.  For
+//  keys that come in order, that is one call to 'eval', and a few more the
+//  further 'd' is from the finger.  After the insert, the path is the same
+//  down to the balance node, and past it as well unless it rotated.  With
+//  a rotation the cursor searches again below the balance node, which for
+//  keys in order averages two more calls, three per insert in all.
+//
+int AVL_insertHint(AVL_TREE *t, void *d, AVL_CURSOR *c)
+{
+    AVL_NODE *stack[AVL_MAX_DEPTH];     //  The path down to the new node
+    int8_t dir[AVL_MAX_DEPTH];          //  Left (-1) or right (+1) at each step
+    AVL_NODE *n;
+    uint32_t pk=AVL_prefixOf(t, d);
+    int top=(*c).top;
+    int bpos=0;
+    int a, e, i, rc, rot;
+
+    if ((*c).t!=t || (*c).mod!=(*t).mod || top<=0)
+        return(AVL_insertSeek(t, d, c));
+    e=AVL_cmp(t, (*c).path[top-1], d, pk);
+    if (e==0)
+        return(1);
+    a=(e<0 ? -1 : +1);
+
+    //  The path of the cursor, and the directions taken on it:
+    for (i=0; i<top; i+=1)
+    {
+        stack[i]=(*c).path[i];
+        if (i>0)
+            dir[i-1]=(AVL_right(stack[i-1])==stack[i] ? +1 : -1);
+    }
+
+    //  Up, past the bounds on side 'a' that 'd' is beyond:
+    for (i=top-2; i>=0; i-=1)
+    {
+        if (dir[i]!=-a)
+            continue;
+        e=AVL_cmp(t, stack[i], d, pk);
+        if (e==0)
+        {
+            AVL_cursorSeek(c, t, d);
+            return(1);
+        }
+        if ((e<0 ? -1 : +1)!=a)
+            break;
+        top=i+1;
+    }
+
+    //  And down from there, on side 'a':
+    dir[top-1]=a;
+    n=(a<0 ? AVL_left(stack[top-1]) : AVL_right(stack[top-1]));
+    while (n!=NULL && top<AVL_MAX_DEPTH)
+    {
+        e=AVL_cmp(t, n, d, pk);
+        if (e==0)
+        {
+            AVL_cursorSeek(c, t, d);
+            return(1);
+        }
+        stack[top]=n;
+        dir[top]=(e<0 ? -1 : +1);
+        top+=1;
+        n=(e<0 ? AVL_left(n) : AVL_right(n));
+    }
+
+    //  The balance node, as 'insertAt' will find it, and whether it is
+    //  going to rotate:
+    for (i=top-1; i>0; i-=1)
+    {
+        if (AVL_getbal(stack[i])!=0)
+        {
+            bpos=i;
+            break;
+        }
+    }
+    rot=(AVL_getbal(stack[bpos])==dir[bpos]);
+    rc=AVL_insertAt(t, d, pk, stack, dir, top);
+    if (rc!=0)
+        return(rc);
+
+    //  Above the balance node nothing moved, and without a rotation
+    //  nothing moved below it either.  With one, a short search:
+    if (!rot)
+        bpos=top;
+    for (i=0; i<bpos; i+=1)
+        (*c).path[i]=stack[i];
+    (*c).top=bpos;
+    (*c).mod=(*t).mod;
+    if (bpos==0)
+        n=(*t).top;
+    else
+        n=(dir[bpos-1]<0 ? AVL_left(stack[bpos-1]) : AVL_right(stack[bpos-1]));
+    while (n!=NULL && (*c).top<AVL_MAX_DEPTH)
+    {
+        (*c).path[(*c).top]=n;
+        (*c).top+=1;
+        if ((*n).d==d)
+            break;
+        e=AVL_cmp(t, n, d, pk);
+        n=(e<0 ? AVL_left(n) : AVL_right(n));
+    }
+    return(0);
+}
+
+
+
+//
+//  Internal method for the bulk build:  builds a perfectly balanced tree
+//  of 'n' items, taking the nodes off the 'list' in order.  The left half
+//  is never bigger than the right half, so the balance of each node is
+//  simply the difference in height of the two halves.  Returns the top
+//  of the subtree, and its height in 'h'.  Recursion is only log2(n) deep.
+//
+AVL_NODE *AVL_buildNodes(AVL_NODE **list, void **items, int n, int *h)
+{
+    AVL_NODE *c, *l, *r;
+    int nl, hl, hr;
+
+    if (n<=0)
+    {
+        *h=0;
+        return(NULL);
+    }
+
+    nl=(n-1)/2;
+    l=AVL_buildNodes(list, items, nl, &hl);
+    c=*list;
+    *list=AVL_right(c);
+    r=AVL_buildNodes(list, items+nl+1, n-nl-1, &hr);
+
+    AVL_store((*c).d, items[nl]);
+    AVL_setLeft(c, l);
+    AVL_setRight(c, r);
+    AVL_setbal(c, hr-hl);
+    AVL_recount(c);
+    *h=(hr>hl ? hr : hl)+1;
+    return(c);
+}
+
+
+#ifdef AVL_KEY_PREFIX
+//
+//  Internal method:  stores the key prefix of every node under 'n'.
+//
+void AVL_prefixAll(AVL_TREE *t, AVL_NODE *n)
+{
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    int top=0;
+
+    while (n!=NULL || top>0)
+    {
+        if (n==NULL)
+        {
+            top-=1;
+            n=AVL_right(stack[top]);
+            continue;
+        }
+        (*n).k=AVL_prefixOf(t, (*n).d);
+        stack[top]=n;
+        top+=1;
+        n=AVL_left(n);
+    }
+    return;
+}
+
+
+//
+//  Sets the key prefix method, and brings every node up to date.
+//
+void AVL_keyPrefix(AVL_TREE *t, uint32_t (*prefix)(void *d, void *user))
+{
+    (*t).prefix=prefix;
+    AVL_prefixAll(t, (*t).top);
+    return;
+}
+#endif
+
+
+//
+//  Bulk build from 'n' items sorted in ascending order (O(n), no 'eval').
+//  All nodes are taken from the blocks up front, so that running
+//  out of memory leaves the (empty) tree untouched.
+//
+int AVL_buildSorted(AVL_TREE *t, void **items, int n)
+{
+    AVL_NODE *list=NULL;
+    AVL_NODE *top;
+    int i;
+
+    if ((*t).top!=NULL)
+        return(1);
+
+    //  Prepending keeps fresh blocks in address order:
+    for (i=0; i<n; i+=1)
+    {
+        AVL_NODE *c=AVL_newNode(t);
+        if (c==NULL)
+        {
+            while (list)
+            {
+                c=list;
+                list=AVL_right(list);
+                AVL_freeNode(t, c);
+            }
+            return(2);
+        }
+        AVL_setRight(c, list);
+        list=c;
+    }
+
+    //  The nodes are not reachable yet, only publishing them is a change:
+    top=AVL_buildNodes(&list, items, n, &((*t).height));
+#ifdef AVL_KEY_PREFIX
+    AVL_prefixAll(t, top);
+#endif
+    AVL_publish((*t).top, top);
+    (*t).mod+=1;
+    AVL_resetEnds(t);
+    return(0);
+}
+
+
+
+//
+//  Deletion, once the search is done.
+//  Rebalances the tree after deleting the node 'stack[top]', where
+//  'stack[0..top-1]' is the path down to it from the top.  Internal method,
+//  shared with the trees of AVL_DEFINE.
+//
+//  Notes on general algorithm:
+//   Find the node that needs to be deleted, if it has 2 children, then  
+//   recurse down and find the closest in-order successor/predecessor.  This is
+//   necessarily a node all the way down, but _might_ have a single child. 
+//   Swap this node from the bottom of the tree into the slot of the node that
+//   is about to be deleted.
+//   At this point an inbalance may have occurred, that needs to be rectified.
+//   Unfortunately, it might completely unbalance the tree to the root, and
+//   all balances must be checked, rotating until the root is balanced.  Rotations
+//   are analogous to the insertion case.
+//   Identical to the 'walk' method below a stack is kept of the path in the
+//   tree from the root to the node to be deleted.
+//   Delete returns the 'data' pointer '(*n).d', or NULL if not found.
+//   
+void AVL_deleteAt(AVL_TREE *t, AVL_NODE **stack, int top)
+{
+    AVL_NODE *c=stack[top];
+    AVL_NODE *p=(top>0 ? stack[top-1] : NULL);
+    AVL_NODE *x, *y;    //  Nodes that a rotation replaced by copies
+    int h=0;        //  Tracks if the tree is getting shorter.
+
+    //  In concurrent mode, rotations copy nodes (see 'copyNode'):
+    if ((*t).epoch)
+        AVL_reserve(t);
+
+
+    //  The smallest node has no left subtree, so the next one up is the
+    //  smallest of the right one, or else the parent.  Likewise for the
+    //  largest:
+    if (c==(*t).first)
+    {
+        AVL_NODE *n=AVL_right(c);
+        while (n && AVL_left(n))
+            n=AVL_left(n);
+        (*t).first=(n ? n : p);
+    }
+    if (c==(*t).last)
+    {
+        AVL_NODE *n=AVL_left(c);
+        while (n && AVL_right(n))
+            n=AVL_right(n);
+        (*t).last=(n ? n : p);
+    }
+
+    //
+    //  At this point, 'c' points to the node that is to be deleted.
+    //  If there is only a single subtree, replace 'c' with that tree,
+    //  no replacement node needs to be found:
+    //
+    if (AVL_left(c)==NULL || AVL_right(c)==NULL)
+    {
+        AVL_NODE *s=AVL_left(c);    //  Left subtree.
+        if (s==NULL)
+            s=AVL_right(c);         //  Right subtree.
+
+        //  If there is a previous
+        if (p)
+        {
+            //  Was 'c' the left or right child?
+            if (AVL_left(p)==c)
+            {
+                //  The tree is getting shorter on the left:
+                AVL_setLeft(p, s);
+                AVL_incbal(p);
+            }
+            else
+            {
+                //  The tree is getting shorter on the right:
+                AVL_setRight(p, s);
+                AVL_decbal(p);
+            }
+            //  Important, did the total tree get shorter?
+            //  This happens when the tree is now balanced (from -1 or +1):
+            if (AVL_getbal(p)==0)
+                h=-1;
+        }
+        else
+        {
+            //  'c' is the top
+            //  Remember that the tree has become less tall, but
+            //  the balance under 's' is already correct:
+            AVL_store((*t).top, s);
+            h=-1;
+        }
+    }
+    else
+    {
+        //
+        //  Find the in-order predecessor or successor.
+        //  Make the decision based on where the balance sits, so
+        //  the tree becomes 'more' balanced, potentially avoiding
+        //  additional balancing rotations.
+        //  
+        //  The process is straight forward: if the balance is positive
+        //  ((*c).r is deeper), then go right once, and continue going left
+        //  until there is no further left.  At this point the in-order
+        //  successor has been found, but might have a right subnode still.
+        //
+        int cpos=top;       //  Remember where in the stack 'c' is located
+        AVL_NODE *sc=c;     //  This is the actual node we're going to delete, saved.
+        AVL_NODE *sp=p;     //  And the parent, also saved.
+        AVL_NODE *s=NULL;   //  The in-order neighbor may still have a subtree on the other side.
+
+        //  'c' is already saved at 'stack[top]', move one up:
+        top+=1;
+        p=c;
+
+        if (AVL_getbal(c)>0)
+        {
+            //  Right-hand side is taller, grab the in-order successor
+            c=AVL_right(c);
+            while (AVL_left(c) && top<AVL_MAX_DEPTH)
+            {
+                stack[top]=c;
+                p=c;
+                c=AVL_left(c);
+                top+=1;
+            }
+            //  Save potentially a subtree still on the right:
+            s=AVL_right(c);
+        }
+        else
+        {
+            //  Left-hand side is taller, grab the in-order precursor
+            c=AVL_left(c);
+            while (AVL_right(c) && top<AVL_MAX_DEPTH)
+            {
+                stack[top]=c;
+                p=c;
+                c=AVL_right(c);
+                top+=1;
+            }
+            //  Save potentially a subtree still on the left:
+            s=AVL_left(c);
+        }
+
+        //  At this point 'c' points to the inorder sucessor/precursor, and is
+        //  the node that is going to be put in position of 'sc'.  Any eventual
+        //  subtrees (in 's') can be put in place of 'c', carving 'c' out of the
+        //  tree.  Now 'p' again points to the parent of 'c', and needs a balance
+        //  update:  specifically, if 'c' was on the left of the parent, then the
+        //  balance is now more to the right, so it is incremented, and vice versa.
+        //
+        //  In this case, 'p' always exists, because the case where the deleted node
+        //  was at the top of the tree was already handled above.  It is possible that
+        //  'p' is pointing at 'sc', which is not a problem.  Note that 's' is 50/50
+        //  change of being NULL, which does not matter.
+        //
+        //  In concurrent mode, nodes stay where readers may be on them:  the
+        //  item of 'c' moves into 'sc' instead, which deletes the item of
+        //  'sc' in one store.  Until 'c' is carved out, its item is in the
+        //  tree twice, and either is found.
+        if ((*t).epoch)
+        {
+            AVL_store((*sc).d, (*c).d);
+            AVL_setPrefix(sc, (*c).k);
+        }
+        if (AVL_left(p)==c)
+        {
+            AVL_setLeft(p, s);
+            AVL_incbal(p);   //  Tree under 'p' got shorter on the left
+        }
+        else
+        {
+            AVL_setRight(p, s);
+            AVL_decbal(p);   //  Tree under 'p' got shorter on the right
+        }
+        //  If 'p' became 'more' balanced (ie. went to 0), then the tree actually
+        //  got shorter:
+        if (AVL_getbal(p)==0)
+            h=-1;
+
+        if ((*t).epoch)
+        {
+            //  'sc' stays, and 'c' is the node that goes:
+            if ((*t).first==c)
+                (*t).first=sc;
+            if ((*t).last==c)
+                (*t).last=sc;
+        }
+        else
+        {
+            //  'c' is going to be swapped into place of 'sc', before 'sc' is discarded.
+            //  The balance is copied, and the pointers connected.
+            AVL_setLeft(c, AVL_left(sc));
+            AVL_setRight(c, AVL_right(sc));
+            AVL_setbal(c, AVL_getbal(sc));
+            //  Parent connections:
+            if (sp==NULL)
+                AVL_store((*t).top, c);
+            else if (AVL_left(sp)==sc)
+                AVL_setLeft(sp, c);
+            else
+                AVL_setRight(sp, c);
+            //  Ensure that 'c' is in the path instead of 'sc':
+            stack[cpos]=c;
+
+            //  Make sure that 'c' (which is to be deleted), is now again correctly
+            //  pointing to the node that was taken out of the tree, ie. 'sc'
+            c=sc;
+        }
+    }
+
+
+    //
+    //  At this point 'c' is out of the tree, and 'd' has been saved.
+    //
+    AVL_freeNode(t, c);
+    (*t).mod+=1;
+    c=NULL;
+
+#ifdef AVL_ORDER_STAT
+    //  Every node left on the path lost a node in its subtree.  Counting
+    //  bottom-up also fixes the node swapped into the place of 'sc':
+    {
+        int i;
+        for (i=top-1; i>=0; i-=1)
+            AVL_recount(stack[i]);
+    }
+#endif
+
+    //
+    //  Rebalance:
+    //   The position in the stack points to either: 1) the node that was taken
     //   and placed in the position of the deleted node, or 2) the deleted node
     //   itself.  So balance must be checked pos-1 and up to the root.
     //
@@ -880,303 +2816,2070 @@ void *AVL_delete(AVL_TREE *t, void *k)
     //    (meaning, the other subtree is dominatant in determining the hight under the node)
     //
 
-    while (top>0)
+    while (top>0)
+    {
+        AVL_NODE *a, *b, *s1, *s2, *s3, *s4;   //  'c' and 'p' already exist.
+
+        //  Get 'a', and 'p'.
+        top-=1;
+        a=stack[top];
+        x=NULL;
+        y=NULL;
+        if (top>0)
+            p=stack[top-1];
+        else
+            p=NULL;
+
+        //  Which scenario are we in?
+        if (AVL_getbal(a)==2)
+        {
+            //
+            //  Heavy on the 'r' side
+            //
+            s1=AVL_left(a);
+            b=AVL_right(a);
+            if (AVL_getbal(b)>=0)
+            {
+                //
+                //  Scenario 1, with the right most tree heaviest, or both
+                //  subtrees 's3' and 's4' being equal.  'c' cannot be NULL
+                //  otherwise bal(a) could not have been 2.
+                //
+                s2=AVL_left(b);
+                c=AVL_right(b);
+                s3=AVL_left(c);
+                s4=AVL_right(c);
+
+                //  In concurrent mode, 'a' is rewired as a copy, which
+                //  only the link from 'p' makes reachable:
+                if ((*t).epoch)
+                {
+                    x=a;
+                    a=AVL_copyNode(t, a);
+                }
+
+                //  Now stitch the trees correctly.
+                //  The subtree under 'c' does not change.
+                AVL_setLeft(a, s1);
+                AVL_setRight(a, s2);
+                AVL_setLeft(b, a);
+                AVL_setRight(b, c);
+                AVL_recount(a);
+                AVL_recount(b);
+
+                //  Parent 'p' might be NULL, in which case modify the root.
+                if (p)
+                {
+                    if (AVL_left(p)==stack[top])
+                        AVL_setLeft(p, b);
+                    else
+                        AVL_setRight(p, b);
+                }
+                else
+                    AVL_store((*t).top, b);
+
+                //  
+                //  Set the balances:
+                //
+                if (AVL_getbal(b)==0)
+                {
+                    //  bal(a)=+1  bal(b)=-1  bal(c)=unchanged, height(p)=unchanged (because s2 is +1 taller)
+                    AVL_setbal(a,+1);
+                    AVL_setbal(b,-1);
+                    //  No balance update necessary for 'p', but still set 'a' to be correct.
+                    h=0;
+                    a=b;
+                }
+                else   //  Balance under 'b' was '1'
+                {
+                    //  bal(a)=0  bal(b)=0  bal(c)=unchanged,  height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,0);
+                    //  Make sure that 'a' is set right, so the comparision on
+                    //  the balance update is done correctly below.
+                    //  (*p).l/r has now been changed from 'a' to 'c':
+                    h=-1;
+                    a=b;
+                }
+            }
+            else
+            {
+                //
+                //  This is scenario 2, with the left-most tree heaviest.
+                //  Both 's2' and 's3' might be NULL, 'c' cannot be NULL.
+                //
+                c=AVL_left(b);
+                s4=AVL_right(b);
+                s2=AVL_left(c);
+                s3=AVL_right(c);
+
+                //  In concurrent mode, 'a' and 'b' are rewired as copies,
+                //  complete before 'c' links them:
+                if ((*t).epoch)
+                {
+                    x=a;
+                    a=AVL_copyNode(t, a);
+                    y=b;
+                    b=AVL_copyNode(t, b);
+                }
+
+                //  Sttich the rotated tree correctly, 'c' becomes root:
+                AVL_setRight(a, s2);
+                AVL_setLeft(b, s3);
+                AVL_setLeft(c, a);
+                AVL_setRight(c, b);
+                AVL_recount(a);
+                AVL_recount(b);
+                AVL_recount(c);
+
+                //  Again, 'p' might be NULL.
+                if (p)
+                {
+                    if (AVL_left(p)==stack[top])
+                        AVL_setLeft(p, c);
+                    else
+                        AVL_setRight(p, c);
+                }
+                else
+                    AVL_store((*t).top, c);
+
+                //
+                //  Balances:
+                //
+                if (AVL_getbal(c)==-1)
+                {
+                    //  bal(a)=0  bal(b)=+1  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,+1);
+                }
+                else if (AVL_getbal(c)==0)
+                {
+                    //  bal(a)=0  bal(b)=0  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,0);
+                }
+                else //  (AVL_getbal(c)==+1)
+                {
+                    //  bal(a)=-1  bal(b)=0  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,-1);
+                    AVL_setbal(b,0);
+                }
+                //  Balance on 'c' is always 0.
+                AVL_setbal(c, 0);
+                //  Make sure that 'a' is set right, so the comparision on
+                //  the balance update is done correctly below.
+                //  (*p).l/r has now been changed from 'a' to 'c':
+                h=-1;
+                a=c;
+            }
+        }
+        else if (AVL_getbal(a)==-2)
+        {
+            //
+            //  Heavy on the 'l' side (symmetric to right)
+            //
+            s1=AVL_right(a);
+            b=AVL_left(a);
+            if (AVL_getbal(b)<=0)
+            {
+                //
+                //  Scenario 1, with the left most tree heaviest, or both
+                //  subtrees 's3' and 's4' being equal.  'c' cannot be NULL
+                //  otherwise bal(a) could not have been -2.
+                //
+                s2=AVL_right(b);
+                c=AVL_left(b);
+                s3=AVL_right(c);
+                s4=AVL_left(c);
+
+                //  In concurrent mode, 'a' is rewired as a copy, which
+                //  only the link from 'p' makes reachable:
+                if ((*t).epoch)
+                {
+                    x=a;
+                    a=AVL_copyNode(t, a);
+                }
+
+                //  Now stitch the trees correctly.
+                //  The subtree under 'c' does not change.
+                AVL_setRight(a, s1);
+                AVL_setLeft(a, s2);
+                AVL_setRight(b, a);
+                AVL_setLeft(b, c);
+                AVL_recount(a);
+                AVL_recount(b);
+
+                //  Parent 'p' might be NULL, in which case modify the root.
+                if (p)
+                {
+                    if (AVL_left(p)==stack[top])
+                        AVL_setLeft(p, b);
+                    else
+                        AVL_setRight(p, b);
+                }
+                else
+                    AVL_store((*t).top, b);
+
+                //  
+                //  Set the balances:
+                //
+                if (AVL_getbal(b)==0)
+                {
+                    //  bal(a)=-1  bal(b)=+1  bal(c)=unchanged, height(p)=unchanged (because s2 is +1 taller)
+                    AVL_setbal(a,-1);
+                    AVL_setbal(b,+1);
+                    //  No balance update necessary for 'p', but still set 'a' to be correct.
+                    h=0;
+                    a=b;
+                }
+                else   //  Balance under 'b' was '-1'
+                {
+                    //  bal(a)=0  bal(b)=0  bal(c)=unchanged,  height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,0);
+                    //  Make sure that 'a' is set right, so the comparision on
+                    //  the balance update is done correctly below.
+                    //  (*p).l/r has now been changed from 'a' to 'c':
+                    h=-1;
+                    a=b;
+                }
+            }
+            else
+            {
+                //
+                //  This is scenario 2, with the left-most tree heaviest.
+                //  Both 's2' and 's3' might be NULL, 'c' cannot be NULL.
+                //
+                c=AVL_right(b);
+                s4=AVL_left(b);
+                s2=AVL_right(c);
+                s3=AVL_left(c);
+
+                //  In concurrent mode, 'a' and 'b' are rewired as copies,
+                //  complete before 'c' links them:
+                if ((*t).epoch)
+                {
+                    x=a;
+                    a=AVL_copyNode(t, a);
+                    y=b;
+                    b=AVL_copyNode(t, b);
+                }
+
+                //  Sttich the rotated tree correctly, 'c' becomes root:
+                AVL_setLeft(a, s2);
+                AVL_setRight(b, s3);
+                AVL_setRight(c, a);
+                AVL_setLeft(c, b);
+                AVL_recount(a);
+                AVL_recount(b);
+                AVL_recount(c);
+
+                //  Again, 'p' might be NULL.
+                if (p)
+                {
+                    if (AVL_left(p)==stack[top])
+                        AVL_setLeft(p, c);
+                    else
+                        AVL_setRight(p, c);
+                }
+                else
+                    AVL_store((*t).top, c);
+
+                //
+                //  Balances:
+                //
+                if (AVL_getbal(c)==+1)
+                {
+                    //  bal(a)=0  bal(b)=+1  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,-1);
+                }
+                else if (AVL_getbal(c)==0)
+                {
+                    //  bal(a)=0  bal(b)=0  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,0);
+                    AVL_setbal(b,0);
+                }
+                else //  (AVL_getbal(c)==+1)
+                {
+                    //  bal(a)=-1  bal(b)=0  bal(c)=0,   height(p)=-1
+                    AVL_setbal(a,+1);
+                    AVL_setbal(b,0);
+                }
+                //  Balance on 'c' is always 0.
+                AVL_setbal(c, 0);
+                //  Make sure that 'a' is set right, so the comparision on
+                //  the balance update is done correctly below.
+                //  (*p).l/r has now been changed from 'a' to 'c':
+                h=-1;
+                a=c;
+            }
+        }
+        //  Else, no rotations necessary.
+
+        //  The nodes that were copied are out of the tree now:
+        if (x)
+            AVL_freeNode(t, x);
+        if (y)
+            AVL_freeNode(t, y);
+
+
+        //  Is there still a height change?
+        if (h!=0)
+        {
+            //  We are propagating a height change on the subtree.
+            //  Check the balances of the parent node 'p' and
+            //  adjust accordingly.
+            if (p)
+            {
+                //  Note that 'a' was reset correctly if a rotation was performed.
+                if (AVL_left(p)==a)
+                    AVL_incbal(p);
+                else
+                    AVL_decbal(p);
+
+                //  At this point, if bal(p) is now zero, it means that height
+                //  under 'p' was lost, otherwise, height under 'p' is dominated
+                //  by the other (non-rotated) subtree.
+                if (AVL_getbal(p)==0)
+                    h=-1;
+                else
+                    h=0;
+            }
+            //  No 'p' means we are at the top of the tree, which is
+            //  handled below, and outside of this while-block.
+        }
+    }
+
+
+    //  If we are still propagating a height after
+    //  reaching the root of the tree, record it now:
+    //  This specificially needs to be outside of the balance
+    //  section for 1 and 2-node trees.
+    if (h<0)
+        (*t).height-=1;
+    return;
+}
+
+
+//
+//  Deletion:  searches for 'k' with 'eval', recording the path.
+//
+void *AVL_delete(AVL_TREE *t, void *k)
+{
+    AVL_NODE *c=(*t).top;
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    int top=0;
+    uint32_t pk=AVL_prefixOf(t, k);
+
+    while (c!=NULL && top<AVL_MAX_DEPTH)
+    {
+        //  Left, right, or found.  The node to delete is the last one on
+        //  the stack:
+        int e=AVL_cmp(t, c, k, pk);
+        stack[top]=c;
+        if (e==0)
+        {
+            void *d=(*c).d;
+            AVL_deleteAt(t, stack, top);
+            return(d);
+        }
+        else if (e<0)
+            c=AVL_left(c);
+        else
+            c=AVL_right(c);
+        top+=1;
+    }
+
+    //  Not in the tree:
+    return(NULL);
+}
+
+
+//
+//  Deletes the smallest (dir<0) or the largest item (dir>0), without
+//  calling 'eval':  the path to it is simply along the edge of the tree.
+//
+void *AVL_popEnd(AVL_TREE *t, int dir)
+{
+    AVL_NODE *c=(*t).top;
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    int top=0;
+    void *d;
+
+    if (c==NULL)
+        return(NULL);
+    for (;;)
+    {
+        AVL_NODE *n=(dir<0 ? AVL_left(c) : AVL_right(c));
+        stack[top]=c;
+        if (n==NULL || top==AVL_MAX_DEPTH-1)
+            break;
+        c=n;
+        top+=1;
+    }
+    d=(*c).d;
+    AVL_deleteAt(t, stack, top);
+    return(d);
+}
+
+void *AVL_popMin(AVL_TREE *t)
+{
+    return(AVL_popEnd(t, -1));
+}
+
+void *AVL_popMax(AVL_TREE *t)
+{
+    return(AVL_popEnd(t, +1));
+}
+
+
+//
+//  Deletion at a cursor:  the cursor holds the path, so there is no
+//  search.  The path to the next item is worked out beforehand, as it will
+//  be once the node is gone, and taken over as far as the rebalancing has
+//  left it in place.  Only below a rotation is it searched for again.
+//
+void *AVL_cursorDelete(AVL_CURSOR *c)
+{
+    AVL_TREE *t=(*c).t;
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    AVL_NODE *n, *s;
+    void *d;
+    int top=(*c).top;
+    int i;
+
+    if (AVL_cursorCheck(c)==NULL)
+        return(NULL);
+    n=(*c).path[top-1];
+    memcpy(stack, (*c).path, top*sizeof(AVL_NODE*));
+
+    if (AVL_right(n)==NULL)
+    {
+        //  Up, past all the nodes of which 'n' is in the right subtree:
+        i=top-1;
+        while (i>0 && AVL_right((*c).path[i-1])==(*c).path[i])
+            i-=1;
+        (*c).top=i;
+    }
+    else
+    {
+        //  The node that takes the place of 'n' (see deleteAt), then the
+        //  left-most node on the right, unless that one moved up itself:
+        (*c).top=top-1;
+        if (AVL_left(n) && AVL_getbal(n)>0)
+        {
+            s=AVL_right(n);
+            while (AVL_left(s))
+                s=AVL_left(s);
+            (*c).path[(*c).top]=s;
+            (*c).top+=1;
+        }
+        else
+        {
+            if (AVL_left(n))
+            {
+                s=AVL_left(n);
+                while (AVL_right(s))
+                    s=AVL_right(s);
+                (*c).path[(*c).top]=s;
+                (*c).top+=1;
+            }
+            AVL_cursorDescend(c, AVL_right(n), -1);
+        }
+    }
+    s=((*c).top>0 ? (*c).path[(*c).top-1] : NULL);
+    d=(s ? (*s).d : NULL);
+
+    AVL_deleteAt(t, stack, top-1);
+    (*c).mod=(*t).mod;
+
+    //  Keep the path down to the first node that a rotation moved:
+    for (i=0; i<(*c).top; i+=1)
+    {
+        AVL_NODE *p=(*c).path[i];
+        if (i==0 ? (*t).top!=p : AVL_left((*c).path[i-1])!=p && AVL_right((*c).path[i-1])!=p)
+            break;
+    }
+    if (i<(*c).top)
+    {
+        //  The last node in place still has the item of 's' below it,
+        //  search from there.  By item, as in concurrent mode 's' may be
+        //  a copy now, or its item may have moved (see deleteAt):
+        uint32_t pk=AVL_prefixOf(t, d);
+        AVL_NODE *m=(*t).top;
+        int e;
+
+        if (i>0)
+        {
+            i-=1;
+            m=(*c).path[i];
+        }
+        while ((e=AVL_cmp(t, m, d, pk))!=0 && i<AVL_MAX_DEPTH-1)
+        {
+            (*c).path[i]=m;
+            i+=1;
+            if (e<0)
+                m=AVL_left(m);
+            else
+                m=AVL_right(m);
+        }
+        (*c).path[i]=m;
+        (*c).top=i+1;
+    }
+    return(AVL_cursorCheck(c));
+}
+
+
+
+
+
+
+
+//
+//  Batched insert and delete.
+//
+//  The batch is sorted first (stable merge sort on an index array, so that
+//  the return codes stay in the caller's order).  Small batches are then
+//  applied in key order with a cursor as the finger (see 'insertHint'):
+//  each item is searched for from the previous one, so the items share
+//  the part of the path they have in common, and a batch of 'k' items
+//  takes O(k log(n/k)) calls to 'eval'.  Big batches, relative to the
+//  tree, are merged with the sorted contents of the tree instead, into
+//  fresh nodes, which then replace the old ones all at once.
+//
+
+//
+//  Internal method:  sorts the indexes of 'n' items into 'idx',
+//  using 'tmp' as scratch space of the same size.
+//
+void AVL_sortBatch(AVL_TREE *t, void **items, int *idx, int *tmp, int n)
+{
+    int *src=idx;
+    int *dst=tmp;
+    int w, i;
+
+    for (i=0; i<n; i+=1)
+        idx[i]=i;
+
+    for (w=1; w<n; w*=2)
+    {
+        int *x;
+        for (i=0; i<n; i+=2*w)
+        {
+            int a=i;
+            int m=(i+w<n ? i+w : n);
+            int b=m;
+            int e=(i+2*w<n ? i+2*w : n);
+            int o=i;
+
+            //  Take from the right only if it is strictly smaller:
+            while (a<m && b<e)
+            {
+                if ((*t).eval(items[src[a]], items[src[b]], (*t).user)<0)
+                    dst[o++]=src[b++];
+                else
+                    dst[o++]=src[a++];
+            }
+            while (a<m)
+                dst[o++]=src[a++];
+            while (b<e)
+                dst[o++]=src[b++];
+        }
+        x=src;
+        src=dst;
+        dst=x;
+    }
+    if (src!=idx)
+        memcpy(idx, src, n*sizeof(int));
+    return;
+}
+
+
+//
+//  Internal method:  is a batch of 'n' items worth a full merge?  One by one
+//  costs about log2(size) comparisons per item, a merge costs one comparison
+//  per item in both the tree and the batch, plus the rebuild.
+//
+int AVL_batchMerge(AVL_TREE *t, int n)
+{
+    long total=(long)AVL_size(t)+n;
+    long h=0;
+    while ((1L<<h)<total)
+        h+=1;
+    return((long)n*h>total);
+}
+
+
+//
+//  Internal method:  replaces the contents of the tree with the 'n' sorted
+//  'items'.  The new tree is built in fresh nodes on the side, and takes
+//  the place of the old one in a single store, so that concurrent readers
+//  see either one whole.  The old nodes are freed afterwards, in concurrent
+//  mode into limbo, as readers may still be among them.
+//  Returns 0 on success, or 2 if out of memory, with the tree untouched.
+//
+int AVL_rebuild(AVL_TREE *t, void **items, int n)
+{
+    AVL_NODE *list=NULL;
+    AVL_NODE *top, *old;
+    int i, h;
+
+    for (i=0; i<n; i+=1)
+    {
+        AVL_NODE *c=AVL_newNode(t);
+        if (c==NULL)
+        {
+            while (list)
+            {
+                c=list;
+                list=AVL_right(list);
+                AVL_freeNode(t, c);
+            }
+            return(2);
+        }
+        AVL_setRight(c, list);
+        list=c;
+    }
+    top=AVL_buildNodes(&list, items, n, &h);
+#ifdef AVL_KEY_PREFIX
+    AVL_prefixAll(t, top);
+#endif
+
+    old=(*t).top;
+    AVL_publish((*t).top, top);
+    (*t).height=h;
+    (*t).mod+=1;
+    AVL_resetEnds(t);
+
+    //  'size' counted the new nodes as well as the old, until now:
+    AVL_freeNodes(t, old);
+    return(0);
+}
+
+
+//
+//  Internal method:  moves cursor 'c' on to the smallest item >= 'k', for
+//  a 'k' that is not smaller than the item it is on.  A finger search, as
+//  in 'insertHint':  up past the ancestors on the right that 'k' is beyond,
+//  and down from the last one.  Returns 1 if the item it lands on is equal
+//  to 'k'.
+//
+int AVL_cursorFinger(AVL_CURSOR *c, void *k, uint32_t pk)
+{
+    AVL_TREE *t=(*c).t;
+    AVL_NODE *n;
+    int top=(*c).top;
+    int found=0;
+    int e, i;
+
+    e=AVL_cmp(t, (*c).path[top-1], k, pk);
+    if (e<=0)
+        return(e==0);
+
+    for (i=top-2; i>=0; i-=1)
+    {
+        if (AVL_left((*c).path[i])!=(*c).path[i+1])
+            continue;
+        e=AVL_cmp(t, (*c).path[i], k, pk);
+        if (e<=0)
+        {
+            found=i+1;
+            if (e==0)
+            {
+                (*c).top=found;
+                return(1);
+            }
+            break;
+        }
+        top=i+1;
+    }
+
+    //  As in 'cursorSeek', the last node that qualified on the way down:
+    n=AVL_right((*c).path[top-1]);
+    e=1;
+    while (n!=NULL && top<AVL_MAX_DEPTH)
+    {
+        e=AVL_cmp(t, n, k, pk);
+        (*c).path[top]=n;
+        top+=1;
+        if (e<=0)
+        {
+            found=top;
+            if (e==0)
+                break;
+            n=AVL_left(n);
+        }
+        else
+            n=AVL_right(n);
+    }
+    (*c).top=found;
+    return(e==0);
+}
+
+
+//
+//  Internal 'walk' callback that collects the data pointers in an array.
+//
+typedef struct
+{
+    void **a;
+    int n;
+}
+AVL_COLLECT;
+
+void AVL_collect(void *d, void *user)
+{
+    AVL_COLLECT *c=(AVL_COLLECT*)user;
+    (*c).a[(*c).n]=d;
+    (*c).n+=1;
+}
+
+
+//
+//  Internal method:  merges the sorted batch with the contents of the tree,
+//  and rebuilds.  The existing items are collected at the end of the array,
+//  and the merge writes from the front, which can never overtake them.
+//  Returns the number of items inserted, or -1 if memory ran out, in which
+//  case the tree is untouched.
+//
+int AVL_mergeInsert(AVL_TREE *t, void **items, int *idx, int n, int *rc)
+{
+    AVL_COLLECT old;
+    void **all;
+    int i, j, k, c;
+
+    all=(void**)malloc((AVL_size(t)+n)*sizeof(void*));
+    if (all==NULL)
+        return(-1);
+    old.a=all+n;
+    old.n=0;
+    AVL_walk(t, AVL_collect, &old);
+
+    i=0;
+    k=0;
+    c=0;
+    for (j=0; j<n; j+=1)
+    {
+        void *d=items[idx[j]];
+        int e=1;
+
+        //  Copy everything smaller than 'd' first:
+        while (i<old.n && (e=(*t).eval(old.a[i], d, (*t).user))>0)
+        {
+            all[k]=old.a[i];
+            k+=1;
+            i+=1;
+        }
+        if (i>=old.n)
+            e=1;
+
+        //  Duplicates, both in the tree and within the batch:
+        if (e==0 || (j>0 && (*t).eval(items[idx[j-1]], d, (*t).user)==0))
+        {
+            if (rc)
+                rc[idx[j]]=1;
+        }
+        else
+        {
+            all[k]=d;
+            k+=1;
+            c+=1;
+            if (rc)
+                rc[idx[j]]=0;
+        }
+    }
+    while (i<old.n)
+    {
+        all[k]=old.a[i];
+        k+=1;
+        i+=1;
+    }
+
+    if (AVL_rebuild(t, all, k))
+        c=-1;
+    free(all);
+    return(c);
+}
+
+
+//
+//  Batched insert.  Returns the number of items inserted.
+//
+int AVL_insertBatch(AVL_TREE *t, void **items, int n, int *rc)
+{
+    int *idx;
+    int i, r;
+    int c=-1;
+
+    if (n<=0)
+        return(0);
+
+    //  Without memory to sort, just do them one by one:
+    idx=(int*)malloc(2*n*sizeof(int));
+    if (idx==NULL)
+    {
+        c=0;
+        for (i=0; i<n; i+=1)
+        {
+            r=AVL_insert(t, items[i]);
+            if (rc)
+                rc[i]=r;
+            if (r==0)
+                c+=1;
+        }
+        return(c);
+    }
+
+    AVL_sortBatch(t, items, idx, idx+n, n);
+    if (AVL_batchMerge(t, n))
+        c=AVL_mergeInsert(t, items, idx, n, rc);
+    if (c<0)
+    {
+        AVL_CURSOR f;
+
+        //  The cursor follows the inserts, from the smallest item on:
+        AVL_cursorFirst(&f, t);
+        c=0;
+        for (i=0; i<n; i+=1)
+        {
+            r=AVL_insertHint(t, items[idx[i]], &f);
+            if (rc)
+                rc[idx[i]]=r;
+            if (r==0)
+                c+=1;
+        }
+    }
+    free(idx);
+    return(c);
+}
+
+
+//
+//  Internal method:  takes the batch of sorted keys out of the sorted
+//  contents of the tree, and rebuilds.  The survivors are compacted
+//  in place.  Returns the number of items deleted, or -1 if memory ran
+//  out, in which case the tree is untouched.
+//
+int AVL_mergeDelete(AVL_TREE *t, void **keys, int *idx, int n, void **out)
+{
+    AVL_COLLECT old;
+    int i, j, k, c;
+
+    old.a=(void**)malloc((AVL_size(t)+1)*sizeof(void*));
+    if (old.a==NULL)
+        return(-1);
+    old.n=0;
+    AVL_walk(t, AVL_collect, &old);
+
+    i=0;
+    k=0;
+    c=0;
+    for (j=0; j<n; j+=1)
+    {
+        void *key=keys[idx[j]];
+        int e=1;
+
+        //  Keep everything smaller than the key:
+        while (i<old.n && (e=(*t).eval(old.a[i], key, (*t).user))>0)
+        {
+            old.a[k]=old.a[i];
+            k+=1;
+            i+=1;
+        }
+        if (i<old.n && e==0)
+        {
+            //  Found, and skipped.  A repeated key finds nothing.
+            if (out)
+                out[idx[j]]=old.a[i];
+            i+=1;
+            c+=1;
+        }
+    }
+    while (i<old.n)
+    {
+        old.a[k]=old.a[i];
+        k+=1;
+        i+=1;
+    }
+
+    if (AVL_rebuild(t, old.a, k))
+        c=-1;
+    free(old.a);
+    return(c);
+}
+
+
+//
+//  Batched delete.  Returns the number of items deleted.
+//
+int AVL_deleteBatch(AVL_TREE *t, void **keys, int n, void **out)
+{
+    int *idx;
+    int i;
+    int c=-1;
+
+    if (n<=0)
+        return(0);
+    if (out)
+        memset(out, 0, n*sizeof(void*));
+
+    //  Without memory to sort, just do them one by one:
+    idx=(int*)malloc(2*n*sizeof(int));
+    if (idx==NULL)
+    {
+        c=0;
+        for (i=0; i<n; i+=1)
+        {
+            void *d=AVL_delete(t, keys[i]);
+            if (out)
+                out[i]=d;
+            if (d)
+                c+=1;
+        }
+        return(c);
+    }
+
+    AVL_sortBatch(t, keys, idx, idx+n, n);
+    if (AVL_batchMerge(t, n))
+        c=AVL_mergeDelete(t, keys, idx, n, out);
+    if (c<0)
+    {
+        AVL_CURSOR f;
+
+        //  The cursor moves on from key to key, and stays valid through
+        //  'cursorDelete', until it runs past the largest item:
+        AVL_cursorFirst(&f, t);
+        c=0;
+        for (i=0; i<n && AVL_cursorValid(&f); i+=1)
+        {
+            void *k=keys[idx[i]];
+            if (AVL_cursorFinger(&f, k, AVL_prefixOf(t, k)))
+            {
+                if (out)
+                    out[idx[i]]=AVL_cursorGet(&f);
+                AVL_cursorDelete(&f);
+                c+=1;
+            }
+        }
+    }
+    free(idx);
+    return(c);
+}
+
+
+
+
+//
+//  Split and join.
+//
+//  Join is the classic AVL join:  to join 'l', pivot 'k', and 'r' where 'l'
+//  is much taller, walk down the right spine of 'l' to the first subtree
+//  that is about as tall as 'r', and hang 'k' there with that subtree on its
+//  left and 'r' on its right.  That subtree grew by one level, which is then
+//  propagated back up the spine as in an insert.  The mirror image applies
+//  when 'r' is the taller one.  Split descends to the key, taking the tree
+//  apart, and joins the pieces back together on the way up.  Both are
+//  O(log n), and only rewire existing nodes.
+//
+//  Nodes only carry their balance, so the heights of subtrees are derived
+//  on the way down from the height of the top of the tree:
+//
+#define AVL_hleft(n,h)      ((h)-1-(AVL_getbal(n)>0))
+#define AVL_hright(n,h)     ((h)-1-(AVL_getbal(n)<0))
+
+
+//
+//  Internal method:  rotates around 'a', which has a balance of +2 or -2,
+//  exactly as in the rebalancing scenarios of 'delete'.  Returns the new
+//  top of the subtree, and in 'dh' the change in height (0 or -1).
+//  With 't', a tree in concurrent mode, the nodes that get new children,
+//  other than the new top, are copies (see 'copyNode').  The nodes they
+//  replace are left in 'old', for the caller to free once the new top is
+//  linked in.
+//
+AVL_NODE *AVL_rotate(AVL_TREE *t, AVL_NODE *a, int *dh, AVL_NODE **old)
+{
+    AVL_NODE *b, *c;
+    int s=(AVL_getbal(a)>0 ? 1 : -1);   //  Heavy side
+
+    old[0]=NULL;
+    old[1]=NULL;
+    if (s>0)
+        b=AVL_right(a);
+    else
+        b=AVL_left(a);
+
+    if (AVL_getbal(b)*s>=0)
+    {
+        //  Scenario 1, single rotation:
+        if (t)
+        {
+            old[0]=a;
+            a=AVL_copyNode(t, a);
+        }
+        if (s>0)
+        {
+            AVL_setRight(a, AVL_left(b));
+            AVL_setLeft(b, a);
+        }
+        else
+        {
+            AVL_setLeft(a, AVL_right(b));
+            AVL_setRight(b, a);
+        }
+        if (AVL_getbal(b)==0)
+        {
+            AVL_setbal(a,s);
+            AVL_setbal(b,-s);
+            *dh=0;
+        }
+        else
+        {
+            AVL_setbal(a,0);
+            AVL_setbal(b,0);
+            *dh=-1;
+        }
+        AVL_recount(a);
+        AVL_recount(b);
+        return(b);
+    }
+
+    //  Scenario 2, double rotation, 'c' becomes the top:
+    if (t)
     {
-        AVL_NODE *a, *b, *s1, *s2, *s3, *s4;   //  'c' and 'p' already exist.
+        old[0]=a;
+        a=AVL_copyNode(t, a);
+        old[1]=b;
+        b=AVL_copyNode(t, b);
+    }
+    if (s>0)
+    {
+        c=AVL_left(b);
+        AVL_setRight(a, AVL_left(c));
+        AVL_setLeft(b, AVL_right(c));
+        AVL_setLeft(c, a);
+        AVL_setRight(c, b);
+    }
+    else
+    {
+        c=AVL_right(b);
+        AVL_setLeft(a, AVL_right(c));
+        AVL_setRight(b, AVL_left(c));
+        AVL_setRight(c, a);
+        AVL_setLeft(c, b);
+    }
+    if (AVL_getbal(c)==-s)
+    {
+        AVL_setbal(a,0);
+        AVL_setbal(b,s);
+    }
+    else if (AVL_getbal(c)==0)
+    {
+        AVL_setbal(a,0);
+        AVL_setbal(b,0);
+    }
+    else
+    {
+        AVL_setbal(a,-s);
+        AVL_setbal(b,0);
+    }
+    AVL_setbal(c,0);
+    *dh=-1;
+    AVL_recount(a);
+    AVL_recount(b);
+    AVL_recount(c);
+    return(c);
+}
 
-        //  Get 'a', and 'p'.
-        top-=1;
-        a=stack[top];
-        if (top>0)
-            p=stack[top-1];
-        else
-            p=NULL;
 
-        //  Which scenario are we in?
-        if (AVL_getbal((*a).f)==2)
+//
+//  Internal method:  joins 'l' (of height 'hl'), the single node 'k', and
+//  'r' (of height 'hr').  Everything in 'l' must sort before 'k', and
+//  everything in 'r' after.  Returns the top, and the height in 'h'.
+//  't' is NULL, or the tree in concurrent mode that 'l' is the top of, in
+//  which case the rotations on the spine of 'l' copy what they change.
+//
+AVL_NODE *AVL_joinNodes(AVL_TREE *t, AVL_NODE *l, int hl, AVL_NODE *k, AVL_NODE *r, int hr, int *h)
+{
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    AVL_NODE *c, *top;
+    int hc;
+    int s;          //  Side on which the spine is followed
+    int i;
+    int grow=1;     //  Is the subtree under the spine still growing?
+
+    //  Close enough in height, 'k' simply goes on top:
+    if (hl<=hr+1 && hr<=hl+1)
+    {
+        AVL_setLeft(k, l);
+        AVL_setRight(k, r);
+        AVL_setbal(k, hr-hl);
+        AVL_recount(k);
+        *h=(hl>hr ? hl : hr)+1;
+        return(k);
+    }
+
+    //  Walk down the spine of the taller tree, to a subtree that is
+    //  as tall as the other tree, or one taller:
+    i=0;
+    if (hl>hr)
+    {
+        s=+1;
+        top=l;
+        c=l;
+        hc=hl;
+        while (hc>hr+1)
         {
-            //
-            //  Heavy on the 'r' side
-            //
-            s1=(*a).l;
-            b=(*a).r;
-            if (AVL_getbal((*b).f)>=0)
-            {
-                //
-                //  Scenario 1, with the right most tree heaviest, or both
-                //  subtrees 's3' and 's4' being equal.  'c' cannot be NULL
-                //  otherwise bal(a) could not have been 2.
-                //
-                s2=(*b).l;
-                c=(*b).r;
-                s3=(*c).l;
-                s4=(*c).r;
+            stack[i]=c;
+            i+=1;
+            hc=AVL_hright(c,hc);
+            c=AVL_right(c);
+        }
+        AVL_setLeft(k, c);
+        AVL_setRight(k, r);
+        AVL_setbal(k, hr-hc);
+        AVL_setRight(stack[i-1], k);
+        *h=hl;
+    }
+    else
+    {
+        s=-1;
+        top=r;
+        c=r;
+        hc=hr;
+        while (hc>hl+1)
+        {
+            stack[i]=c;
+            i+=1;
+            hc=AVL_hleft(c,hc);
+            c=AVL_left(c);
+        }
+        AVL_setRight(k, c);
+        AVL_setLeft(k, l);
+        AVL_setbal(k, hc-hl);
+        AVL_setLeft(stack[i-1], k);
+        *h=hr;
+    }
+    AVL_recount(k);
 
-                //  Now stitch the trees correctly.
-                //  The subtree under 'c' does not change.
-                (*a).l=s1;
-                (*a).r=s2;
-                (*b).l=a;
-                (*b).r=c;
+    //  The subtree that 'k' replaced is now one taller.  Propagate up:
+    while (i>0)
+    {
+        i-=1;
+        c=stack[i];
+        if (grow)
+        {
+            if (s>0)
+                AVL_incbal(c);
+            else
+                AVL_decbal(c);
 
-                //  Parent 'p' might be NULL, in which case modify the root.
-                if (p)
+            if (AVL_getbal(c)==0)
+                grow=0;
+            else if (AVL_getbal(c)==2*s)
+            {
+                int dh;
+                AVL_NODE *old[2];
+                AVL_NODE *n=AVL_rotate((s>0 ? t : NULL), c, &dh, old);
+                if (dh<0)
+                    grow=0;
+                //  Hook the rotated subtree back in:
+                if (i>0)
                 {
-                    if ((*p).l==a)
-                        (*p).l=b;
+                    if (s>0)
+                        AVL_setRight(stack[i-1], n);
                     else
-                        (*p).r=b;
+                        AVL_setLeft(stack[i-1], n);
                 }
                 else
-                    (*t).top=b;
-
-                //  
-                //  Set the balances:
-                //
-                if (AVL_getbal((*b).f)==0)
-                {
-                    //  bal(a)=+1  bal(b)=-1  bal(c)=unchanged, height(p)=unchanged (because s2 is +1 taller)
-                    AVL_setbal((*a).f,+1);
-                    AVL_setbal((*b).f,-1);
-                    //  No balance update necessary for 'p', but still set 'a' to be correct.
-                    h=0;
-                    a=b;
-                }
-                else   //  Balance under 'b' was '1'
-                {
-                    //  bal(a)=0  bal(b)=0  bal(c)=unchanged,  height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,0);
-                    //  Make sure that 'a' is set right, so the comparision on
-                    //  the balance update is done correctly below.
-                    //  (*p).l/r has now been changed from 'a' to 'c':
-                    h=-1;
-                    a=b;
-                }
+                    top=n;
+                if (old[0])
+                    AVL_freeNode(t, old[0]);
+                if (old[1])
+                    AVL_freeNode(t, old[1]);
+                c=n;
             }
-            else
-            {
-                //
-                //  This is scenario 2, with the left-most tree heaviest.
-                //  Both 's2' and 's3' might be NULL, 'c' cannot be NULL.
-                //
-                c=(*b).l;
-                s4=(*b).r;
-                s2=(*c).l;
-                s3=(*c).r;
+        }
+        AVL_recount(c);
+    }
+    if (grow)
+        *h+=1;
+    return(top);
+}
 
-                //  Sttich the rotated tree correctly, 'c' becomes root:
-                (*c).l=a;
-                (*c).r=b;
-                (*a).r=s2;
-                (*b).l=s3;
 
-                //  Again, 'p' might be NULL.
-                if (p)
-                {
-                    if ((*p).l==a)
-                        (*p).l=c;
-                    else
-                        (*p).r=c;
-                }
-                else
-                    (*t).top=c;
+//
+//  Internal method:  splits the subtree 'n' of height 'h' around 'k', into
+//  'l' with everything smaller, and 'r' with everything bigger.  A node that
+//  matches 'k' is returned in 'm', on its own.  Recursion is as deep as
+//  the tree is tall.
+//
+void AVL_splitNodes(AVL_TREE *t, AVL_NODE *n, int h, void *k, AVL_NODE **l, int *hl, AVL_NODE **r, int *hr, AVL_NODE **m)
+{
+    AVL_NODE *a=NULL, *b=NULL;
+    int ha, hb;
+    int e;
 
-                //
-                //  Balances:
-                //
-                if (AVL_getbal((*c).f)==-1)
-                {
-                    //  bal(a)=0  bal(b)=+1  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,+1);
-                }
-                else if (AVL_getbal((*c).f)==0)
-                {
-                    //  bal(a)=0  bal(b)=0  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,0);
-                }
-                else //  (AVL_getbal((*c).f)==+1)
-                {
-                    //  bal(a)=-1  bal(b)=0  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,-1);
-                    AVL_setbal((*b).f,0);
-                }
-                //  Balance on 'c' is always 0.
-                AVL_setbal((*c).f, 0);
-                //  Make sure that 'a' is set right, so the comparision on
-                //  the balance update is done correctly below.
-                //  (*p).l/r has now been changed from 'a' to 'c':
-                h=-1;
-                a=c;
-            }
+    if (n==NULL)
+    {
+        *l=NULL;
+        *hl=0;
+        *r=NULL;
+        *hr=0;
+        return;
+    }
+
+    e=(*t).eval((*n).d, k, (*t).user);
+    if (e==0)
+    {
+        *l=AVL_left(n);
+        *hl=AVL_hleft(n,h);
+        *r=AVL_right(n);
+        *hr=AVL_hright(n,h);
+        *m=n;
+    }
+    else if (e<0)
+    {
+        //  'k' is on the left, 'n' and its right subtree go right:
+        b=AVL_right(n);
+        hb=AVL_hright(n,h);
+        AVL_splitNodes(t, AVL_left(n), AVL_hleft(n,h), k, l, hl, &a, &ha, m);
+        *r=AVL_joinNodes(NULL, a, ha, n, b, hb, hr);
+    }
+    else
+    {
+        //  'k' is on the right, 'n' and its left subtree go left:
+        a=AVL_left(n);
+        ha=AVL_hleft(n,h);
+        AVL_splitNodes(t, AVL_right(n), AVL_hright(n,h), k, &b, &hb, r, hr, m);
+        *l=AVL_joinNodes(NULL, a, ha, n, b, hb, hl);
+    }
+    return;
+}
+
+
+//
+//  Internal method:  counts the nodes under 'n' (w/o recursion).
+//
+int AVL_countNodes(AVL_NODE *n)
+{
+#ifdef AVL_ORDER_STAT
+    return(AVL_count(n));
+#else
+    AVL_NODE *stack[AVL_MAX_DEPTH];
+    int top=0;
+    int c=0;
+
+    while (n!=NULL || top>0)
+    {
+        //  All the way left, then one step right:
+        while (n!=NULL && top<AVL_MAX_DEPTH)
+        {
+            stack[top]=n;
+            top+=1;
+            n=AVL_left(n);
+        }
+        top-=1;
+        n=AVL_right(stack[top]);
+        c+=1;
+    }
+    return(c);
+#endif
+}
+
+
+//
+//  The size of 't', counted first if a split left it unknown.  The nodes
+//  that came and went since were counted in and out of 'size' as usual,
+//  but from an unknown start, so the count replaces it.
+//
+int AVL_size(AVL_TREE *t)
+{
+    if ((*t).uncounted)
+    {
+        (*t).size=AVL_countNodes((*t).top);
+        (*t).uncounted=0;
+    }
+    return((*t).size);
+}
+
+
+//
+//  Splits 't' around 'k'.
+//
+int AVL_split(AVL_TREE *t, void *k, AVL_TREE **left, AVL_TREE **right)
+{
+    AVL_NODE *l, *r, *m=NULL;
+    AVL_NODE *top=(*t).top;
+    int hl, hr;
+
+    *left=AVL_newShared(t);
+    *right=AVL_newShared(t);
+    if (*left==NULL || *right==NULL)
+    {
+        if (*left)
+            free(*left);
+        if (*right)
+            free(*right);
+        *left=NULL;
+        *right=NULL;
+        return(2);
+    }
+
+    //  Concurrent readers find 't' empty from here on.  Those still inside
+    //  only meet its own nodes, rewired but none freed:
+    AVL_store((*t).top, NULL);
+    AVL_splitNodes(t, top, (*t).height, k, &l, &hl, &r, &hr, &m);
+
+    //  A match is the smallest item on the right:
+    if (m)
+        r=AVL_joinNodes(NULL, NULL, 0, m, r, hr, &hr);
+
+    AVL_store((**left).top, l);
+    (**left).height=hl;
+    AVL_store((**right).top, r);
+    (**right).height=hr;
+#ifdef AVL_ORDER_STAT
+    (**left).size=AVL_count(l);
+    (**right).size=AVL_count(r);
+#else
+    //  Counting either half would make the split O(n), so 'size' does:
+    (**left).uncounted=1;
+    (**right).uncounted=1;
+#endif
+
+    (*t).height=0;
+    (*t).size=0;
+    (*t).uncounted=0;
+    (*t).mod+=1;
+    AVL_resetEnds(*left);
+    AVL_resetEnds(*right);
+    AVL_resetEnds(t);
+
+    //  The halves free nodes at once, so they wait for those readers:
+    AVL_synchronize(t);
+    return(0);
+}
+
+
+//
+//  Joins 'left', 'pivot', and 'right' into 'left'.
+//
+int AVL_join(AVL_TREE *left, void *pivot, AVL_TREE *right)
+{
+    AVL_NODE *lmax, *rmin, *k, *top;
+
+    if (!AVL_sameSet(left, right))
+        return(3);
+
+    //  The order is checked on the largest item on the left,
+    //  and the smallest on the right:
+    lmax=(*left).top;
+    while (lmax && AVL_right(lmax))
+        lmax=AVL_right(lmax);
+    rmin=(*right).top;
+    while (rmin && AVL_left(rmin))
+        rmin=AVL_left(rmin);
+
+    if (pivot==NULL)
+    {
+        if (rmin==NULL)
+            return(0);
+        if (lmax && (*left).eval((*lmax).d, (*rmin).d, (*left).user)<=0)
+            return(1);
+    }
+    else
+    {
+        if (rmin && (*right).eval((*rmin).d, pivot, (*right).user)>=0)
+            return(1);
+        if (lmax && (*left).eval((*lmax).d, pivot, (*left).user)<=0)
+            return(1);
+    }
+
+    //  The node for the pivot comes first, and in concurrent mode the
+    //  copies of the rotations (see 'joinNodes'), so that running out of
+    //  memory leaves both trees as they were:
+    if ((*left).epoch && AVL_reserve(left))
+        return(2);
+    k=AVL_newNode(left);
+    if (k==NULL)
+        return(2);
+
+    //  Without a pivot, the smallest item on the right is taken out, to
+    //  serve as the pivot:
+    if (pivot==NULL)
+        pivot=AVL_popMin(right);
+    AVL_store((*k).d, pivot);
+    AVL_setPrefix(k, AVL_prefixOf(left, pivot));
+
+    //  Concurrent readers find 'right' empty from here on, and those
+    //  still inside only meet its own nodes.  Those of 'left' see it
+    //  whole until the join is linked in:
+    top=(*right).top;
+    AVL_store((*right).top, NULL);
+    AVL_store((*left).top, AVL_joinNodes(((*left).epoch ? left : NULL), (*left).top, (*left).height, k, top, (*right).height, &((*left).height)));
+    (*left).size+=(*right).size;
+    (*left).uncounted|=(*right).uncounted;
+    (*left).mod+=1;
+
+    (*right).height=0;
+    (*right).size=0;
+    (*right).uncounted=0;
+    (*right).mod+=1;
+    AVL_resetEnds(left);
+    AVL_resetEnds(right);
+
+    //  Readers of 'right' may still be on the nodes it gave up, which
+    //  'left' frees at once unless it is in concurrent mode as well:
+    AVL_synchronize(right);
+    return(0);
+}
+
+
+
+
+//
+//  Set operations, built on split and join.
+//
+//  Union:         split 'b' around the top of 'a', take the union of the
+//                 left halves and of the right halves, and join the two
+//                 results with the top of 'a'.
+//  Intersection:  idem, but the top of 'a' is only kept if it was found in
+//                 'b', otherwise the two halves are joined without it.
+//  Difference:    split 'a' around the top of 'b', which is dropped, as is
+//                 the matching node of 'a', if any.
+//
+//  The work is O(m log(n/m+1)) for trees of size m<=n.  The two halves are
+//  independent, so they run on separate threads while the thread budget
+//  lasts and the subtrees are tall enough to be worth it.  Dropped nodes
+//  are collected on a list per task, and only returned to their blocks
+//  when all threads are done, as the block lists are not thread-safe.
+//
+#define AVL_SETOP_UNION         0
+#define AVL_SETOP_INTERSECT     1
+#define AVL_SETOP_DIFFERENCE    2
+
+//  Subtrees shorter than this are not worth a thread:
+#define AVL_SETOP_GRAIN         12
+
+typedef struct
+{
+    AVL_TREE *t;            //  For 'eval'
+    int op;
+    int nt;                 //  Thread budget
+    AVL_NODE *a, *b;        //  Input subtrees,
+    int ha, hb;             //  and their heights
+    AVL_NODE *r;            //  Result,
+    int hr;                 //  and its height
+    AVL_NODE *dh, *dt;      //  Dropped nodes (head and tail, linked on 'r')
+}
+AVL_SETOP;
+
+
+//
+//  Internal method:  puts a node on the list of dropped nodes.
+//
+void AVL_setOpDrop(AVL_SETOP *s, AVL_NODE *n)
+{
+    AVL_setRight(n, (*s).dh);
+    if ((*s).dh==NULL)
+        (*s).dt=n;
+    (*s).dh=n;
+    return;
+}
+
+//
+//  Internal method:  drops a whole subtree.  Pushing the right
+//  and then the left child keeps the stack within the height.
+//
+void AVL_setOpDropAll(AVL_SETOP *s, AVL_NODE *n)
+{
+    AVL_NODE *stack[AVL_MAX_DEPTH+1];
+    int top=0;
+
+    if (n==NULL)
+        return;
+    stack[top]=n;
+    top+=1;
+    while (top>0)
+    {
+        top-=1;
+        n=stack[top];
+        if (AVL_right(n))
+        {
+            stack[top]=AVL_right(n);
+            top+=1;
+        }
+        if (AVL_left(n))
+        {
+            stack[top]=AVL_left(n);
+            top+=1;
+        }
+        AVL_setOpDrop(s, n);
+    }
+    return;
+}
+
+//
+//  Internal method:  appends the dropped nodes of 'x' to those of 's'.
+//
+void AVL_setOpCollect(AVL_SETOP *s, AVL_SETOP *x)
+{
+    if ((*x).dh==NULL)
+        return;
+    AVL_setRight((*x).dt, (*s).dh);
+    if ((*s).dh==NULL)
+        (*s).dt=(*x).dt;
+    (*s).dh=(*x).dh;
+    return;
+}
+
+//
+//  Internal method:  takes the largest node out of 'n' (of height 'h').
+//  Returns that node, and the rest of the tree in 'rest'.
+//
+AVL_NODE *AVL_splitLast(AVL_NODE *n, int h, AVL_NODE **rest, int *hrest)
+{
+    AVL_NODE *m, *r;
+    int hr;
+
+    if (AVL_right(n)==NULL)
+    {
+        *rest=AVL_left(n);
+        *hrest=AVL_hleft(n,h);
+        return(n);
+    }
+    m=AVL_splitLast(AVL_right(n), AVL_hright(n,h), &r, &hr);
+    *rest=AVL_joinNodes(NULL, AVL_left(n), AVL_hleft(n,h), n, r, hr, hrest);
+    return(m);
+}
+
+//
+//  Internal method:  joins two trees without a pivot node.
+//
+AVL_NODE *AVL_joinTwo(AVL_NODE *l, int hl, AVL_NODE *r, int hr, int *h)
+{
+    AVL_NODE *k;
+
+    if (l==NULL)
+    {
+        *h=hr;
+        return(r);
+    }
+    k=AVL_splitLast(l, hl, &l, &hl);
+    return(AVL_joinNodes(NULL, l, hl, k, r, hr, h));
+}
+
+void AVL_setOp(AVL_SETOP *s);
+
+void *AVL_setOpThread(void *s)
+{
+    AVL_setOp((AVL_SETOP*)s);
+    return(NULL);
+}
+
+//
+//  Internal method:  the recursive set operation on one pair of subtrees.
+//
+void AVL_setOp(AVL_SETOP *s)
+{
+    AVL_SETOP x, y;
+    AVL_NODE *k, *m=NULL;
+    pthread_t tid;
+    int spawned=0;
+
+    (*s).dh=NULL;
+    (*s).dt=NULL;
+
+    //  Either side empty:
+    if ((*s).a==NULL || (*s).b==NULL)
+    {
+        (*s).r=NULL;
+        (*s).hr=0;
+        if ((*s).op==AVL_SETOP_UNION)
+        {
+            (*s).r=((*s).a ? (*s).a : (*s).b);
+            (*s).hr=((*s).a ? (*s).ha : (*s).hb);
         }
-        else if (AVL_getbal((*a).f)==-2)
+        else if ((*s).op==AVL_SETOP_DIFFERENCE && (*s).a)
         {
-            //
-            //  Heavy on the 'l' side (symmetric to right)
-            //
-            s1=(*a).r;
-            b=(*a).l;
-            if (AVL_getbal((*b).f)<=0)
-            {
-                //
-                //  Scenario 1, with the left most tree heaviest, or both
-                //  subtrees 's3' and 's4' being equal.  'c' cannot be NULL
-                //  otherwise bal(a) could not have been -2.
-                //
-                s2=(*b).r;
-                c=(*b).l;
-                s3=(*c).r;
-                s4=(*c).l;
+            (*s).r=(*s).a;
+            (*s).hr=(*s).ha;
+        }
+        else
+        {
+            AVL_setOpDropAll(s, (*s).a);
+            AVL_setOpDropAll(s, (*s).b);
+        }
+        return;
+    }
 
-                //  Now stitch the trees correctly.
-                //  The subtree under 'c' does not change.
-                (*a).r=s1;
-                (*a).l=s2;
-                (*b).r=a;
-                (*b).l=c;
+    x=*s;
+    y=*s;
+    if ((*s).op==AVL_SETOP_DIFFERENCE)
+    {
+        //  Split 'a' around the top of 'b':
+        k=(*s).b;
+        AVL_splitNodes((*s).t, (*s).a, (*s).ha, (*k).d, &(x.a), &(x.ha), &(y.a), &(y.ha), &m);
+        x.b=AVL_left(k);
+        x.hb=AVL_hleft(k,(*s).hb);
+        y.b=AVL_right(k);
+        y.hb=AVL_hright(k,(*s).hb);
+    }
+    else
+    {
+        //  Split 'b' around the top of 'a':
+        k=(*s).a;
+        AVL_splitNodes((*s).t, (*s).b, (*s).hb, (*k).d, &(x.b), &(x.hb), &(y.b), &(y.hb), &m);
+        x.a=AVL_left(k);
+        x.ha=AVL_hleft(k,(*s).ha);
+        y.a=AVL_right(k);
+        y.ha=AVL_hright(k,(*s).ha);
+    }
 
-                //  Parent 'p' might be NULL, in which case modify the root.
-                if (p)
-                {
-                    if ((*p).l==a)
-                        (*p).l=b;
-                    else
-                        (*p).r=b;
-                }
-                else
-                    (*t).top=b;
+    //  Fork, if there is budget, and enough work:
+    if ((*s).nt>1 && (*s).ha>=AVL_SETOP_GRAIN && (*s).hb>=AVL_SETOP_GRAIN)
+    {
+        x.nt=(*s).nt/2;
+        y.nt=(*s).nt-x.nt;
+        spawned=(pthread_create(&tid, NULL, AVL_setOpThread, &x)==0);
+        if (!spawned)
+            y.nt=(*s).nt;
+    }
+    if (!spawned)
+        AVL_setOp(&x);
+    AVL_setOp(&y);
+    if (spawned)
+        pthread_join(tid, NULL);
+
+    //  Join:
+    AVL_setOpCollect(s, &x);
+    AVL_setOpCollect(s, &y);
+    if (m)
+        AVL_setOpDrop(s, m);
+    if ((*s).op==AVL_SETOP_UNION || ((*s).op==AVL_SETOP_INTERSECT && m))
+        (*s).r=AVL_joinNodes(NULL, x.r, x.hr, k, y.r, y.hr, &((*s).hr));
+    else
+    {
+        AVL_setOpDrop(s, k);
+        (*s).r=AVL_joinTwo(x.r, x.hr, y.r, y.hr, &((*s).hr));
+    }
+    return;
+}
 
-                //  
-                //  Set the balances:
-                //
-                if (AVL_getbal((*b).f)==0)
+//
+//  Internal method:  a set operation on trees in concurrent mode.  Split
+//  and join would take 'a' apart under its readers, so instead the result
+//  is merged from the sorted items of both, and built on the side by
+//  'rebuild', which links it in with a single store.  O(n+m).  Returns 0
+//  on success, or 2 if out of memory, with both trees untouched.
+//
+int AVL_setOpMerge(AVL_TREE *a, AVL_TREE *b, int op)
+{
+    AVL_COLLECT x, y;
+    void **r;
+    int i=0, j=0, k=0;
+    int rc=2;
+
+    x.a=(void**)malloc((AVL_size(a)+1)*sizeof(void*));
+    y.a=(void**)malloc((AVL_size(b)+1)*sizeof(void*));
+    r=(void**)malloc((AVL_size(a)+AVL_size(b)+1)*sizeof(void*));
+    if (x.a && y.a && r)
+    {
+        x.n=0;
+        y.n=0;
+        AVL_walk(a, AVL_collect, &x);
+        AVL_walk(b, AVL_collect, &y);
+        while (i<x.n || j<y.n)
+        {
+            //  Which comes first, or both:
+            int e=(i==x.n ? -1 : (j==y.n ? 1 : (*a).eval(x.a[i], y.a[j], (*a).user)));
+            if (e>0)
+            {
+                if (op!=AVL_SETOP_INTERSECT)
                 {
-                    //  bal(a)=-1  bal(b)=+1  bal(c)=unchanged, height(p)=unchanged (because s2 is +1 taller)
-                    AVL_setbal((*a).f,-1);
-                    AVL_setbal((*b).f,+1);
-                    //  No balance update necessary for 'p', but still set 'a' to be correct.
-                    h=0;
-                    a=b;
+                    r[k]=x.a[i];
+                    k+=1;
                 }
-                else   //  Balance under 'b' was '-1'
+                i+=1;
+            }
+            else if (e<0)
+            {
+                if (op==AVL_SETOP_UNION)
                 {
-                    //  bal(a)=0  bal(b)=0  bal(c)=unchanged,  height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,0);
-                    //  Make sure that 'a' is set right, so the comparision on
-                    //  the balance update is done correctly below.
-                    //  (*p).l/r has now been changed from 'a' to 'c':
-                    h=-1;
-                    a=b;
+                    r[k]=y.a[j];
+                    k+=1;
                 }
+                j+=1;
             }
             else
             {
-                //
-                //  This is scenario 2, with the left-most tree heaviest.
-                //  Both 's2' and 's3' might be NULL, 'c' cannot be NULL.
-                //
-                c=(*b).r;
-                s4=(*b).l;
-                s2=(*c).r;
-                s3=(*c).l;
-
-                //  Sttich the rotated tree correctly, 'c' becomes root:
-                (*c).r=a;
-                (*c).l=b;
-                (*a).l=s2;
-                (*b).r=s3;
-
-                //  Again, 'p' might be NULL.
-                if (p)
-                {
-                    if ((*p).l==a)
-                        (*p).l=c;
-                    else
-                        (*p).r=c;
-                }
-                else
-                    (*t).top=c;
-
-                //
-                //  Balances:
-                //
-                if (AVL_getbal((*c).f)==+1)
-                {
-                    //  bal(a)=0  bal(b)=+1  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,-1);
-                }
-                else if (AVL_getbal((*c).f)==0)
-                {
-                    //  bal(a)=0  bal(b)=0  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,0);
-                    AVL_setbal((*b).f,0);
-                }
-                else //  (AVL_getbal((*c).f)==+1)
+                if (op!=AVL_SETOP_DIFFERENCE)
                 {
-                    //  bal(a)=-1  bal(b)=0  bal(c)=0,   height(p)=-1
-                    AVL_setbal((*a).f,+1);
-                    AVL_setbal((*b).f,0);
+                    r[k]=x.a[i];
+                    k+=1;
                 }
-                //  Balance on 'c' is always 0.
-                AVL_setbal((*c).f, 0);
-                //  Make sure that 'a' is set right, so the comparision on
-                //  the balance update is done correctly below.
-                //  (*p).l/r has now been changed from 'a' to 'c':
-                h=-1;
-                a=c;
+                i+=1;
+                j+=1;
             }
         }
-        //  Else, no rotations necessary.
+        rc=AVL_rebuild(a, r, k);
+        if (rc==0)
+            AVL_flush(b);
+    }
+    free(x.a);
+    free(y.a);
+    free(r);
+    return(rc);
+}
+
+//
+//  Internal method:  runs a set operation on two whole trees.
+//
+int AVL_setOpTrees(AVL_TREE *a, AVL_TREE *b, int op, int threads)
+{
+    AVL_SETOP s;
 
+    if (!AVL_sameSet(a, b))
+        return(3);
+    if (a==b)
+    {
+        if (op==AVL_SETOP_DIFFERENCE)
+            AVL_flush(a);
+        return(0);
+    }
+    if ((*a).epoch || (*b).epoch)
+        return(AVL_setOpMerge(a, b, op));
+
+    s.t=a;
+    s.op=op;
+    s.nt=(threads<1 ? 1 : threads);
+    s.a=(*a).top;
+    s.ha=(*a).height;
+    s.b=(*b).top;
+    s.hb=(*b).height;
+    AVL_setOp(&s);
+
+    //  All nodes of 'b' now belong to 'a', and the dropped ones are freed:
+    AVL_store((*a).top, s.r);
+    (*a).height=s.hr;
+    (*a).size+=(*b).size;
+    (*a).uncounted|=(*b).uncounted;
+    (*a).mod+=1;
+    AVL_store((*b).top, NULL);
+    (*b).height=0;
+    (*b).size=0;
+    (*b).uncounted=0;
+    (*b).mod+=1;
+    AVL_resetEnds(a);
+    AVL_resetEnds(b);
+    while (s.dh)
+    {
+        AVL_NODE *n=s.dh;
+        s.dh=AVL_right(n);
+        AVL_freeNode(a, n);
+    }
+    return(0);
+}
 
-        //  Is there still a height change?
-        if (h!=0)
-        {
-            //  We are propagating a height change on the subtree.
-            //  Check the balances of the parent node 'p' and
-            //  adjust accordingly.
-            if (p)
-            {
-                //  Note that 'a' was reset correctly if a rotation was performed.
-                if ((*p).l==a)
-                    AVL_incbal((*p).f);
-                else
-                    AVL_decbal((*p).f);
+int AVL_union(AVL_TREE *a, AVL_TREE *b, int threads)
+{
+    return(AVL_setOpTrees(a, b, AVL_SETOP_UNION, threads));
+}
 
-                //  At this point, if bal(p) is now zero, it means that height
-                //  under 'p' was lost, otherwise, height under 'p' is dominated
-                //  by the other (non-rotated) subtree.
-                if (AVL_getbal((*p).f)==0)
-                    h=-1;
-                else
-                    h=0;
-            }
-            //  No 'p' means we are at the top of the tree, which is
-            //  handled below, and outside of this while-block.
-        }
+int AVL_intersect(AVL_TREE *a, AVL_TREE *b, int threads)
+{
+    return(AVL_setOpTrees(a, b, AVL_SETOP_INTERSECT, threads));
+}
+
+int AVL_difference(AVL_TREE *a, AVL_TREE *b, int threads)
+{
+    return(AVL_setOpTrees(a, b, AVL_SETOP_DIFFERENCE, threads));
+}
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Concurrent readers                                                 *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Switches the tree to concurrent mode.  Must be called before any
+//  reader joins, by the writer.
+//
+int AVL_concurrent(AVL_TREE *t)
+{
+    AVL_EPOCH *e;
+
+    if ((*t).epoch)
+        return(0);
+    e=(AVL_EPOCH*)malloc(sizeof(AVL_EPOCH));
+    if (e==NULL)
+        return(2);
+    memset(e, 0, sizeof(AVL_EPOCH));
+    //  Epoch 0 is reserved for readers outside of the tree:
+    (*e).epoch=1;
+    (*t).epoch=e;
+    return(0);
+}
+
+
+//
+//  Reader registration.  Records are never freed until the tree is
+//  destroyed, so the writer can scan the list without locking.
+//
+AVL_READER *AVL_readerJoin(AVL_TREE *t)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    AVL_READER *r;
+
+    if (e==NULL)
+        return(NULL);
+
+    //  Take over the record of a reader that left:
+    for (r=__atomic_load_n(&((*e).readers), __ATOMIC_ACQUIRE); r; r=(*r).next)
+    {
+        if (__atomic_exchange_n(&((*r).used), 1, __ATOMIC_ACQ_REL)==0)
+            return(r);
     }
 
+    r=(AVL_READER*)malloc(sizeof(AVL_READER));
+    if (r)
+    {
+        memset(r, 0, sizeof(AVL_READER));
+        (*r).used=1;
+        (*r).next=__atomic_load_n(&((*e).readers), __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&((*e).readers), &((*r).next), r, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+    return(r);
+}
 
-    //  If we are still propagating a height after
-    //  reaching the root of the tree, record it now:
-    //  This specificially needs to be outside of the balance
-    //  section for 1 and 2-node trees.
-    if (h<0)
-        (*t).height-=1;
+void AVL_readerLeave(AVL_READER *r)
+{
+    if (r==NULL)
+        return;
+    __atomic_store_n(&((*r).epoch), 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&((*r).used), 0, __ATOMIC_RELEASE);
+    return;
+}
+
+
+//
+//  The reader announces the epoch it entered in, which holds back the
+//  reclaiming of anything it may run into.  The search itself is 'find',
+//  with every pointer loaded atomically, once:  the writer only links in
+//  changes that are complete (see 'copyNode'), so whatever the reader
+//  follows is the tree before or after a change.  Only a reader that was
+//  inside while 'split' or 'join' took the tree apart can be led in a
+//  circle, so the depth is bounded.
+//
+void *AVL_findConcurrent(AVL_TREE *t, AVL_READER *r, void *k)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    AVL_NODE *c;
+    void *d=NULL;
+    int depth=0;
+
+    __atomic_store_n(&((*r).epoch), __atomic_load_n(&((*e).epoch), __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    c=__atomic_load_n(&((*t).top), __ATOMIC_ACQUIRE);
+    while (c!=NULL && depth<AVL_MAX_DEPTH)
+    {
+        void *cd=__atomic_load_n(&((*c).d), __ATOMIC_ACQUIRE);
+        int v=(*t).eval(cd, k, (*t).user);
+        if (v==0)
+        {
+            d=cd;
+            c=NULL;
+        }
+        else if (v<0)
+            c=AVL_untag(__atomic_load_n(&((*c).l), __ATOMIC_ACQUIRE));
+        else
+            c=AVL_untag(__atomic_load_n(&((*c).r), __ATOMIC_ACQUIRE));
+        depth+=1;
+    }
 
-    //  And the data pointer, if found:
+    __atomic_store_n(&((*r).epoch), 0, __ATOMIC_RELEASE);
     return(d);
 }
 
 
+//
+//  Every reader inside the tree holds back the epoch by at most one, so
+//  after two advances none of them can be left.
+//
+void AVL_synchronize(AVL_TREE *t)
+{
+    AVL_EPOCH *e=(*t).epoch;
+    unsigned long g;
+
+    if (e==NULL)
+        return;
+    g=(*e).epoch;
+    while ((*e).epoch<g+2)
+    {
+        if (!AVL_epochAdvance(t))
+            sched_yield();
+    }
+    return;
+}
+
+
 
 
 
+/************************************************************************
+ *                                                                      *
+ *   Frozen snapshots                                                   *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Internal method:  fills the Eytzinger array 'e' from 'n' sorted items,
+//  in the in-order of the complete tree under index 'i'.  '*next' is the
+//  next sorted item to place.
+//
+void AVL_freezeFill(void **e, void **sorted, int n, int i, int *next)
+{
+    if (i>n)
+        return;
+    AVL_freezeFill(e, sorted, n, 2*i, next);
+    e[i]=sorted[*next];
+    *next+=1;
+    AVL_freezeFill(e, sorted, n, 2*i+1, next);
+    return;
+}
+
+
+//
+//  Internal callback for 'freeze', collects the items in sorted order.
+//
+void AVL_freezeCollect(void *d, void *user)
+{
+    AVL_FROZEN *f=(AVL_FROZEN*)user;
+    (*f).d[(*f).n]=d;
+    (*f).n+=1;
+    return;
+}
+
+
+//
+//  Snapshot of the data pointers in Eytzinger order, and the keys if
+//  'key' is given.  The arrays are aligned to cache lines, so that the
+//  descendants four levels down from 'i' are exactly two lines.
+//
+AVL_FROZEN *AVL_freezeInt64(AVL_TREE *t, int64_t (*key)(void *d, void *user))
+{
+    AVL_FROZEN *f=(AVL_FROZEN*)calloc(1, sizeof(AVL_FROZEN));
+    void **sorted;
+    void *p;
+    int next=0;
+    int n=AVL_size(t);
+    int i;
+
+    if (f==NULL)
+        return(NULL);
+    (*f).eval=(*t).eval;
+    (*f).user=(*t).user;
+    sorted=(void**)malloc((n+1)*sizeof(void*));
+    if (sorted==NULL || posix_memalign(&p, 64, (n+1)*sizeof(void*)))
+    {
+        free(sorted);
+        free(f);
+        return(NULL);
+    }
+
+    //  Sorted first, in the new array, then into place:
+    (*f).d=(void**)p;
+    AVL_walk(t, AVL_freezeCollect, f);
+    memcpy(sorted, (*f).d, n*sizeof(void*));
+    AVL_freezeFill((*f).d, sorted, n, 1, &next);
+    (*f).d[0]=NULL;
+    free(sorted);
+
+    if (key)
+    {
+        if (posix_memalign(&p, 64, (n+1)*sizeof(int64_t)))
+        {
+            AVL_frozenDestroy(f);
+            return(NULL);
+        }
+        (*f).k=(int64_t*)p;
+        (*f).k[0]=0;
+        for (i=1; i<=n; i+=1)
+            (*f).k[i]=key((*f).d[i], (*t).user);
+    }
+    return(f);
+}
+
+AVL_FROZEN *AVL_freeze(AVL_TREE *t)
+{
+    return(AVL_freezeInt64(t, NULL));
+}
+
+void AVL_frozenDestroy(AVL_FROZEN *f)
+{
+    free((*f).d);
+    free((*f).k);
+    free(f);
+    return;
+}
+
+
+//
+//  Both searches find the lower bound:  they go right while the item is
+//  smaller than the key, and left otherwise, all the way down.  The bits
+//  of 'i' are then the path taken, and the lower bound is where it last
+//  went left, found by stripping the trailing right turns (1 bits) and
+//  that one left turn.  Only then is the item checked for a match.
+//
+void *AVL_frozenFind(AVL_FROZEN *f, void *k)
+{
+    void **d=(*f).d;
+    int n=(*f).n;
+    unsigned long i=1;
+
+    while (i<=(unsigned long)n)
+    {
+        __builtin_prefetch(d+16*i);
+        __builtin_prefetch(d+16*i+8);
+        i=2*i+((*f).eval(d[i], k, (*f).user)>0);
+    }
+    i>>=__builtin_ffsl(~i);
+    if (i==0 || (*f).eval(d[i], k, (*f).user)!=0)
+        return(NULL);
+    return(d[i]);
+}
+
+void *AVL_frozenFindInt64(AVL_FROZEN *f, int64_t k)
+{
+    int64_t *a=(*f).k;
+    int n=(*f).n;
+    unsigned long i=1;
+
+    if (a==NULL)
+        return(NULL);
+    while (i<=(unsigned long)n)
+    {
+        __builtin_prefetch(a+16*i);
+        __builtin_prefetch(a+16*i+8);
+        i=2*i+(a[i]<k);
+    }
+    i>>=__builtin_ffsl(~i);
+    if (i==0 || a[i]!=k)
+        return(NULL);
+    return((*f).d[i]);
+}
+
 
 
 
@@ -1218,13 +4921,13 @@ void AVL_walk(AVL_TREE *t, void (*callback)(void *d, void *user), void *user)
             //  Do the operation here -- for root-left-right:
             //  NOTE:  this is NOT the sorted order.
             //callback((*c).d, user);
-            if ((*c).l)
+            if (AVL_left(c))
             {
                 //  Recurse left
                 stack[top]=c;
                 top+=1;
                 p=c;
-                c=(*c).l;
+                c=AVL_left(c);
             }
             else
                 p=NULL;     //  Triggers the next immediate section
@@ -1232,7 +4935,7 @@ void AVL_walk(AVL_TREE *t, void (*callback)(void *d, void *user), void *user)
         //  We just popped up, if 'prev' is one of our
         //  children.  If it is the left, then now we
         //  move to the right.
-        if (p==(*c).l)
+        if (p==AVL_left(c))
         {
             //
             //  Operation here -- for left-root-right 
@@ -1241,18 +4944,18 @@ void AVL_walk(AVL_TREE *t, void (*callback)(void *d, void *user), void *user)
             callback((*c).d, user);
 
             // Recurse right
-            if ((*c).r)
+            if (AVL_right(c))
             {
                 stack[top]=c;
                 top+=1;
                 p=c;
-                c=(*c).r;
+                c=AVL_right(c);
             }
             else
                 p=NULL;     //  Triggers the next immediate section
         }
         //  Previous node is right, we must now move up the stack.
-        if (p==(*c).r)
+        if (p==AVL_right(c))
         {
             top-=1;
             p=c;
@@ -1320,7 +5023,7 @@ void AVL_print(AVL_TREE *t, int x, int y, void (*printLabel)(FILE *stream, void
             printLabel(stdout, (*c).d);
             fprintf(stdout, "</text>\n");
             //  Recurse left:
-            if ((*c).l)
+            if (AVL_left(c))
             {
                 //  Smaller dx steps.
                 dx=x>>(top+1);
@@ -1332,7 +5035,7 @@ void AVL_print(AVL_TREE *t, int x, int y, void (*printLabel)(FILE *stream, void
                 stack[top]=c;
                 top+=1;
                 p=c;
-                c=(*c).l;
+                c=AVL_left(c);
             }
             else
                 p=NULL;     //  Triggers the next immediate section
@@ -1340,7 +5043,7 @@ void AVL_print(AVL_TREE *t, int x, int y, void (*printLabel)(FILE *stream, void
         //  We just popped up, if 'prev' is one of our
         //  children.  If it is the left, then now we
         //  move to the right.
-        if (p==(*c).l)
+        if (p==AVL_left(c))
         {
             //  After all, if we were on the left, then now we've come
             //  up and should adjust our cx by the right amount:
@@ -1350,7 +5053,7 @@ void AVL_print(AVL_TREE *t, int x, int y, void (*printLabel)(FILE *stream, void
                 cx+=dx;
             }
 
-            if ((*c).r)
+            if (AVL_right(c))
             {
                 //  Smaller dx steps.
                 dx=x>>(top+1);
@@ -1362,13 +5065,13 @@ void AVL_print(AVL_TREE *t, int x, int y, void (*printLabel)(FILE *stream, void
                 stack[top]=c;
                 top+=1;
                 p=c;
-                c=(*c).r;
+                c=AVL_right(c);
             }
             else
                 p=NULL;     //  Triggers the next immediate section
         }
         //  Previous node is right, we must now move up the stack.
-        if (p==(*c).r)
+        if (p==AVL_right(c))
         {
             //  How do we "back out" of our cx changes?
             if (p!=NULL)
@@ -1412,17 +5115,24 @@ int AVL_checkBalance(AVL_NODE *n)
 {
     int l,r, a, b;
     if (n==NULL) return(0);
-    l=AVL_checkBalance((*n).l);
-    r=AVL_checkBalance((*n).r);
+    l=AVL_checkBalance(AVL_left(n));
+    r=AVL_checkBalance(AVL_right(n));
     if (l==-1 || r==-1)
         return(-1);
     b=r-l;
-    a=(int)AVL_getbal((*n).f);
+    a=(int)AVL_getbal(n);
     if (b!=a || b<-1 || b>+1)
     {
         fprintf(stderr, "BALANCE ERROR on %i:  l=%i r=%i (b=%i) f=%i\n", *((int*)(*n).d), l, r, b, a);
         return(-1);
     }
+#ifdef AVL_ORDER_STAT
+    if ((*n).s!=AVL_count(AVL_left(n))+AVL_count(AVL_right(n))+1)
+    {
+        fprintf(stderr, "COUNT ERROR on %i:  s=%u l=%u r=%u\n", *((int*)(*n).d), (*n).s, AVL_count(AVL_left(n)), AVL_count(AVL_right(n)));
+        return(-1);
+    }
+#endif
     if (b>0)
         return(r+1);
     return(l+1);
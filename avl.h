@@ -37,10 +37,12 @@
  *  and print-callback methods are given where the data are simple int* pointers.
  *
  *  Memory management:  Nodes for the tree are allocated in blocks of 'N'
- *  (preferably adapted to page size), and stored on a stack of free nodes.
- *  Delete returns nodes to this stack.  If a tree shrinks substantially, the
- *  de-alloc method can be used to return free memory rom the free stack.
- *  Using an allocation size of 128, pages of 4kb worth are allocated at once.
+ *  (preferably adapted to page size), and each block keeps a list of its
+ *  free nodes, and a count of the ones in use.  Delete returns nodes to
+ *  their block.  If a tree shrinks substantially, the de-alloc method can
+ *  be used to return the blocks that are no longer used, or this can be
+ *  done automatically.  Using an allocation size of 128, pages of 4kb worth
+ *  are allocated at once.
  *
  *  This tree is not re-entrant.  Any modification (meaning insert or delete)
  *  must be exclusive.  Any non-modifying method can be concurrent (search/find,
@@ -49,7 +51,8 @@
  *  Serializing the tree is best done through the 'walk' method, that calls
  *  the callback for each object in the tree, in sorted order.  The actual
  *  structure of the tree does not need to be serialized upon storage or
- *  transmission, as it will rebuild automatically upon 'insert' calls.
+ *  transmission, as it will rebuild automatically upon 'insert' calls, or
+ *  in linear time through 'buildSorted' when the items are kept in order.
  *
  *  Inserting, deletion, and rebalancing algorithms adapted from Knuth's art
  *  of computer programming. (pg 458, volume 3, 3rd ed.)
@@ -66,7 +69,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 //  This maximum depth is defined to build static arrays of paths in the
@@ -75,35 +85,277 @@
 #define AVL_MAX_DEPTH 64
 
 
-//  32 bytes on a 64 bit system, 16 bytes on 32-bit system
-typedef struct AVL_NODE_S
+//  Order statistics (rank, select, range counts) are optional, and require
+//  each node to carry the size of its subtree.  Build everything, both the
+//  library and its users, with -DAVL_ORDER_STAT to enable them.  On 64-bit
+//  the count fits in the padding after 'f' and 'b', and the node stays 32 bytes.
+//#define AVL_ORDER_STAT
+
+
+//  Key prefixes are optional as well (see 'keyPrefix'), and keep a 32-bit
+//  prefix of the key in each node, so that most steps of a search compare
+//  that instead of calling 'eval'.  Build with -DAVL_KEY_PREFIX to enable.
+//  On 64-bit the prefix takes the rest of the padding, and the node stays
+//  32 bytes, unless AVL_ORDER_STAT is on too.
+//#define AVL_KEY_PREFIX
+
+
+//  Tagged nodes, also optional, keep the balance and flags in the low bits
+//  of the 'l' and 'r' pointers, and drop 'f' and 'b':  the node is then
+//  24 bytes on 64-bit instead of 32, unless one of the options above is
+//  on as well.  On 32-bit it stays 16, as the 3 tag bits need the nodes
+//  8-byte aligned.  Blocks are then aligned to their size, a power of 2, for a
+//  node to find its block.  Build everything with -DAVL_TAGGED_NODE, and
+//  read 'l' and 'r' only through 'AVL_left' and 'AVL_right'.
+//#define AVL_TAGGED_NODE
+
+
+//  Tagged nodes must be 8-byte aligned, for their pointers to have 3 bits
+//  free, which pads them to 16 bytes on 32-bit systems:
+#ifdef AVL_TAGGED_NODE
+#define AVL_NODE_ALIGN      __attribute__((aligned(8)))
+#else
+#define AVL_NODE_ALIGN
+#endif
+
+//  32 bytes on a 64 bit system, 16 bytes on 32-bit system (20 with AVL_ORDER_STAT),
+//  24 and 16 bytes with AVL_TAGGED_NODE
+typedef struct AVL_NODE_ALIGN AVL_NODE_S
 {
     struct AVL_NODE_S *l, *r;   //  Left and right sub-trees
-    int8_t f;                  //  Flags:  balance, free/used, alloc (1st in sequence), free-me, and count (if 1st in sequence)
+#ifndef AVL_TAGGED_NODE
+    int8_t f;                  //  Flags:  balance, and free/used
+    uint16_t b;                 //  Index of the node in its block
+#endif
+#ifdef AVL_ORDER_STAT
+    unsigned int s;             //  Number of nodes in this subtree, including this one
+#endif
+#ifdef AVL_KEY_PREFIX
+    uint32_t k;                 //  Prefix of the key, when the tree has a 'prefix' method
+#endif
     void *d;                    //  The user data pointer.
 }
 AVL_NODE;
 
 
+//  The children of a node, without the tag bits:
+#ifdef AVL_TAGGED_NODE
+#define AVL_TAG_BITS        ((uintptr_t)0x7)
+#define AVL_untag(p)        ((struct AVL_NODE_S*)((uintptr_t)(p)&~AVL_TAG_BITS))
+#else
+#define AVL_untag(p)        (p)
+#endif
+#define AVL_left(n)         AVL_untag((*(n)).l)
+#define AVL_right(n)        AVL_untag((*(n)).r)
+
+
+//  Most nodes a block can hold, as 'b' is 16 bits:
+#define AVL_MAX_ALLOC 65535
+
+
+//  Blocks that are partly used are kept on this many lists, by occupancy,
+//  so that the fullest one is found at once.
+#define AVL_ALLOC_BUCKETS 8
+
+
+//  Policies for the block that a new node comes from (see 'allocPolicy'):
+#define AVL_ALLOC_RECENT    0   //  The block a node was last returned to (default)
+#define AVL_ALLOC_FULLEST   1   //  The fullest block that has a free node
+#define AVL_ALLOC_PARENT    2   //  The block of the parent, on insert
+
+
+//  Node layouts for 'compact':
+#define AVL_LAYOUT_BFS      0   //  Level by level, top first
+#define AVL_LAYOUT_INORDER  1   //  In sorted order
+#define AVL_LAYOUT_VEB      2   //  van Emde Boas:  recursively, the top half of the levels, then each subtree below
+
+
+//  A block of 'allocAtOnce' nodes, with a header that keeps its own list
+//  of free nodes, so that a block that empties is known right away.
+typedef struct AVL_BLOCK_S
+{
+    struct AVL_BLOCK_S *prev, *next;    //  On a 'partial' list or the 'empty' list
+    struct AVL_NODE_S *free;    //  Free nodes, linked on 'r'
+    int used;                   //  Nodes not on 'free':  in a tree, or in limbo
+    unsigned int run;           //  The compaction run that filled it, 0 if none
+#ifndef __cplusplus
+    struct AVL_NODE_S n[];      //  The nodes, not declared for C++, which has no flexible arrays
+#endif
+}
+AVL_BLOCK;
+
+
 //  Global tree structure:
-typedef struct
+typedef struct AVL_TREE_S
 {
-    //  The list of free nodes:
-    struct AVL_NODE_S *freeStack;        //  freeStack->(*n).r->(*n).r->...->NULL
+    //  The allocation set, blocks that are full are on none of the lists:
+    struct AVL_BLOCK_S *partial[AVL_ALLOC_BUCKETS]; //  Blocks with free and used nodes, by occupancy
+    struct AVL_BLOCK_S *empty;      //  Blocks without used nodes
+    struct AVL_BLOCK_S *recent;     //  Block a node was last returned to
     int allocAtOnce;
+#ifdef AVL_TAGGED_NODE
+    size_t blockSize;           //  Bytes in a block, header included, a power of 2
+#endif
+    int policy;                 //  AVL_ALLOC_RECENT, _FULLEST, or _PARENT
+    int blocks;                 //  Number of blocks allocated
+    int emptyBlocks;            //  Number of blocks on 'empty'
+    int used;                   //  Number of nodes in use, in all trees of the set
+    int releaseHigh;            //  Automatic release of empty blocks (see 'autoRelease'), off when <0
+    int releaseLow;
+    int hold;                   //  Automatic release is put on hold while >0
+    unsigned int runs;          //  Compaction runs started on the set
+    struct AVL_TREE_S *alloc;   //  Owner of the allocation set, normally the tree itself
+    struct AVL_POOL_S *pool;    //  Node pool the tree draws from instead, NULL if none
 
     //  The tree and all:
     struct AVL_NODE_S *top;
     int height;     //  Height to the deepest node
-    int size;       //  Number of nodes in the tree
+    int size;       //  Number of nodes in the tree, unless 'uncounted' (see 'AVL_size')
+    int uncounted;  //  Set by 'split' without AVL_ORDER_STAT, until the nodes are counted
+    unsigned long mod;  //  Modification counter, bumped on every insert/delete/flush
+    struct AVL_NODE_S *first, *last;    //  Smallest and largest node, NULL if empty
+    struct AVL_EPOCH_S *epoch;  //  Reclamation state for concurrent readers, NULL if not enabled
+    struct AVL_COMPACT_S *compact;  //  Compaction that runs over several calls, NULL if none
 
     //  The method by which *data pointers are compared
     int (*eval)(void *d1, void *d2, void *user);
+#ifdef AVL_KEY_PREFIX
+    uint32_t (*prefix)(void *d, void *user);    //  Key prefixes, NULL if not used
+#endif
     void *user;
 }
 AVL_TREE;
 
 
+//  Cursor, for stepping through the tree in either direction.
+//  Holds the path from the top of the tree to the current node,
+//  and is invalidated by any modification of the tree.
+typedef struct
+{
+    AVL_TREE *t;
+    struct AVL_NODE_S *path[AVL_MAX_DEPTH];
+    int top;            //  path[top-1] is the current node, 0 when off the end
+    unsigned long mod;  //  Copy of (*t).mod when the cursor was positioned
+}
+AVL_CURSOR;
+
+
+//  A reader thread, registered with a tree in concurrent mode.
+typedef struct AVL_READER_S
+{
+    unsigned long epoch;        //  Epoch in which the reader entered, 0 when outside the tree
+    int used;                   //  Registered, records are reused after 'readerLeave'
+    struct AVL_READER_S *next;
+}
+AVL_READER;
+
+
+//  Reclamation state of a tree in concurrent mode.  Deleted nodes, and
+//  the nodes that rotations replaced by copies, are retired into the limbo
+//  of the current epoch, and only go back to their block after every reader
+//  has moved on two epochs.  Limbo is kept apart from the nodes, so that
+//  a retired node still leads a reader on it to where it pointed before.
+typedef struct AVL_EPOCH_S
+{
+    unsigned long epoch;        //  Global epoch, advanced by the writer
+    AVL_READER *readers;        //  All reader records, linked on 'next'
+    struct AVL_NODE_S **limbo[3];   //  Retired nodes per epoch (mod 3)
+    int count[3];               //  Number of nodes in each,
+    int max[3];                 //  and room for
+    int pending;                //  Number of nodes in limbo
+    struct AVL_NODE_S *spare[2];    //  Nodes set aside for the copies of a rotation
+    int spares;
+}
+AVL_EPOCH;
+
+
+//  A task of a compaction:  the slot (a child pointer, or the top of the
+//  tree) of a node that has yet to move.  For the vEB layout, 'h' is the
+//  number of levels to lay out from there, or with 'd'>=0, the task goes
+//  down 'd' levels to the subtrees that are laid out next.
+typedef struct
+{
+    struct AVL_NODE_S **s;
+    int h;
+    int d;
+}
+AVL_COMPACT_TASK;
+
+
+//  State of a compaction between calls, valid while the tree is not
+//  modified otherwise.
+typedef struct AVL_COMPACT_S
+{
+    int layout;
+    unsigned int run;           //  Tags the blocks this run fills
+    unsigned long mod;          //  (*t).mod after the last call
+    AVL_COMPACT_TASK *work;     //  A queue for BFS, a stack otherwise
+    int head, tail, max;
+    struct AVL_BLOCK_S *dest;   //  Block being filled
+}
+AVL_COMPACT;
+
+
+//  A frozen, read-only snapshot of a tree (see 'freeze'):  the data
+//  pointers in Eytzinger order, which is the BFS order of a complete tree,
+//  1-based so the children of 'i' are at 2i and 2i+1.
+typedef struct
+{
+    int n;                      //  Number of items
+    void **d;                   //  d[1..n]
+    int64_t *k;                 //  Integer keys in the same order, NULL if none
+    int (*eval)(void *d1, void *d2, void *user);
+    void *user;
+}
+AVL_FROZEN;
+
+
+//  Number of free nodes a magazine of a node pool holds.
+#define AVL_POOL_MAG 64
+
+
+//  A magazine, a small stack of free nodes (linked on 'r') that
+//  moves as a whole between the threads and the depot of a pool.
+typedef struct AVL_MAGAZINE_S
+{
+    struct AVL_NODE_S *nodes;
+    int n;                      //  Number of nodes on 'nodes'
+    struct AVL_MAGAZINE_S *next;    //  In the depot
+}
+AVL_MAGAZINE;
+
+
+//  The magazines a thread holds for a pool, found through a
+//  thread-specific key.  Nodes are taken from and returned to 'loaded',
+//  which swaps with 'previous' when it runs empty or full.
+typedef struct AVL_POOL_CACHE_S
+{
+    AVL_MAGAZINE *loaded;
+    AVL_MAGAZINE *previous;
+    int used;                   //  Records of exited threads are reused
+    struct AVL_POOL_S *pool;
+    struct AVL_POOL_CACHE_S *next;
+}
+AVL_POOL_CACHE;
+
+
+//  A node pool, that any number of trees can draw from.  Threads only go
+//  to the depot, under its lock, once per magazine worth of nodes.
+typedef struct AVL_POOL_S
+{
+    int allocAtOnce;
+    pthread_key_t key;          //  Finds the cache of the calling thread
+    pthread_mutex_t lock;       //  Depot lock
+    AVL_MAGAZINE *full;         //  Depot:  magazines with nodes,
+    AVL_MAGAZINE *empty;        //  and empty ones
+    AVL_POOL_CACHE *caches;     //  All thread caches, linked on 'next'
+    struct AVL_NODE_S **blocks; //  Every block of 'allocAtOnce' nodes, freed with the pool
+    int nblocks;
+    int maxBlocks;
+}
+AVL_POOL;
+
+
 
 
 
@@ -183,10 +435,42 @@ void AVL_examplePrintLabel(FILE *stream, void *d)
 //  'allocAtOnce' indicates how many nodes should be 'malloc-ed'
 //  at a time.  Small numbers lead to overhead, big numbers lead
 //  to wasted memory.  On a 64-bit system, allocating 128 nodes is
-//  a exactly a 4kb page, and therefore a good number.
+//  a exactly a 4kb page, and therefore a good number.  At most
+//  AVL_MAX_ALLOC nodes go in one block.  With AVL_TAGGED_NODE, it is
+//  rounded up to fill a power of 2 bytes:  128 becomes 169 in 4kb.
 //
 AVL_TREE *AVL_newTree(int allocAtOnce, int (*eval)(void *d1, void *d2, void *user), void *user);
 
+//
+//  Creates an empty tree with the same 'eval' and 'user' as 't', that
+//  takes its nodes from the allocation set of 't'.  Nodes can then be
+//  moved between the trees (see split and join).  Destroying a shared
+//  tree returns its nodes to the set, and the owner, the tree that was
+//  created with 'newTree', must be destroyed last.  All trees sharing an
+//  allocation set must be modified under the same (external) lock.
+//
+AVL_TREE *AVL_newShared(AVL_TREE *t);
+
+//
+//  Node pools.  Many small trees that each have their own allocation set
+//  also each have their own partly empty blocks.  Trees created with
+//  'newPooled' draw from a common pool instead:  every thread keeps a few
+//  magazines of free nodes of its own, and exchanges whole magazines with
+//  a central depot, so nodes move freely between trees and threads.
+//
+//  Trees of the same pool share an allocation set, so split, join, and
+//  the set operations work between them, and they can be destroyed in any
+//  order.  Different trees of a pool can be modified by different threads
+//  at the same time, but each tree still needs one writer at a time.
+//  Pooled nodes are only returned to the OS by 'destroyPool', so 'dealloc'
+//  does nothing for these trees.  All trees must be destroyed first.
+//
+//  'newPool' returns NULL if out of memory.
+//
+AVL_POOL *AVL_newPool(int allocAtOnce);
+AVL_TREE *AVL_newPooled(AVL_POOL *p, int (*eval)(void *d1, void *d2, void *user), void *user);
+void AVL_destroyPool(AVL_POOL *p);
+
 //  
 //  Break down the tree, and return all nodes to the 'free' stack:
 //  The tree will be empty after this call, but memory is still allocated.
@@ -194,15 +478,69 @@ AVL_TREE *AVL_newTree(int allocAtOnce, int (*eval)(void *d1, void *d2, void *use
 void AVL_flush(AVL_TREE *t);
 
 //  
-//  Check if any memory blocks (of 'allocAtOnce' size) are unused
-//  and can be returned to the OS.  This method is CPU intesive, and
-//  only makes sense when the tree has significantly shrunk through
-//  deletes, or a 'flush' has recently been called.
+//  Returns the memory blocks (of 'allocAtOnce' size) that are unused to
+//  the OS.  Each block counts the nodes in use, and the empty ones are
+//  kept on a list of their own, so this is O(number of empty blocks).
+//  Returns the number of nodes freed.
 //
 //  Will NOT touch or harm nodes that are currently in the tree.
 //
 int AVL_dealloc(AVL_TREE *t);
 
+//
+//  Automatic 'dealloc', off by default.  Once more than 'high' blocks are
+//  empty, empty blocks are returned to the OS until 'low' are left, which
+//  keeps a tree that hovers around a block boundary from calling malloc
+//  and free over and over.  With both at 0, a block is released as soon as
+//  it empties, in O(1).  A 'high' below 0 turns it off again.  Applies to
+//  the allocation set of 't', so to every tree that shares it.
+//
+void AVL_autoRelease(AVL_TREE *t, int high, int low);
+
+//
+//  Sets the block a new node comes from, for the allocation set of 't'.
+//  After a lot of inserts and deletes, taking the next free node from
+//  wherever one was last returned (AVL_ALLOC_RECENT, the default) leaves
+//  the nodes of a tree spread thinly over every block.  AVL_ALLOC_FULLEST
+//  fills up the fullest blocks first, so that the others can empty and be
+//  released, and AVL_ALLOC_PARENT places a new node in the block of its
+//  parent if that has room, which keeps search paths on fewer pages.  Both
+//  fall back to the fullest block.  Does not apply to pooled trees.
+//
+void AVL_allocPolicy(AVL_TREE *t, int policy);
+
+//
+//  The fragmentation metric:  nodes in use over nodes allocated, for the
+//  allocation set of 't'.  1.0 is fully packed, and the lower it gets, the
+//  more memory sits idle in partly used blocks.  Returns -1.0 for pooled
+//  trees.
+//
+double AVL_occupancy(AVL_TREE *t);
+
+//
+//  Compaction.  Moves every node of the tree into fresh blocks, one after
+//  the other in the order of 'layout' (AVL_LAYOUT_BFS, _INORDER, or _VEB),
+//  and releases the blocks that empty.  Searches then touch fewer pages
+//  and cache lines:  BFS keeps the top levels together, in-order suits
+//  walks and cursors, and vEB keeps every short stretch of a search path
+//  close, whatever the cache size.  The data pointers do not change, but
+//  cursors go stale.  Blocks shared with other trees, or with nodes in
+//  limbo, are released once those are gone too.
+//
+//  'compactStep' visits at most 'max' nodes per call (all if 'max'<=0), so
+//  that a pause stays short, and picks up where the previous call left off.
+//  If the tree was modified in between, it walks the tree from the top
+//  again, but leaves the nodes it already moved where they are.  It can
+//  only finish once the tree stays unmodified for about size/max calls.
+//  Both return:
+//    0  done
+//    1  more nodes to move ('compactStep' only)
+//    2  unable to allocate memory (the tree is intact, and call again)
+//    3  pooled trees can not be compacted
+//
+int AVL_compact(AVL_TREE *t, int layout);
+int AVL_compactStep(AVL_TREE *t, int layout, int max);
+
 //
 //  Simply destroys the tree, and 't' cannot be used again after.
 //  Calls 'flush', then 'dealloc', then 'free' on 't'.
@@ -232,6 +570,121 @@ void AVL_destroy(AVL_TREE *t);
 void *AVL_find(AVL_TREE *t, void *k);
 
 
+//
+//  Finding 'n' items at once:  'out[i]' receives what 'find' would return
+//  for keys[i].  The searches are interleaved, with prefetching, so that
+//  on trees bigger than the cache they wait for memory side by side
+//  rather than one at a time.  Batches of 64 keys or more work best.
+//  Returns the number of keys found.
+//
+int AVL_findMany(AVL_TREE *t, void **keys, int n, void **out);
+
+
+//
+//  As 'findMany', for keys that are sorted already (by 'eval', smallest
+//  first, duplicates allowed).  The batch goes down the tree as a whole,
+//  and is split at each node by a binary search, of about log2(m)+2
+//  calls to 'eval' for the 'm' keys that reach it.  Over the top log2(k)
+//  levels that adds up to O(k) for 'k' keys, and below them each key goes
+//  on alone, one call per level, for O(k log(n/k+1)) calls in all, rather
+//  than the O(k log n) of 'findMany'.  If the keys are not sorted, some
+//  may not be found.
+//
+int AVL_findSorted(AVL_TREE *t, void **keys, int n, void **out);
+
+
+//
+//  Bounded lookups, based on a key 'k', in a single descent.
+//  Returns the pointer 'p' of the item found, or NULL if there is none:
+//    lowerBound:  smallest item >= k
+//    upperBound:  smallest item >  k
+//    floor:       largest item  <= k
+//    ceiling:     smallest item >= k  (same as lowerBound, the mirror of floor)
+//
+void *AVL_lowerBound(AVL_TREE *t, void *k);
+void *AVL_upperBound(AVL_TREE *t, void *k);
+void *AVL_floor(AVL_TREE *t, void *k);
+void *AVL_ceiling(AVL_TREE *t, void *k);
+
+
+//
+//  The smallest and the largest item, or NULL if the tree is empty, in
+//  O(1).  The tree keeps both up to date:  insert and delete as they go,
+//  and the operations that change the tree as a whole (split, join, the
+//  batches, set operations, compaction) before they return.  Both only
+//  read the tree, and can run concurrently with other readers.
+//
+void *AVL_min(AVL_TREE *t);
+void *AVL_max(AVL_TREE *t);
+
+
+//
+//  Range walk: calls 'callback' for each item between 'lo' and 'hi'
+//  (inclusive) in sorted order.  Either may be NULL for an open end.
+//  Only subtrees that overlap the range are visited, so the cost is
+//  O(log n + k) for 'k' items in the range.
+//
+void AVL_walkRange(AVL_TREE *t, void *lo, void *hi, void (*callback)(void *d, void *user), void *user);
+
+
+//
+//  Cursors.  Position a cursor with 'first', 'last', or 'seek' (which
+//  finds the smallest item >= k), then step with 'next' and 'prev'.
+//  Each returns the data pointer of the item the cursor lands on, or NULL
+//  when stepping off either end.  Stepping is amortized O(1).
+//
+//  A cursor is a plain structure that needs no cleanup, so it can be
+//  dropped at any point.  Any insert, delete, or flush on the tree makes
+//  the cursor stale:  all calls then return NULL without touching the
+//  tree, until it is re-positioned.  'valid' returns 1 only while the
+//  cursor sits on an item of an unmodified tree.
+//
+void *AVL_cursorFirst(AVL_CURSOR *c, AVL_TREE *t);
+void *AVL_cursorLast(AVL_CURSOR *c, AVL_TREE *t);
+void *AVL_cursorSeek(AVL_CURSOR *c, AVL_TREE *t, void *k);
+void *AVL_cursorNext(AVL_CURSOR *c);
+void *AVL_cursorPrev(AVL_CURSOR *c);
+void *AVL_cursorGet(AVL_CURSOR *c);
+int AVL_cursorValid(AVL_CURSOR *c);
+
+
+#ifdef AVL_ORDER_STAT
+//
+//  Order statistics, O(log n) each (requires AVL_ORDER_STAT):
+//    rank:        the number of items smaller than 'k', which is the
+//                 0-based position of 'k' if it is in the tree.
+//    select:      the item at 0-based position 'i', NULL if out of range.
+//    countRange:  the number of items between 'lo' and 'hi' (inclusive),
+//                 either may be NULL for an open end.
+//
+int AVL_rank(AVL_TREE *t, void *k);
+void *AVL_select(AVL_TREE *t, int i);
+int AVL_countRange(AVL_TREE *t, void *lo, void *hi);
+#endif
+
+
+#ifdef AVL_KEY_PREFIX
+//
+//  Key prefixes (requires AVL_KEY_PREFIX):  'prefix' maps the data, or a
+//  search key, to 32 bits that sort the same way as 'eval'.  Whenever
+//  prefix(a)<prefix(b), 'eval' must find 'a' smaller than 'b'.  Items
+//  with equal prefixes can compare any way.  Each node keeps the prefix
+//  of its data, and a search computes the prefix of the key once, so it
+//  only calls 'eval', and touches the data, where the prefixes are equal.
+//  For integer keys of up to 32 bits, the key with its sign bit flipped is
+//  a full prefix.  For strings, the first four bytes, most significant
+//  first, give a prefix for 'strcmp'.
+//
+//  Setting or clearing (NULL) the method recomputes the prefixes of all
+//  nodes, in O(n).  Trees that exchange nodes (split, join, the set
+//  operations) must use the same method, and 'newShared' copies it.
+//  Applies to find, the bounded lookups, walkRange, cursorSeek, rank,
+//  insert, and delete.
+//
+void AVL_keyPrefix(AVL_TREE *t, uint32_t (*prefix)(void *d, void *user));
+#endif
+
+
 //
 //  Insertion of a new data element.
 //  Returns:
@@ -242,6 +695,60 @@ void *AVL_find(AVL_TREE *t, void *k);
 int AVL_insert(AVL_TREE *t, void *d);
 
 
+//
+//  Get or create:  inserts 'd' unless an equal item is in the tree, in a
+//  single descent.  'existing' (if not NULL) receives the item that is in
+//  the tree afterwards:  'd' if it was inserted, the one that was there
+//  otherwise, or NULL if out of memory.  Return codes as for 'insert'.
+//
+int AVL_findOrInsert(AVL_TREE *t, void *d, void **existing);
+
+//
+//  Insert or update:  inserts 'd', or swaps it for an equal item already
+//  in the tree, in a single descent.  A swap only changes the data pointer
+//  of the node, so the tree is not rebalanced, and cursors on the item
+//  stay valid.  'old' (if not NULL) receives the item that was replaced,
+//  or NULL.
+//  Returns:
+//    0  'd' was inserted
+//    1  'd' replaced an equal item
+//    2  unable to allocate memory
+//
+int AVL_replace(AVL_TREE *t, void *d, void **old);
+
+
+//
+//  Insertion next to a finger:  cursor 'c', on an item of 't' that 'd'
+//  is expected to go right next to, such as the last one inserted when
+//  the keys come in order, or nearly so.  Then the insert takes about
+//  three calls to 'eval' instead of one per level:  one against the
+//  finger, and a short search to put the cursor back on 'd' when the
+//  insert rotated ('avl_example hint' measures 3.0 for keys in order, and
+//  5.6 for nearly sorted ones).  That saves calls to 'eval', but not
+//  always time:  with a cheap 'eval', nearly sorted keys went no faster
+//  than with 'insert', and at times slower.  If 'd' does not go next to
+//  the finger, or the cursor is stale, it is a normal insert.  Either way
+//  the cursor is left on 'd' (on the item already there if it returns 1),
+//  so that it follows a stream of inserts.  Position it first with
+//  'cursorLast' for keys that grow, for instance.  Return codes as for
+//  'insert'.
+//
+int AVL_insertHint(AVL_TREE *t, void *d, AVL_CURSOR *c);
+
+
+//
+//  Bulk build of an empty tree from 'n' items, already sorted in ascending
+//  order and without duplicates (which is not checked).  Builds a perfectly
+//  balanced tree in O(n) without calling 'eval', so this is the fast way
+//  to reload a tree serialized with 'walk'.
+//  Returns:
+//    0  on success
+//    1  the tree is not empty
+//    2  unable to allocate memory (the tree is left empty)
+//
+int AVL_buildSorted(AVL_TREE *t, void **items, int n);
+
+
 //
 //  Deletion.
 //  Rebalances the tree after deleting a node.
@@ -252,6 +759,361 @@ int AVL_insert(AVL_TREE *t, void *d);
 void *AVL_delete(AVL_TREE *t, void *k);
 
 
+//
+//  Deletes the smallest, or the largest item, and returns it (NULL if the
+//  tree is empty), as for a priority queue or a timer wheel.  There is no
+//  search, and 'eval' is not called.
+//
+void *AVL_popMin(AVL_TREE *t);
+void *AVL_popMax(AVL_TREE *t);
+
+
+//
+//  Deletes the item cursor 'c' is on, without searching for it again, and
+//  moves the cursor on to the next item, which it returns (NULL past the
+//  end, or if the cursor was stale, in which case nothing is deleted).
+//  The cursor stays valid, so a sweep can step through the tree and take
+//  out items as it goes:
+//      d=AVL_cursorFirst(&c, t);
+//      while (d)
+//          d=(expired(d) ? AVL_cursorDelete(&c) : AVL_cursorNext(&c));
+//  Get the item itself first, with 'cursorGet', to free it.  Any other
+//  cursor on the tree is stale afterwards, as with 'delete'.
+//
+void *AVL_cursorDelete(AVL_CURSOR *c);
+
+
+//
+//  Batched insert and delete of 'n' items or keys.  The batch is sorted
+//  with 'eval' first.  Small batches are then applied in key order, each
+//  item searched for from the one before it (see 'insertHint'), so that
+//  items close together share most of the search.  Big ones (relative to
+//  the tree) are merged with the tree into fresh nodes, in linear time,
+//  which replace the old ones at once.  If memory runs out for that, the
+//  batch is applied item by item instead.  Either way the outcome is the
+//  same as calling insert or delete for each item in turn:
+//    rc[i]   receives the return code of 'insert' for items[i]
+//    out[i]  receives the return value of 'delete' for keys[i]
+//  Both 'rc' and 'out' may be NULL.  Returns the number of items that
+//  were inserted, or deleted.
+//
+int AVL_insertBatch(AVL_TREE *t, void **items, int n, int *rc);
+int AVL_deleteBatch(AVL_TREE *t, void **keys, int n, void **out);
+
+
+//
+//  Split 't' around key 'k', in O(log n).  Creates two new trees that share
+//  the allocation set of 't' (see newShared):  'left' receives all items
+//  smaller than 'k', and 'right' all others.  The nodes are moved, not
+//  copied, and 't' is left empty.  Without AVL_ORDER_STAT the sizes of
+//  the two are not known without counting, which is left to 'size'.
+//  Returns:
+//    0  on success
+//    2  unable to allocate memory ('t' is untouched)
+//
+int AVL_split(AVL_TREE *t, void *k, AVL_TREE **left, AVL_TREE **right);
+
+
+//
+//  Number of items in 't'.  That is the 'size' field, in O(1), except on
+//  the halves of a 'split' without AVL_ORDER_STAT, and the trees they
+//  are joined into:  the first call counts their nodes, in O(n), and it is
+//  O(1) again after.
+//
+int AVL_size(AVL_TREE *t);
+
+//
+//  Join 'left', the item 'pivot', and 'right' into 'left', in O(log n).
+//  Every item in 'left' must be smaller than 'pivot', and every item in
+//  'right' bigger.  The nodes of 'right' are moved into 'left', and 'right'
+//  is left empty, which requires that the trees share an allocation set.
+//  With a NULL 'pivot', the two trees are simply concatenated.
+//  Returns:
+//    0  on success
+//    1  the items are not in order (nothing is changed)
+//    2  unable to allocate memory (nothing is changed)
+//    3  the trees do not share an allocation set
+//
+int AVL_join(AVL_TREE *left, void *pivot, AVL_TREE *right);
+
+
+//
+//  Set operations on two trees that share an allocation set, in
+//  O(m log(n/m+1)) work for trees of sizes m<=n:
+//    union:       'a' receives all items in either tree
+//    intersect:   'a' keeps only the items that are also in 'b'
+//    difference:  'a' keeps only the items that are not in 'b'
+//  The result is always in 'a', and 'b' is left empty:  its nodes are either
+//  moved into 'a' or freed.  When an item is in both trees, the one from
+//  'a' is kept.  The work is split over at most 'threads' threads (pthreads,
+//  fork-join), so 'eval' must be safe to call concurrently.  In concurrent
+//  mode the trees are merged instead, in O(n+m), on one thread.
+//  Returns:
+//    0  on success
+//    2  unable to allocate memory, in concurrent mode (nothing is changed)
+//    3  the trees do not share an allocation set
+//
+int AVL_union(AVL_TREE *a, AVL_TREE *b, int threads);
+int AVL_intersect(AVL_TREE *a, AVL_TREE *b, int threads);
+int AVL_difference(AVL_TREE *a, AVL_TREE *b, int threads);
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Concurrent readers                                                 *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  In concurrent mode, a single writer may modify the tree while any number
+//  of readers search it with 'findConcurrent'.  Readers take no lock, never
+//  wait for the writer, and never search twice:
+//
+//    - The writer never changes a node that a reader may be on in a way
+//      that could lead it astray.  A rotation works on copies of the nodes
+//      it moves, and links them in with a single store once they are
+//      complete, so a reader sees the tree either before or after it.  The
+//      two spare nodes this takes are set aside first, so 'insert' and
+//      'join' return 2 if they cannot be had, with nothing changed.
+//    - Deleting an item with two children moves the next item into its
+//      node, rather than moving the nodes.
+//    - 'flush' and 'split' empty the tree with a single store before they
+//      take its nodes apart, as 'join' does with 'right'.  The set
+//      operations merge the two trees on the side, in O(n+m), and link the
+//      result in at once, so they do not use threads in this mode.
+//    - Nodes are never reused while a reader may still be looking at them.
+//      Nodes that were deleted or replaced by a copy wait in limbo, and
+//      only return to their block once every active reader has been seen
+//      in a later epoch.  Blocks can therefore not be released by
+//      'dealloc' while any of their nodes is still in limbo.
+//
+//  Only the writer waits:  'split' and 'join', and a delete that finds no
+//  memory for its copies, until the readers that were inside have left.
+//  All modifying calls remain exclusive:  one writer at a time.  Plain
+//  'find', 'walk', and cursors are not safe against the writer.  The user
+//  data of a deleted item may still be passed to 'eval' by a reader, until
+//  the writer calls 'synchronize'.
+//
+//  Returns 0 on success, or 2 if unable to allocate memory.
+//
+int AVL_concurrent(AVL_TREE *t);
+
+//
+//  Registers the calling reader thread, returns NULL if out of memory.
+//  Records of readers that left are reused.  Requires concurrent mode.
+//
+AVL_READER *AVL_readerJoin(AVL_TREE *t);
+void AVL_readerLeave(AVL_READER *r);
+
+//
+//  Like 'find', but safe to run while the writer modifies the tree, in a
+//  single pass that never waits (see above).
+//
+void *AVL_findConcurrent(AVL_TREE *t, AVL_READER *r, void *k);
+
+//
+//  Writer only:  waits until every reader that is currently inside the
+//  tree has left, after which the user data of items deleted before the
+//  call can be freed.  Also returns nodes in limbo to their blocks.
+//
+void AVL_synchronize(AVL_TREE *t);
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Frozen snapshots                                                   *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  For a tree that is read far more often than it is written:  'freeze'
+//  copies the data pointers into one array in Eytzinger order, where a
+//  search goes down the array from index 1 with no branches other than
+//  the loop, and prefetches four levels ahead.  The first levels are
+//  shared by every search, and stay in cache.  The snapshot does not
+//  follow later changes to the tree, and costs 8 bytes per item.
+//
+//  'freezeInt64' also stores a 64-bit integer key per item, taken from the
+//  data by 'key', so that 'frozenFindInt64' compares keys in the array
+//  without calling 'eval' or touching the data at all.  The order of the
+//  keys must be the order of 'eval'.
+//
+//  Both return NULL if out of memory.  A snapshot can be searched by any
+//  number of threads at once.
+//
+AVL_FROZEN *AVL_freeze(AVL_TREE *t);
+AVL_FROZEN *AVL_freezeInt64(AVL_TREE *t, int64_t (*key)(void *d, void *user));
+void AVL_frozenDestroy(AVL_FROZEN *f);
+
+//
+//  Same results as 'find' on the tree at the time of the freeze:  the data
+//  pointer, or NULL if not found.  'frozenFindInt64' requires a snapshot
+//  made with 'freezeInt64', and returns NULL otherwise.
+//
+void *AVL_frozenFind(AVL_FROZEN *f, void *k);
+void *AVL_frozenFindInt64(AVL_FROZEN *f, int64_t k);
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Type-specialized trees                                             *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Every search step of the regular methods calls 'eval' through a
+//  pointer, with void* arguments, which the compiler can not inline.
+//  AVL_DEFINE(name, type, cmp) generates static inline methods for a tree
+//  of 'type*' items, with the comparison 'cmp' written out in the search.
+//  An inlined comparison by itself is no faster:  the compiler picks the
+//  next child with a conditional move, which waits for the item to come
+//  in from memory.  So each step also prefetches both children, while
+//  the item of the node is read, and on a tree that is not in cache a
+//  search waits on one miss per level instead of two:
+//
+//    AVL_TREE *name_newTree(int allocAtOnce, void *user);
+//    int name_insert(AVL_TREE *t, type *d);
+//    type *name_find(AVL_TREE *t, const type *k);
+//    type *name_delete(AVL_TREE *t, const type *k);
+//    void name_walk(AVL_TREE *t, void (*callback)(type *d, void *user), void *user);
+//
+//  'cmp' is an expression on 'const type *a', the key, and 'const type *b',
+//  an item in the tree, that is negative if 'a' sorts before 'b', 0 if
+//  they match, and positive otherwise.  'user' is in scope as well.  For
+//  example:
+//
+//    AVL_DEFINE(intTree, int, (*a>*b)-(*a<*b))
+//
+//  Only the searches are generated:  the rebalancing, the blocks, and the
+//  rest of the tree are the same as for any AVL_TREE.  The tree also gets
+//  an 'eval' made from 'cmp', so every other method (cursors, batches,
+//  split and join, compaction...) works on it as well.  Return codes are
+//  those of the regular methods.
+//
+#define AVL_DEFINE(name, type, cmp)                                             \
+static inline int name##_cmp(const type *a, const type *b, void *user)          \
+{                                                                               \
+    (void)user;                                                                 \
+    return(cmp);                                                                \
+}                                                                               \
+                                                                                \
+static inline int name##_eval(void *d1, void *d2, void *user)                   \
+{                                                                               \
+    return(name##_cmp((const type*)d2, (const type*)d1, user));                 \
+}                                                                               \
+                                                                                \
+static inline AVL_TREE *name##_newTree(int allocAtOnce, void *user)             \
+{                                                                               \
+    return(AVL_newTree(allocAtOnce, name##_eval, user));                        \
+}                                                                               \
+                                                                                \
+static inline type *name##_find(AVL_TREE *t, const type *k)                     \
+{                                                                               \
+    AVL_NODE *c=(*t).top;                                                       \
+    while (c!=NULL)                                                             \
+    {                                                                           \
+        __builtin_prefetch(AVL_left(c));                                        \
+        __builtin_prefetch(AVL_right(c));                                       \
+        int e=name##_cmp(k, (const type*)(*c).d, (*t).user);                    \
+        if (e==0)                                                               \
+            return((type*)(*c).d);                                              \
+        else if (e<0)                                                           \
+            c=AVL_left(c);                                                      \
+        else                                                                    \
+            c=AVL_right(c);                                                     \
+    }                                                                           \
+    return(NULL);                                                               \
+}                                                                               \
+                                                                                \
+static inline int name##_insert(AVL_TREE *t, type *d)                           \
+{                                                                               \
+    AVL_NODE *c=(*t).top;                                                       \
+    AVL_NODE *stack[AVL_MAX_DEPTH];                                             \
+    int8_t dir[AVL_MAX_DEPTH];                                                  \
+    int top=0;                                                                  \
+    while (c!=NULL && top<AVL_MAX_DEPTH)                                        \
+    {                                                                           \
+        __builtin_prefetch(AVL_left(c));                                        \
+        __builtin_prefetch(AVL_right(c));                                       \
+        int e=name##_cmp(d, (const type*)(*c).d, (*t).user);                    \
+        if (e==0)                                                               \
+            return(1);                                                          \
+        stack[top]=c;                                                           \
+        dir[top]=(e<0 ? -1 : +1);                                               \
+        c=(e<0 ? AVL_left(c) : AVL_right(c));                                   \
+        top+=1;                                                                 \
+    }                                                                           \
+    return(AVL_insertAt(t, d, AVL_prefixOf(t, d), stack, dir, top));           \
+}                                                                               \
+                                                                                \
+static inline type *name##_delete(AVL_TREE *t, const type *k)                   \
+{                                                                               \
+    AVL_NODE *c=(*t).top;                                                       \
+    AVL_NODE *stack[AVL_MAX_DEPTH];                                             \
+    int top=0;                                                                  \
+    while (c!=NULL && top<AVL_MAX_DEPTH)                                        \
+    {                                                                           \
+        __builtin_prefetch(AVL_left(c));                                        \
+        __builtin_prefetch(AVL_right(c));                                       \
+        int e=name##_cmp(k, (const type*)(*c).d, (*t).user);                    \
+        stack[top]=c;                                                           \
+        if (e==0)                                                               \
+        {                                                                       \
+            type *d=(type*)(*c).d;                                              \
+            AVL_deleteAt(t, stack, top);                                        \
+            return(d);                                                          \
+        }                                                                       \
+        c=(e<0 ? AVL_left(c) : AVL_right(c));                                   \
+        top+=1;                                                                 \
+    }                                                                           \
+    return(NULL);                                                               \
+}                                                                               \
+                                                                                \
+static inline void name##_walk(AVL_TREE *t, void (*callback)(type *d, void *user), void *user) \
+{                                                                               \
+    AVL_NODE *stack[AVL_MAX_DEPTH];                                             \
+    AVL_NODE *c=(*t).top;                                                       \
+    int top=0;                                                                  \
+    while (c!=NULL || top>0)                                                    \
+    {                                                                           \
+        if (c!=NULL)                                                            \
+        {                                                                       \
+            stack[top]=c;                                                       \
+            top+=1;                                                             \
+            c=AVL_left(c);                                                      \
+        }                                                                       \
+        else                                                                    \
+        {                                                                       \
+            top-=1;                                                             \
+            c=stack[top];                                                       \
+            callback((type*)(*c).d, user);                                      \
+            c=AVL_right(c);                                                     \
+        }                                                                       \
+    }                                                                           \
+}
+
+
+//
+//  Internal methods that the generated ones share with 'insert' and
+//  'delete':  they take the path the search recorded, and do the rest.
+//
+int AVL_insertAt(AVL_TREE *t, void *d, uint32_t pk, AVL_NODE **stack, int8_t *dir, int top);
+void AVL_deleteAt(AVL_TREE *t, AVL_NODE **stack, int top);
+#ifdef AVL_KEY_PREFIX
+#define AVL_prefixOf(t,k)   ((*(t)).prefix ? (*(t)).prefix((k), (*(t)).user) : 0)
+#else
+#define AVL_prefixOf(t,k)   0
+#endif
+
+
+
 
 /************************************************************************
  *                                                                      *
@@ -290,7 +1152,9 @@ int AVL_checkBalance(AVL_NODE *n);
 
 
 
-
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
@@ -0,0 +1,1192 @@
+/*
+ *  Copyright (c) 2020 by Vincent H. Berk
+ *  All rights reserved.
+ *
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ *  C++17 wrapper around AVL_TREE, with the interface of std::map:
+ *
+ *    avl::map<std::string, int> m;
+ *    m.try_emplace("one", 1);
+ *    for (auto &[k, v] : m)
+ *        ...
+ *
+ *  The rebalancing and the node blocks are those of avl.c, so link with it.
+ *  Only the searches are written here, as templates, so that 'Compare' is
+ *  inlined into them rather than called through 'eval'.  Each item, a
+ *  std::pair<const Key, T>, is allocated on its own through 'Allocator',
+ *  and the tree node that points to it comes from the blocks of the tree.
+ *  Items therefore never move:  references stay valid until the item is
+ *  erased, and 'extract' and 'insert' of a node handle move an item from
+ *  one map to another without copying or reallocating it.
+ *
+ *  Iterators are bidirectional, and trivially copyable:  the tree and
+ *  the item.  The map keeps one AVL_CURSOR for their steps, on the item
+ *  it last stepped to, so an iterator that goes on from there steps in
+ *  amortized O(1), and any other first finds its item by key, in
+ *  O(log n).  Loops, and reverse iterators (which step a copy back for
+ *  every '*'), take the first path.  As with std::map, only iterators to
+ *  an erased item are invalidated.  'erase' moves the cursor on as well
+ *  (see cursorDelete), so erasing as a loop steps through the map is not
+ *  a search per item.  Concurrent readers stay safe:  one that finds the
+ *  cursor taken by another thread searches on its own instead.
+ *
+ *  A map that is moved from has no tree, until it gets items again, so
+ *  moving a map never allocates, and does not throw.
+ *
+ *  As in avl.h, the map is not re-entrant, and modifications need
+ *  external locking.
+ *
+ */
+
+
+
+
+#ifndef _AVL_TREE_HPP
+#define _AVL_TREE_HPP
+
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "avl.h"
+
+
+namespace avl
+{
+
+
+template <class Key, class T, class Compare=std::less<Key>,
+          class Allocator=std::allocator<std::pair<const Key, T>>>
+class map
+{
+public:
+    using key_type=Key;
+    using mapped_type=T;
+    using value_type=std::pair<const Key, T>;
+    using size_type=std::size_t;
+    using difference_type=std::ptrdiff_t;
+    using key_compare=Compare;
+    using allocator_type=Allocator;
+    using reference=value_type&;
+    using const_reference=const value_type&;
+    using pointer=typename std::allocator_traits<Allocator>::pointer;
+    using const_pointer=typename std::allocator_traits<Allocator>::const_pointer;
+
+    static_assert(std::is_same<typename Allocator::value_type, value_type>::value,
+                  "Allocator::value_type must be the value_type of the map");
+
+    //  Nodes per block of the underlying tree, 4kb worth on 64-bit.
+    static constexpr int allocAtOnce=128;
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Iterators                                                      *
+     *                                                                  *
+     ********************************************************************/
+
+    template <bool Const>
+    class basic_iterator
+    {
+    public:
+        using iterator_category=std::bidirectional_iterator_tag;
+        using value_type=typename map::value_type;
+        using difference_type=std::ptrdiff_t;
+        using pointer=typename std::conditional<Const, const value_type*, value_type*>::type;
+        using reference=typename std::conditional<Const, const value_type&, value_type&>::type;
+
+        basic_iterator()
+        {
+        }
+
+        //  An iterator converts to a const_iterator, not the other way around.
+        template <bool C, class=typename std::enable_if<Const && !C>::type>
+        basic_iterator(const basic_iterator<C> &o) : t(o.t), v(o.v)
+        {
+        }
+
+        reference operator*() const
+        {
+            return(*v);
+        }
+
+        pointer operator->() const
+        {
+            return(v);
+        }
+
+        basic_iterator &operator++()
+        {
+            v=(*(const map*)(*t).user).stepFrom(v, true);
+            return(*this);
+        }
+
+        //  From end(), to the last item:
+        basic_iterator &operator--()
+        {
+            v=(*(const map*)(*t).user).stepFrom(v, false);
+            return(*this);
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator i(*this);
+            ++(*this);
+            return(i);
+        }
+
+        basic_iterator operator--(int)
+        {
+            basic_iterator i(*this);
+            --(*this);
+            return(i);
+        }
+
+        template <bool C>
+        bool operator==(const basic_iterator<C> &o) const
+        {
+            return(v==o.v);
+        }
+
+        template <bool C>
+        bool operator!=(const basic_iterator<C> &o) const
+        {
+            return(v!=o.v);
+        }
+
+    private:
+        friend class map;
+        template <bool C> friend class basic_iterator;
+
+        basic_iterator(AVL_TREE *tr, value_type *d) : t(tr), v(d)
+        {
+        }
+
+        AVL_TREE *t=NULL;
+        value_type *v=NULL;     //  The item, NULL at the end
+    };
+
+    using iterator=basic_iterator<false>;
+    using const_iterator=basic_iterator<true>;
+    using reverse_iterator=std::reverse_iterator<iterator>;
+    using const_reverse_iterator=std::reverse_iterator<const_iterator>;
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Node handles                                                   *
+     *                                                                  *
+     ********************************************************************/
+
+    //
+    //  An item taken out of a map by 'extract', which owns it until it is
+    //  inserted into a map again, or destroyed with the handle.
+    //
+    class node_type
+    {
+    public:
+        using key_type=Key;
+        using mapped_type=T;
+        using allocator_type=Allocator;
+
+        node_type()=default;
+
+        node_type(node_type &&o) noexcept : v(o.v), a(std::move(o.a))
+        {
+            o.v=NULL;
+            o.a.reset();
+        }
+
+        node_type &operator=(node_type &&o)
+        {
+            if (this!=&o)
+            {
+                reset();
+                v=o.v;
+                a=std::move(o.a);
+                o.v=NULL;
+                o.a.reset();
+            }
+            return(*this);
+        }
+
+        ~node_type()
+        {
+            reset();
+        }
+
+        bool empty() const
+        {
+            return(v==NULL);
+        }
+
+        explicit operator bool() const
+        {
+            return(v!=NULL);
+        }
+
+        allocator_type get_allocator() const
+        {
+            return(*a);
+        }
+
+        key_type &key() const
+        {
+            return(const_cast<key_type&>((*v).first));
+        }
+
+        mapped_type &mapped() const
+        {
+            return((*v).second);
+        }
+
+        void swap(node_type &o)
+        {
+            std::swap(v, o.v);
+            std::swap(a, o.a);
+        }
+
+    private:
+        friend class map;
+
+        node_type(value_type *d, const Allocator &al) : v(d), a(al)
+        {
+        }
+
+        void reset()
+        {
+            if (v!=NULL)
+                map::destroyItem(*a, v);
+            v=NULL;
+            a.reset();
+        }
+
+        value_type *v=NULL;
+        std::optional<Allocator> a;
+    };
+
+    struct insert_return_type
+    {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Construction                                                   *
+     *                                                                  *
+     ********************************************************************/
+
+    map() : map(Compare())
+    {
+    }
+
+    explicit map(const Compare &comp, const Allocator &alloc=Allocator()) : cmp(comp), al(alloc)
+    {
+        t=newTree();
+    }
+
+    explicit map(const Allocator &alloc) : map(Compare(), alloc)
+    {
+    }
+
+    template <class It>
+    map(It first, It last, const Compare &comp=Compare(), const Allocator &alloc=Allocator()) : map(comp, alloc)
+    {
+        insert(first, last);
+    }
+
+    map(std::initializer_list<value_type> il, const Compare &comp=Compare(), const Allocator &alloc=Allocator()) : map(comp, alloc)
+    {
+        insert(il);
+    }
+
+    map(const map &o) : cmp(o.cmp), al(std::allocator_traits<Allocator>::select_on_container_copy_construction(o.al))
+    {
+        t=newTree();
+        try
+        {
+            copyFrom(o);
+        }
+        catch (...)
+        {
+            AVL_destroy(t);
+            throw;
+        }
+    }
+
+    //
+    //  The map that is moved from is left empty, without a tree, and gets
+    //  a new one when something is inserted into it.
+    //
+    map(map &&o) noexcept(std::is_nothrow_copy_constructible<Compare>::value) : t(o.t), cmp(o.cmp), al(std::move(o.al))
+    {
+        o.t=NULL;
+        o.cacheStep(NULL, true, NULL);
+        if (t!=NULL)
+            (*t).user=this;
+    }
+
+    ~map()
+    {
+        if (t!=NULL)
+        {
+            clear();
+            AVL_destroy(t);
+        }
+    }
+
+    map &operator=(const map &o)
+    {
+        if (this!=&o)
+        {
+            map m(o);
+            swap(m);
+        }
+        return(*this);
+    }
+
+    map &operator=(map &&o) noexcept(std::is_nothrow_swappable<Compare>::value)
+    {
+        if (this!=&o)
+        {
+            clear();
+            swap(o);
+        }
+        return(*this);
+    }
+
+    map &operator=(std::initializer_list<value_type> il)
+    {
+        clear();
+        insert(il);
+        return(*this);
+    }
+
+    void swap(map &o) noexcept(std::is_nothrow_swappable<Compare>::value)
+    {
+        std::swap(t, o.t);
+        std::swap(cmp, o.cmp);
+        std::swap(al, o.al);
+        if (t!=NULL)
+            (*t).user=this;
+        if (o.t!=NULL)
+            (*o.t).user=&o;
+        cacheStep(NULL, true, NULL);
+        o.cacheStep(NULL, true, NULL);
+    }
+
+    allocator_type get_allocator() const
+    {
+        return(al);
+    }
+
+    key_compare key_comp() const
+    {
+        return(cmp);
+    }
+
+    //
+    //  The underlying tree, for the methods of avl.h that do not add or
+    //  remove items (allocPolicy, autoRelease, compact, occupancy...).
+    //  Its data pointers are value_type*, and its 'eval' compares those.
+    //  NULL for a map that was moved from, until it gets items again.
+    //
+    AVL_TREE *tree() const
+    {
+        return(t);
+    }
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Iteration and size                                             *
+     *                                                                  *
+     ********************************************************************/
+
+    iterator begin()
+    {
+        return(iterator(t, first()));
+    }
+
+    const_iterator begin() const
+    {
+        return(const_iterator(t, first()));
+    }
+
+    iterator end()
+    {
+        return(iterator(t, NULL));
+    }
+
+    const_iterator end() const
+    {
+        return(const_iterator(t, NULL));
+    }
+
+    const_iterator cbegin() const
+    {
+        return(begin());
+    }
+
+    const_iterator cend() const
+    {
+        return(end());
+    }
+
+    reverse_iterator rbegin()
+    {
+        return(reverse_iterator(end()));
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+        return(const_reverse_iterator(end()));
+    }
+
+    reverse_iterator rend()
+    {
+        return(reverse_iterator(begin()));
+    }
+
+    const_reverse_iterator rend() const
+    {
+        return(const_reverse_iterator(begin()));
+    }
+
+    bool empty() const
+    {
+        return(t==NULL || (*t).top==NULL);
+    }
+
+    size_type size() const
+    {
+        return(t==NULL ? 0 : (size_type)AVL_size(t));
+    }
+
+    size_type max_size() const
+    {
+        return((size_type)std::numeric_limits<int>::max());
+    }
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Insertion                                                      *
+     *                                                                  *
+     ********************************************************************/
+
+    //
+    //  Constructs the item first, as the key is only known after, and
+    //  destroys it again if the key is already in the map, or if 'Compare'
+    //  throws.
+    //
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        value_type *d=newItem(std::forward<Args>(args)...);
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int8_t dir[AVL_MAX_DEPTH];
+        int at, top;
+        bool found;
+
+        try
+        {
+            top=descend<false>((*d).first, path, dir, at);
+            found=match((*d).first, path, at);
+        }
+        catch (...)
+        {
+            destroyItem(al, d);
+            throw;
+        }
+        if (found)
+        {
+            destroyItem(al, d);
+            return(std::pair<iterator, bool>(iterator(t, itemAt(path, at)), false));
+        }
+        link(d, path, dir, top, true);
+        return(std::pair<iterator, bool>(iterator(t, d), true));
+    }
+
+    template <class... Args>
+    iterator emplace_hint(const_iterator, Args&&... args)
+    {
+        return(emplace(std::forward<Args>(args)...).first);
+    }
+
+    //
+    //  Only constructs the item if the key is not in the map yet, so 'k'
+    //  and 'args' are not moved from otherwise.
+    //
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const key_type &k, Args&&... args)
+    {
+        return(tryEmplace(k, std::forward<Args>(args)...));
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(key_type &&k, Args&&... args)
+    {
+        return(tryEmplace(std::move(k), std::forward<Args>(args)...));
+    }
+
+    template <class... Args>
+    iterator try_emplace(const_iterator, const key_type &k, Args&&... args)
+    {
+        return(tryEmplace(k, std::forward<Args>(args)...).first);
+    }
+
+    template <class... Args>
+    iterator try_emplace(const_iterator, key_type &&k, Args&&... args)
+    {
+        return(tryEmplace(std::move(k), std::forward<Args>(args)...).first);
+    }
+
+    std::pair<iterator, bool> insert(const value_type &x)
+    {
+        return(emplace(x));
+    }
+
+    std::pair<iterator, bool> insert(value_type &&x)
+    {
+        return(emplace(std::move(x)));
+    }
+
+    template <class P, class=typename std::enable_if<std::is_constructible<value_type, P&&>::value>::type>
+    std::pair<iterator, bool> insert(P &&x)
+    {
+        return(emplace(std::forward<P>(x)));
+    }
+
+    iterator insert(const_iterator, const value_type &x)
+    {
+        return(emplace(x).first);
+    }
+
+    iterator insert(const_iterator, value_type &&x)
+    {
+        return(emplace(std::move(x)).first);
+    }
+
+    template <class It>
+    void insert(It first, It last)
+    {
+        for (; first!=last; ++first)
+            emplace(*first);
+    }
+
+    void insert(std::initializer_list<value_type> il)
+    {
+        insert(il.begin(), il.end());
+    }
+
+    //
+    //  Inserts the item a node handle owns, without copying it.  If the
+    //  key is already in the map, the handle keeps the item.
+    //
+    insert_return_type insert(node_type &&nh)
+    {
+        insert_return_type r{end(), false, node_type()};
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int8_t dir[AVL_MAX_DEPTH];
+        int at, top;
+
+        if (nh.empty())
+            return(r);
+        top=descend<false>((*nh.v).first, path, dir, at);
+        if (match((*nh.v).first, path, at))
+        {
+            r.position=iterator(t, itemAt(path, at));
+            r.node=std::move(nh);
+            return(r);
+        }
+        link(nh.v, path, dir, top, false);
+        r.position=iterator(t, nh.v);
+        r.inserted=true;
+        nh.v=NULL;
+        nh.a.reset();
+        return(r);
+    }
+
+    iterator insert(const_iterator, node_type &&nh)
+    {
+        return(insert(std::move(nh)).position);
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const key_type &k, M &&m)
+    {
+        std::pair<iterator, bool> r=tryEmplace(k, std::forward<M>(m));
+        if (!r.second)
+            (*r.first).second=std::forward<M>(m);
+        return(r);
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(key_type &&k, M &&m)
+    {
+        std::pair<iterator, bool> r=tryEmplace(std::move(k), std::forward<M>(m));
+        if (!r.second)
+            (*r.first).second=std::forward<M>(m);
+        return(r);
+    }
+
+    mapped_type &operator[](const key_type &k)
+    {
+        return((*tryEmplace(k).first).second);
+    }
+
+    mapped_type &operator[](key_type &&k)
+    {
+        return((*tryEmplace(std::move(k)).first).second);
+    }
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Removal                                                        *
+     *                                                                  *
+     ********************************************************************/
+
+    //
+    //  Takes the item out of the map, and hands it over to a node handle.
+    //
+    node_type extract(const_iterator pos)
+    {
+        return(node_type(unlink(pos), al));
+    }
+
+    node_type extract(const key_type &k)
+    {
+        const_iterator i=find(k);
+        if (i==end())
+            return(node_type());
+        return(extract(i));
+    }
+
+    iterator erase(const_iterator pos)
+    {
+        value_type *d;
+
+        //  Not shared with readers, as erase needs external locking:
+        cursorOn(cur, pos.v);
+        d=(value_type*)AVL_cursorDelete(&cur);
+        cacheStep(NULL, true, d);
+        destroyItem(al, pos.v);
+        return(iterator(t, d));
+    }
+
+    iterator erase(iterator pos)
+    {
+        return(erase(const_iterator(pos)));
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        while (first!=last)
+            first=erase(first);
+        return(iterator(t, last.v));
+    }
+
+    size_type erase(const key_type &k)
+    {
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int at;
+        value_type *d;
+
+        descend<false>(k, path, NULL, at);
+        if (!match(k, path, at))
+            return(0);
+        d=(value_type*)(*path[at]).d;
+        AVL_deleteAt(t, path, at);
+        destroyItem(al, d);
+        return(1);
+    }
+
+    void clear() noexcept
+    {
+        AVL_CURSOR c;
+        void *d;
+
+        if (t==NULL)
+            return;
+        for (d=AVL_cursorFirst(&c, t); d!=NULL; d=AVL_cursorNext(&c))
+            destroyItem(al, (value_type*)d);
+        AVL_flush(t);
+    }
+
+
+    /********************************************************************
+     *                                                                  *
+     *   Lookup                                                         *
+     *                                                                  *
+     ********************************************************************/
+
+    //
+    //  Each takes a key_type, or any type that 'Compare' takes when it
+    //  has 'is_transparent', as std::less<> does.
+    //
+    iterator find(const key_type &k)
+    {
+        return(findKey<iterator>(k));
+    }
+
+    const_iterator find(const key_type &k) const
+    {
+        return(findKey<const_iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    iterator find(const K &k)
+    {
+        return(findKey<iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    const_iterator find(const K &k) const
+    {
+        return(findKey<const_iterator>(k));
+    }
+
+    size_type count(const key_type &k) const
+    {
+        return(contains(k) ? 1 : 0);
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    size_type count(const K &k) const
+    {
+        return(contains(k) ? 1 : 0);
+    }
+
+    bool contains(const key_type &k) const
+    {
+        return(containsKey(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    bool contains(const K &k) const
+    {
+        return(containsKey(k));
+    }
+
+    mapped_type &at(const key_type &k)
+    {
+        iterator i=find(k);
+        if (i==end())
+            throw std::out_of_range("avl::map::at");
+        return((*i).second);
+    }
+
+    const mapped_type &at(const key_type &k) const
+    {
+        const_iterator i=find(k);
+        if (i==end())
+            throw std::out_of_range("avl::map::at");
+        return((*i).second);
+    }
+
+    iterator lower_bound(const key_type &k)
+    {
+        return(bound<false, iterator>(k));
+    }
+
+    const_iterator lower_bound(const key_type &k) const
+    {
+        return(bound<false, const_iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    iterator lower_bound(const K &k)
+    {
+        return(bound<false, iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    const_iterator lower_bound(const K &k) const
+    {
+        return(bound<false, const_iterator>(k));
+    }
+
+    iterator upper_bound(const key_type &k)
+    {
+        return(bound<true, iterator>(k));
+    }
+
+    const_iterator upper_bound(const key_type &k) const
+    {
+        return(bound<true, const_iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    iterator upper_bound(const K &k)
+    {
+        return(bound<true, iterator>(k));
+    }
+
+    template <class K, class C=Compare, class=typename C::is_transparent>
+    const_iterator upper_bound(const K &k) const
+    {
+        return(bound<true, const_iterator>(k));
+    }
+
+    std::pair<iterator, iterator> equal_range(const key_type &k)
+    {
+        return(std::pair<iterator, iterator>(lower_bound(k), upper_bound(k)));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const key_type &k) const
+    {
+        return(std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k)));
+    }
+
+
+private:
+    using alloc_traits=std::allocator_traits<Allocator>;
+
+    AVL_TREE *t;
+    Compare cmp;
+    Allocator al;
+
+    //
+    //  The cursor for the steps of the iterators, on item 'curAt', where it
+    //  got to from item 'curFrom' in direction 'curNext'.  'curBusy' is held while
+    //  it is used, so that readers in other threads leave it alone.
+    //
+    mutable AVL_CURSOR cur{};
+    mutable const value_type *curAt=NULL, *curFrom=NULL;
+    mutable bool curNext=false;
+    mutable std::atomic_flag curBusy=ATOMIC_FLAG_INIT;
+
+
+    //
+    //  The 'eval' of the underlying tree, for the methods of avl.h.  The
+    //  searches below do not use it.
+    //
+    static int eval(void *d1, void *d2, void *user)
+    {
+        const map &m=*(const map*)user;
+        const Key &a=(*(value_type*)d1).first;
+        const Key &b=(*(value_type*)d2).first;
+
+        if (m.cmp(b, a))
+            return(-1);
+        return(m.cmp(a, b) ? 1 : 0);
+    }
+
+    AVL_TREE *newTree()
+    {
+        AVL_TREE *n=AVL_newTree(allocAtOnce, eval, this);
+        if (n==NULL)
+            throw std::bad_alloc();
+        return(n);
+    }
+
+    static const Key &keyOf(AVL_NODE *n)
+    {
+        return((*(value_type*)(*n).d).first);
+    }
+
+    static value_type *itemAt(AVL_NODE **path, int at)
+    {
+        return((value_type*)(*path[at]).d);
+    }
+
+    AVL_NODE *root() const
+    {
+        return(t==NULL ? NULL : (*t).top);
+    }
+
+    value_type *first() const
+    {
+        return(t==NULL || (*t).first==NULL ? NULL : (value_type*)(*(*t).first).d);
+    }
+
+    template <class... Args>
+    value_type *newItem(Args&&... args)
+    {
+        value_type *d=alloc_traits::allocate(al, 1);
+        try
+        {
+            alloc_traits::construct(al, d, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            alloc_traits::deallocate(al, d, 1);
+            throw;
+        }
+        return(d);
+    }
+
+    static void destroyItem(Allocator &a, value_type *d)
+    {
+        alloc_traits::destroy(a, d);
+        alloc_traits::deallocate(a, d, 1);
+    }
+
+    //
+    //  Goes down from the top to the bottom of the tree, with a single
+    //  comparison per level, and records the path, and the direction taken
+    //  at each node if 'dir' is not NULL.  Returns the length of the path.
+    //  'at' receives the position on the path of the last node that is not
+    //  smaller than 'k' (with 'Upper', that is bigger than 'k'), or -1 if
+    //  there is none.  The path up to 'at' is then the path to that node.
+    //
+    template <bool Upper, class K>
+    int descend(const K &k, AVL_NODE **path, int8_t *dir, int &at) const
+    {
+        AVL_NODE *c=root();
+        int top=0;
+
+        at=-1;
+        while (c!=NULL && top<AVL_MAX_DEPTH)
+        {
+            bool left=(Upper ? cmp(k, keyOf(c)) : !cmp(keyOf(c), k));
+            path[top]=c;
+            if (dir!=NULL)
+                dir[top]=(left ? -1 : +1);
+            if (left)
+                at=top;
+            c=(left ? AVL_left(c) : AVL_right(c));
+            top+=1;
+        }
+        return(top);
+    }
+
+    //
+    //  After 'descend', if the node at 'at' holds 'k':
+    //
+    template <class K>
+    bool match(const K &k, AVL_NODE **path, int at) const
+    {
+        return(at>=0 && !cmp(k, keyOf(path[at])));
+    }
+
+    //
+    //  Positions a cursor on the item with key 'k', which must be in the map.
+    //
+    void locate(AVL_CURSOR &c, const Key &k) const
+    {
+        int at;
+
+        descend<false>(k, c.path, NULL, at);
+        c.t=t;
+        c.top=at+1;
+        c.mod=(*t).mod;
+    }
+
+    //
+    //  Puts cursor 'c' on item 'v', unless it is there already, that is,
+    //  unless it is the step cursor 'cur', still on 'v'.
+    //
+    void cursorOn(AVL_CURSOR &c, const value_type *v) const
+    {
+        if (&c!=&cur || curAt!=v || cur.t!=t || cur.top==0 || cur.mod!=(*t).mod)
+            locate(c, (*v).first);
+    }
+
+    void cacheStep(const value_type *v, bool n, value_type *d) const
+    {
+        curFrom=v;
+        curNext=n;
+        curAt=d;
+        if (d==NULL)
+            cur.top=0;
+    }
+
+    //
+    //  The item after 'v' (before, if not 'next'), or the last item if 'v'
+    //  is NULL and stepping back, for the iterators.  A step that was just
+    //  taken by a copy of the iterator, as reverse iterators do, is not
+    //  taken again.
+    //
+    value_type *stepFrom(const value_type *v, bool n) const
+    {
+        AVL_CURSOR local;
+        AVL_CURSOR *c=&local;
+        value_type *d;
+
+        if (t==NULL)
+            return(NULL);
+        if (!curBusy.test_and_set(std::memory_order_acquire))
+        {
+            c=&cur;
+            if (v!=NULL && v==curFrom && n==curNext && cur.t==t && cur.mod==(*t).mod)
+            {
+                d=(value_type*)curAt;
+                curBusy.clear(std::memory_order_release);
+                return(d);
+            }
+        }
+        if (v==NULL)
+            d=(value_type*)AVL_cursorLast(c, t);
+        else
+        {
+            cursorOn(*c, v);
+            d=(value_type*)(n ? AVL_cursorNext(c) : AVL_cursorPrev(c));
+        }
+        if (c==&cur)
+        {
+            cacheStep(v, n, d);
+            curBusy.clear(std::memory_order_release);
+        }
+        return(d);
+    }
+
+    //
+    //  Adds 'd' under the end of the path, and first makes the tree if the
+    //  map was moved from.  If there is no memory for either, 'd' is
+    //  destroyed when 'owned', and bad_alloc thrown.
+    //
+    void link(value_type *d, AVL_NODE **path, int8_t *dir, int top, bool owned)
+    {
+        if (t==NULL)
+            t=AVL_newTree(allocAtOnce, eval, this);
+        if (t==NULL || AVL_insertAt(t, d, AVL_prefixOf(t, d), path, dir, top)!=0)
+        {
+            if (owned)
+                destroyItem(al, d);
+            throw std::bad_alloc();
+        }
+    }
+
+    //
+    //  Removes the item of 'pos' from the tree, and returns it.
+    //
+    value_type *unlink(const_iterator pos)
+    {
+        AVL_CURSOR c;
+
+        locate(c, (*pos.v).first);
+        AVL_deleteAt(t, c.path, c.top-1);
+        return(pos.v);
+    }
+
+    template <class K, class... Args>
+    std::pair<iterator, bool> tryEmplace(K &&k, Args&&... args)
+    {
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int8_t dir[AVL_MAX_DEPTH];
+        int at;
+        int top=descend<false>(k, path, dir, at);
+        value_type *d;
+
+        if (match(k, path, at))
+            return(std::pair<iterator, bool>(iterator(t, itemAt(path, at)), false));
+        d=newItem(std::piecewise_construct, std::forward_as_tuple(std::forward<K>(k)),
+                  std::forward_as_tuple(std::forward<Args>(args)...));
+        link(d, path, dir, top, true);
+        return(std::pair<iterator, bool>(iterator(t, d), true));
+    }
+
+    template <class I, class K>
+    I findKey(const K &k) const
+    {
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int at;
+
+        descend<false>(k, path, NULL, at);
+        if (!match(k, path, at))
+            return(I(t, NULL));
+        return(I(t, itemAt(path, at)));
+    }
+
+    template <class K>
+    bool containsKey(const K &k) const
+    {
+        AVL_NODE *c=root();
+        AVL_NODE *f=NULL;
+
+        //  Same single comparison per level as 'descend', without the path:
+        while (c!=NULL)
+        {
+            bool left=!cmp(keyOf(c), k);
+            f=(left ? c : f);
+            c=(left ? AVL_left(c) : AVL_right(c));
+        }
+        return(f!=NULL && !cmp(k, keyOf(f)));
+    }
+
+    template <bool Upper, class I, class K>
+    I bound(const K &k) const
+    {
+        AVL_NODE *path[AVL_MAX_DEPTH];
+        int at;
+
+        descend<Upper>(k, path, NULL, at);
+        if (at<0)
+            return(I(t, NULL));
+        return(I(t, itemAt(path, at)));
+    }
+
+    void copyFrom(const map &o)
+    {
+        std::vector<void*> items;
+        items.reserve(o.size());
+        try
+        {
+            for (const value_type &x : o)
+                items.push_back(newItem(x));
+            if (AVL_buildSorted(t, items.data(), (int)items.size())!=0)
+                throw std::bad_alloc();
+        }
+        catch (...)
+        {
+            for (void *d : items)
+                destroyItem(al, (value_type*)d);
+            throw;
+        }
+    }
+};
+
+
+template <class Key, class T, class Compare, class Allocator>
+void swap(map<Key, T, Compare, Allocator> &a, map<Key, T, Compare, Allocator> &b)
+{
+    a.swap(b);
+}
+
+
+}
+
+
+#endif
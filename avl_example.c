@@ -32,7 +32,10 @@
  */
 
 #include "avl.h"
+#include "avl_mt.h"
+#include "avl_ix.h"
 #include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
 
@@ -255,6 +258,7 @@ typedef struct
     int rank;       //  To determine some order in the threads
     pthread_mutex_t rankLock;
     int nt;         //  Num threads
+    AVL_POOL *pool; //  Shared by the trees of the odd ranks
 }
 AVL_EXAMPLE_STRUCT;
 
@@ -287,8 +291,13 @@ void *workerThread(void *user)
     //fprintf(stderr, "Thread ID %i\n", rank);
 
         //  Create the tree, the 'user' pointer is the
-        //  seed for the rand_r method.
-    AVL_TREE *t=AVL_newTree(32, exampleEval, &seed);
+        //  seed for the rand_r method.  Odd ranks draw
+        //  their nodes from the shared pool.
+    AVL_TREE *t;
+    if (rank%2)
+        t=AVL_newPooled((*e).pool, exampleEval, &seed);
+    else
+        t=AVL_newTree(32, exampleEval, &seed);
     a=(int*)malloc(AVL_TEST_NUM*sizeof(int));
 
     //  Each thread starts with a different place in the random
@@ -311,6 +320,888 @@ void *workerThread(void *user)
     return(NULL);
 }
 
+//
+//  Scaling benchmark, run as 'avl_example scale'.  All threads work on
+//  one shared tree, with 80% finds, 10% inserts and 10% deletes of random
+//  keys, half of which are in the tree at the start.  A single mutex
+//  around an AVL_TREE is compared to the concurrent AVL_MTREE, for 1, 2,
+//  4, ... threads up to twice the number of cores.
+//
+#define AVL_SCALE_KEYS 1000000
+#define AVL_SCALE_OPS 500000     //  Per thread
+typedef struct
+{
+    AVL_TREE *t;                //  Either this one, behind 'lock'
+    pthread_mutex_t lock;
+    AVL_MTREE *mt;              //  Or this one
+    int *keys;                  //  keys[k]==k, the data of both trees
+}
+AVL_SCALE_STRUCT;
+
+typedef struct
+{
+    AVL_SCALE_STRUCT *s;
+    unsigned seed;
+    pthread_t tid;
+}
+AVL_SCALE_THREAD;
+
+void *scaleThread(void *user)
+{
+    AVL_SCALE_THREAD *st=(AVL_SCALE_THREAD*) user;
+    AVL_SCALE_STRUCT *s=(*st).s;
+    int i;
+
+    for (i=0; i<AVL_SCALE_OPS; i+=1)
+    {
+        int r=rand_r(&((*st).seed));
+        int *k=&((*s).keys[r%AVL_SCALE_KEYS]);
+        int op=(r/AVL_SCALE_KEYS)%10;
+
+        if ((*s).mt)
+        {
+            if (op==0)
+                AVL_mtInsert((*s).mt, k);
+            else if (op==1)
+                AVL_mtDelete((*s).mt, k);
+            else
+                AVL_mtFind((*s).mt, k);
+        }
+        else
+        {
+            pthread_mutex_lock(&((*s).lock));
+            if (op==0)
+                AVL_insert((*s).t, k);
+            else if (op==1)
+                AVL_delete((*s).t, k);
+            else
+                AVL_find((*s).t, k);
+            pthread_mutex_unlock(&((*s).lock));
+        }
+    }
+    return(NULL);
+}
+
+//
+//  Runs 'nt' threads on the tree in 's', and returns the
+//  number of operations per second.
+//
+double scaleRun(AVL_SCALE_STRUCT *s, int nt)
+{
+    AVL_SCALE_THREAD st[AVL_EXAMPLE_MAX_THREAD];
+    struct timespec t0, t1;
+    void *retval;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<nt; i+=1)
+    {
+        st[i].s=s;
+        st[i].seed=i*7919+1;
+        pthread_create(&st[i].tid, NULL, scaleThread, &st[i]);
+    }
+    for (i=0; i<nt; i+=1)
+        pthread_join(st[i].tid, &retval);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return(((double)nt*AVL_SCALE_OPS)/((t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9));
+}
+
+int scaleBenchmark(void)
+{
+    AVL_SCALE_STRUCT s;
+    int ncpu=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    int nt, i;
+
+    memset(&s, 0, sizeof(AVL_SCALE_STRUCT));
+    pthread_mutex_init(&s.lock, NULL);
+    s.keys=(int*)malloc(AVL_SCALE_KEYS*sizeof(int));
+    for (i=0; i<AVL_SCALE_KEYS; i+=1)
+        s.keys[i]=i;
+
+    fprintf(stdout, "threads      mutex ops/s    concurrent ops/s\n");
+    for (nt=1; nt<=2*ncpu && nt<=AVL_EXAMPLE_MAX_THREAD; nt*=2)
+    {
+        double mutex, concurrent;
+
+        //  Every run starts from the same half-full tree:
+        s.t=AVL_newTree(128, exampleEval, NULL);
+        s.mt=NULL;
+        for (i=0; i<AVL_SCALE_KEYS; i+=2)
+            AVL_insert(s.t, &(s.keys[i]));
+        mutex=scaleRun(&s, nt);
+        AVL_destroy(s.t);
+
+        s.mt=AVL_mtNewTree(exampleEval, NULL, NULL);
+        for (i=0; i<AVL_SCALE_KEYS; i+=2)
+            AVL_mtInsert(s.mt, &(s.keys[i]));
+        concurrent=scaleRun(&s, nt);
+        if (AVL_mtCheckBalance(s.mt)<0)
+        {
+            fprintf(stderr, "ERROR:  concurrent tree out of balance after %i threads!\n", nt);
+            exit(1);
+        }
+        AVL_mtDestroy(s.mt);
+
+        fprintf(stdout, "%7i  %15.0f  %18.0f\n", nt, mutex, concurrent);
+    }
+
+    free(s.keys);
+    pthread_mutex_destroy(&s.lock);
+    return(0);
+}
+
+//
+//  Snapshot benchmark, run as 'avl_example freeze'.  Random lookups of
+//  keys that are in the tree, or just next to one, through 'find' on the
+//  tree, and through 'frozenFind' and 'frozenFindInt64' on a snapshot of
+//  it.  The results must all agree.
+//
+#define AVL_FREEZE_KEYS 1000000
+#define AVL_FREEZE_OPS 10000000
+int64_t freezeKey(void *d, void *user)
+{
+    return(*((int*)d));
+}
+
+double freezeSeconds(struct timespec *t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return((t1.tv_sec-(*t0).tv_sec)+(t1.tv_nsec-(*t0).tv_nsec)/1e9);
+}
+
+int freezeBenchmark(void)
+{
+    AVL_TREE *t=AVL_newTree(128, exampleEval, NULL);
+    AVL_FROZEN *f;
+    struct timespec t0;
+    double find, frozen, frozen64;
+    unsigned seed=1;
+    int *keys=(int*)malloc(AVL_FREEZE_KEYS*sizeof(int));
+    int *probe=(int*)malloc(AVL_FREEZE_OPS*sizeof(int));
+    long hits=0, hitsFrozen=0, hitsFrozen64=0;
+    int i;
+
+    //  Odd keys only, inserted in random order:
+    for (i=0; i<AVL_FREEZE_KEYS; i+=1)
+        keys[i]=2*i+1;
+    for (i=AVL_FREEZE_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        int x=keys[i];
+        keys[i]=keys[j];
+        keys[j]=x;
+    }
+    for (i=0; i<AVL_FREEZE_KEYS; i+=1)
+        AVL_insert(t, &(keys[i]));
+    for (i=0; i<AVL_FREEZE_OPS; i+=1)
+        probe[i]=rand_r(&seed)%(2*AVL_FREEZE_KEYS+1);
+
+    f=AVL_freezeInt64(t, freezeKey);
+    if (f==NULL)
+    {
+        fprintf(stderr, "ERROR:  out of memory\n");
+        return(1);
+    }
+    for (i=0; i<AVL_FREEZE_KEYS; i+=1)
+    {
+        void *d=AVL_find(t, &(probe[i]));
+        if (AVL_frozenFind(f, &(probe[i]))!=d || AVL_frozenFindInt64(f, probe[i])!=d)
+        {
+            fprintf(stderr, "ERROR:  snapshot lookup of %i differs from the tree!\n", probe[i]);
+            return(1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_FREEZE_OPS; i+=1)
+        hits+=(AVL_find(t, &(probe[i]))!=NULL);
+    find=freezeSeconds(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_FREEZE_OPS; i+=1)
+        hitsFrozen+=(AVL_frozenFind(f, &(probe[i]))!=NULL);
+    frozen=freezeSeconds(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_FREEZE_OPS; i+=1)
+        hitsFrozen64+=(AVL_frozenFindInt64(f, probe[i])!=NULL);
+    frozen64=freezeSeconds(&t0);
+
+    if (hits!=hitsFrozen || hits!=hitsFrozen64)
+    {
+        fprintf(stderr, "ERROR:  snapshot hits differ from the tree!\n");
+        return(1);
+    }
+    fprintf(stdout, "%i items, %i lookups, %li found\n", AVL_FREEZE_KEYS, AVL_FREEZE_OPS, hits);
+    fprintf(stdout, "find             %6.1f ns/lookup\n", find*1e9/AVL_FREEZE_OPS);
+    fprintf(stdout, "frozenFind       %6.1f ns/lookup\n", frozen*1e9/AVL_FREEZE_OPS);
+    fprintf(stdout, "frozenFindInt64  %6.1f ns/lookup\n", frozen64*1e9/AVL_FREEZE_OPS);
+
+    AVL_frozenDestroy(f);
+    AVL_destroy(t);
+    free(probe);
+    free(keys);
+    return(0);
+}
+
+//
+//  Specialization benchmark, run as 'avl_example define'.  The same random
+//  inserts, finds and deletes, on int and on uint64_t keys, through the
+//  regular methods and through the ones generated by AVL_DEFINE.  A
+//  million keys, so that the tree does not fit in cache.
+//
+#define AVL_DEFINE_KEYS 1000000
+AVL_DEFINE(intTree, int, (*a>*b)-(*a<*b))
+AVL_DEFINE(u64Tree, uint64_t, (*a>*b)-(*a<*b))
+
+int u64Eval(void *data1, void *data2, void *user)
+{
+    uint64_t a=*((uint64_t*)data2);
+    uint64_t b=*((uint64_t*)data1);
+    return((a>b)-(a<b));
+}
+
+double defineOnce(AVL_TREE *t, void *keys, int size, int generated, int u64)
+{
+    struct timespec t0;
+    char *k=(char*)keys;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_DEFINE_KEYS; i+=1)
+    {
+        if (!generated)
+            AVL_insert(t, k+i*size);
+        else if (u64)
+            u64Tree_insert(t, (uint64_t*)(k+i*size));
+        else
+            intTree_insert(t, (int*)(k+i*size));
+    }
+    for (i=0; i<AVL_DEFINE_KEYS; i+=1)
+    {
+        void *d;
+        if (!generated)
+            d=AVL_find(t, k+i*size);
+        else if (u64)
+            d=u64Tree_find(t, (uint64_t*)(k+i*size));
+        else
+            d=intTree_find(t, (int*)(k+i*size));
+        if (d!=k+i*size)
+        {
+            fprintf(stderr, "ERROR:  key %i not found!\n", i);
+            exit(1);
+        }
+    }
+    for (i=0; i<AVL_DEFINE_KEYS; i+=1)
+    {
+        if (!generated)
+            AVL_delete(t, k+i*size);
+        else if (u64)
+            u64Tree_delete(t, (uint64_t*)(k+i*size));
+        else
+            intTree_delete(t, (int*)(k+i*size));
+    }
+    if ((*t).top!=NULL)
+    {
+        fprintf(stderr, "ERROR:  tree not empty after deleting all keys!\n");
+        exit(1);
+    }
+    return(freezeSeconds(&t0));
+}
+
+//
+//  Best of three, the tree is empty again after each:
+//
+double defineRun(AVL_TREE *t, void *keys, int size, int generated, int u64)
+{
+    double best=0.0;
+    int i;
+
+    for (i=0; i<3; i+=1)
+    {
+        double s=defineOnce(t, keys, size, generated, u64);
+        if (i==0 || s<best)
+            best=s;
+    }
+    return(best);
+}
+
+int defineBenchmark(void)
+{
+    int *ik=(int*)malloc(AVL_DEFINE_KEYS*sizeof(int));
+    uint64_t *uk=(uint64_t*)malloc(AVL_DEFINE_KEYS*sizeof(uint64_t));
+    unsigned seed=1;
+    AVL_TREE *t;
+    double a, b;
+    int i;
+
+    //  Distinct keys, in random order, and the same order for both:
+    for (i=0; i<AVL_DEFINE_KEYS; i+=1)
+        ik[i]=i;
+    for (i=AVL_DEFINE_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        int x=ik[i];
+        ik[i]=ik[j];
+        ik[j]=x;
+    }
+    for (i=0; i<AVL_DEFINE_KEYS; i+=1)
+        uk[i]=((uint64_t)ik[i])<<32;
+
+    fprintf(stdout, "%i inserts, finds and deletes     regular    AVL_DEFINE\n", AVL_DEFINE_KEYS);
+    t=AVL_newTree(128, exampleEval, NULL);
+    a=defineRun(t, ik, sizeof(int), 0, 0);
+    AVL_destroy(t);
+    t=intTree_newTree(128, NULL);
+    b=defineRun(t, ik, sizeof(int), 1, 0);
+    AVL_destroy(t);
+    fprintf(stdout, "int keys                        %9.3fs    %9.3fs\n", a, b);
+
+    t=AVL_newTree(128, u64Eval, NULL);
+    a=defineRun(t, uk, sizeof(uint64_t), 0, 1);
+    AVL_destroy(t);
+    t=u64Tree_newTree(128, NULL);
+    b=defineRun(t, uk, sizeof(uint64_t), 1, 1);
+    AVL_destroy(t);
+    fprintf(stdout, "uint64_t keys                   %9.3fs    %9.3fs\n", a, b);
+
+    free(ik);
+    free(uk);
+    return(0);
+}
+
+//
+//  Compact tree benchmark, run as 'avl_example index'.  The same random
+//  inserts, finds and deletes on a regular tree, and on a compact one
+//  with 16 byte nodes, and the memory the nodes of each take.
+//
+#define AVL_INDEX_KEYS 1000000
+int indexBenchmark(void)
+{
+    AVL_TREE *t=AVL_newTree(128, exampleEval, NULL);
+    AVL_ITREE *x=AVL_ixNewTree(128, exampleEval, NULL);
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    int *probe=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    double ins[2], find[2], del[2];
+    size_t mem[2];
+    struct timespec t0;
+    unsigned seed=1;
+    int i;
+
+    //  Inserted in one random order, looked up and deleted in another:
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+    {
+        keys[i]=i;
+        probe[i]=i;
+    }
+    for (i=AVL_INDEX_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        int k=keys[i];
+        keys[i]=keys[j];
+        keys[j]=k;
+        j=rand_r(&seed)%(i+1);
+        k=probe[i];
+        probe[i]=probe[j];
+        probe[j]=k;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        AVL_insert(t, &(keys[i]));
+    ins[0]=freezeSeconds(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        AVL_ixInsert(x, &(keys[i]));
+    ins[1]=freezeSeconds(&t0);
+#ifdef AVL_TAGGED_NODE
+    mem[0]=(size_t)(*t).blocks*(*t).blockSize;
+#else
+    mem[0]=(size_t)(*t).blocks*(sizeof(AVL_BLOCK)+(*t).allocAtOnce*sizeof(AVL_NODE));
+#endif
+    mem[1]=(size_t)(*x).max*sizeof(AVL_INODE);
+    if (AVL_checkBalance((*t).top)<0 || AVL_ixCheckBalance(x)<0)
+    {
+        fprintf(stderr, "ERROR:  tree out of balance!\n");
+        return(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        if (AVL_find(t, &(probe[i]))==NULL)
+            fprintf(stderr, "ERROR:  key %i not found!\n", probe[i]);
+    find[0]=freezeSeconds(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        if (AVL_ixFind(x, &(probe[i]))==NULL)
+            fprintf(stderr, "ERROR:  key %i not found in the compact tree!\n", probe[i]);
+    find[1]=freezeSeconds(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        AVL_delete(t, &(probe[i]));
+    del[0]=freezeSeconds(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        AVL_ixDelete(x, &(probe[i]));
+    del[1]=freezeSeconds(&t0);
+    if ((*t).size!=0 || (*x).size!=0)
+    {
+        fprintf(stderr, "ERROR:  tree not empty after deleting all keys!\n");
+        return(1);
+    }
+
+    fprintf(stdout, "%i keys       insert      find    delete    node memory\n", AVL_INDEX_KEYS);
+    for (i=0; i<2; i+=1)
+        fprintf(stdout, "%-16s %8.3fs %8.3fs %8.3fs  %9.1f MB\n", (i==0 ? "AVL_TREE" : "AVL_ITREE"),
+                ins[i], find[i], del[i], mem[i]/1048576.0);
+
+    AVL_destroy(t);
+    AVL_ixDestroy(x);
+    free(probe);
+    free(keys);
+    return(0);
+}
+
+//
+//  Node format benchmark, run as 'avl_example nodes', once built as is
+//  and once with -DAVL_TAGGED_NODE.  The size of a node, the nodes in a
+//  block of the default size, the memory of the blocks for a million
+//  random keys, and the time per random find.
+//
+int nodeBenchmark(void)
+{
+    AVL_TREE *t=AVL_newTree(128, exampleEval, NULL);
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    int *probe=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    double find=0;
+    size_t mem;
+    struct timespec t0;
+    unsigned seed=1;
+    int i, k;
+
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+    {
+        keys[i]=i;
+        probe[i]=i;
+    }
+    for (i=AVL_INDEX_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        k=keys[i];
+        keys[i]=keys[j];
+        keys[j]=k;
+        j=rand_r(&seed)%(i+1);
+        k=probe[i];
+        probe[i]=probe[j];
+        probe[j]=k;
+    }
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        AVL_insert(t, &(keys[i]));
+    if (AVL_checkBalance((*t).top)<0)
+    {
+        fprintf(stderr, "ERROR:  tree out of balance!\n");
+        return(1);
+    }
+#ifdef AVL_TAGGED_NODE
+    mem=(size_t)(*t).blocks*(*t).blockSize;
+#else
+    mem=(size_t)(*t).blocks*(sizeof(AVL_BLOCK)+(*t).allocAtOnce*sizeof(AVL_NODE));
+#endif
+
+    //  Best of 3 passes, the first one warms up:
+    for (k=0; k<3; k+=1)
+    {
+        double s;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            if (AVL_find(t, &(probe[i]))==NULL)
+                fprintf(stderr, "ERROR:  key %i not found!\n", probe[i]);
+        s=freezeSeconds(&t0);
+        if (k==0 || s<find)
+            find=s;
+    }
+
+#ifdef AVL_TAGGED_NODE
+    fprintf(stdout, "tagged nodes:    ");
+#else
+    fprintf(stdout, "regular nodes:   ");
+#endif
+    fprintf(stdout, "%i bytes, %i per block, %.1f MB for %i keys, %.1f ns per find\n",
+            (int)sizeof(AVL_NODE), (*t).allocAtOnce, mem/1048576.0, AVL_INDEX_KEYS, find*1e9/AVL_INDEX_KEYS);
+
+    AVL_destroy(t);
+    free(probe);
+    free(keys);
+    return(0);
+}
+
+//
+//  Batched lookup benchmark, run as 'avl_example many'.  A million random
+//  keys, half of them in the tree, looked up with 'find' one at a time,
+//  and with 'findMany' in batches of 64 and 256.  Then the same with each
+//  batch of 256 sorted, which 'findSorted' takes as well.  The results
+//  must agree.
+//
+int manySort(const void *a, const void *b)
+{
+    return(*((int*)a)-*((int*)b));
+}
+
+int manyBenchmark(void)
+{
+    AVL_TREE *t=AVL_newTree(128, exampleEval, NULL);
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    int *probe=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    void **kp=(void**)malloc(AVL_INDEX_KEYS*sizeof(void*));
+    void **out=(void**)malloc(AVL_INDEX_KEYS*sizeof(void*));
+    int batch[6]={1, 64, 256, 1, 256, 256};
+    double s[6];
+    struct timespec t0;
+    unsigned seed=1;
+    int i, j, k;
+
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+    {
+        keys[i]=i;
+        probe[i]=2*i;
+    }
+    for (i=AVL_INDEX_KEYS-1; i>0; i-=1)
+    {
+        j=rand_r(&seed)%(i+1);
+        k=keys[i];
+        keys[i]=keys[j];
+        keys[j]=k;
+        j=rand_r(&seed)%(i+1);
+        k=probe[i];
+        probe[i]=probe[j];
+        probe[j]=k;
+    }
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+    {
+        AVL_insert(t, &(keys[i]));
+        kp[i]=&(probe[i]);
+    }
+
+    for (k=0; k<6; k+=1)
+    {
+        //  The second half is on sorted keys, as for a merge join:
+        if (k==3)
+            qsort(probe, AVL_INDEX_KEYS, sizeof(int), manySort);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i=0; i<AVL_INDEX_KEYS; i+=batch[k])
+        {
+            int n=(AVL_INDEX_KEYS-i<batch[k] ? AVL_INDEX_KEYS-i : batch[k]);
+            if (batch[k]==1)
+                out[i]=AVL_find(t, kp[i]);
+            else if (k==5)
+                AVL_findSorted(t, kp+i, n, out+i);
+            else
+                AVL_findMany(t, kp+i, n, out+i);
+        }
+        s[k]=freezeSeconds(&t0);
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            if ((out[i]!=NULL)!=(probe[i]<AVL_INDEX_KEYS) || (out[i]!=NULL && *((int*)out[i])!=probe[i]))
+            {
+                fprintf(stderr, "ERROR:  wrong result for key %i!\n", probe[i]);
+                return(1);
+            }
+    }
+
+    fprintf(stdout, "%i lookups, ns per key:\n", AVL_INDEX_KEYS);
+    fprintf(stdout, "random batches   find %7.1f   findMany(64) %7.1f   findMany(256) %7.1f\n",
+            s[0]*1e9/AVL_INDEX_KEYS, s[1]*1e9/AVL_INDEX_KEYS, s[2]*1e9/AVL_INDEX_KEYS);
+    fprintf(stdout, "sorted batches   find %7.1f   findMany(256) %6.1f   findSorted(256) %5.1f\n",
+            s[3]*1e9/AVL_INDEX_KEYS, s[4]*1e9/AVL_INDEX_KEYS, s[5]*1e9/AVL_INDEX_KEYS);
+
+    AVL_destroy(t);
+    free(out);
+    free(kp);
+    free(probe);
+    free(keys);
+    return(0);
+}
+
+//
+//  Hinted insert benchmark, run as 'avl_example hint'.  A million keys
+//  that grow, and a million that grow but each land up to 16 places back,
+//  inserted with 'insert', and with 'insertHint' and a cursor that follows
+//  the inserts.  Counts the calls to 'eval' as well.
+//
+long hintCalls;
+
+int hintEval(void *data1, void *data2, void *user)
+{
+    hintCalls+=1;
+    return((*((int*)data2))-(*((int*)data1)));
+}
+
+int hintBenchmark(void)
+{
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    double s[2][2];
+    long calls[2][2];
+    struct timespec t0;
+    unsigned seed=1;
+    int i, k, h;
+
+    for (k=0; k<2; k+=1)
+    {
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            keys[i]=(k==0 ? i : 16*i-16*(rand_r(&seed)%16)+rand_r(&seed)%16);
+        for (h=0; h<2; h+=1)
+        {
+            AVL_TREE *t=AVL_newTree(128, hintEval, NULL);
+            AVL_CURSOR c;
+
+            AVL_cursorLast(&c, t);
+            hintCalls=0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            {
+                if (h==0)
+                    AVL_insert(t, &(keys[i]));
+                else
+                    AVL_insertHint(t, &(keys[i]), &c);
+            }
+            s[k][h]=freezeSeconds(&t0);
+            calls[k][h]=hintCalls;
+            if (AVL_checkBalance((*t).top)!=(*t).height)
+            {
+                fprintf(stderr, "ERROR:  tree out of balance!\n");
+                return(1);
+            }
+            AVL_destroy(t);
+        }
+    }
+
+    fprintf(stdout, "%i inserts       insert             insertHint\n", AVL_INDEX_KEYS);
+    for (k=0; k<2; k+=1)
+        fprintf(stdout, "%-14s %6.3fs %5.1f evals   %6.3fs %5.1f evals\n", (k==0 ? "in order" : "nearly sorted"),
+                s[k][0], (double)calls[k][0]/AVL_INDEX_KEYS, s[k][1], (double)calls[k][1]/AVL_INDEX_KEYS);
+
+    free(keys);
+    return(0);
+}
+
+//
+//  Pop benchmark, run as 'avl_example pop'.  A queue of a million
+//  deadlines, taken out earliest first with 'cursorFirst' and 'delete',
+//  and with 'popMin'.  Counts the calls to 'eval' as well.
+//
+int popBenchmark(void)
+{
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    double s[2];
+    long calls[2];
+    struct timespec t0;
+    unsigned seed=1;
+    int i, h;
+
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        keys[i]=16*i+rand_r(&seed)%16;
+    for (i=AVL_INDEX_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        int k=keys[i];
+        keys[i]=keys[j];
+        keys[j]=k;
+    }
+    for (h=0; h<2; h+=1)
+    {
+        AVL_TREE *t=AVL_newTree(128, hintEval, NULL);
+        int last=-1;
+
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            AVL_insert(t, &(keys[i]));
+        hintCalls=0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        {
+            int *d;
+
+            if (h==0)
+            {
+                AVL_CURSOR c;
+                d=(int*)AVL_cursorFirst(&c, t);
+                AVL_delete(t, d);
+            }
+            else
+                d=(int*)AVL_popMin(t);
+            if (*d<=last)
+            {
+                fprintf(stderr, "ERROR:  out of order!\n");
+                return(1);
+            }
+            last=*d;
+        }
+        s[h]=freezeSeconds(&t0);
+        calls[h]=hintCalls;
+        if ((*t).top!=NULL)
+        {
+            fprintf(stderr, "ERROR:  tree not empty!\n");
+            return(1);
+        }
+        AVL_destroy(t);
+    }
+
+    fprintf(stdout, "%i deadlines, earliest first\n", AVL_INDEX_KEYS);
+    fprintf(stdout, "cursorFirst+delete  %6.3fs %5.1f evals\n", s[0], (double)calls[0]/AVL_INDEX_KEYS);
+    fprintf(stdout, "popMin              %6.3fs %5.1f evals\n", s[1], (double)calls[1]/AVL_INDEX_KEYS);
+
+    free(keys);
+    return(0);
+}
+
+//
+//  Upsert benchmark, run as 'avl_example upsert'.  A million random keys,
+//  about half of them repeats, first as get-or-create ('find', then
+//  'insert' if missing, against 'findOrInsert'), then as updates
+//  ('delete', then 'insert', against 'replace').  Counts the calls to
+//  'eval' as well.
+//
+int upsertBenchmark(void)
+{
+    int *keys=(int*)malloc(2*AVL_INDEX_KEYS*sizeof(int));
+    double s[2][2];
+    long calls[2][2];
+    struct timespec t0;
+    unsigned seed=1;
+    int i, k, h;
+
+    for (i=0; i<2*AVL_INDEX_KEYS; i+=1)
+        keys[i]=rand_r(&seed)%AVL_INDEX_KEYS;
+    for (k=0; k<2; k+=1)
+    {
+        for (h=0; h<2; h+=1)
+        {
+            AVL_TREE *t=AVL_newTree(128, hintEval, NULL);
+
+            //  The updates start from a full tree, with the second copy of
+            //  the keys replacing the first:
+            if (k==1)
+                for (i=0; i<AVL_INDEX_KEYS; i+=1)
+                    AVL_insert(t, &(keys[i]));
+            hintCalls=0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (i=k*AVL_INDEX_KEYS; i<(k+1)*AVL_INDEX_KEYS; i+=1)
+            {
+                void *d=&(keys[i]);
+                void *x;
+
+                if (k==0 && h==0)
+                {
+                    x=AVL_find(t, d);
+                    if (x==NULL)
+                        AVL_insert(t, d);
+                }
+                else if (k==0)
+                    AVL_findOrInsert(t, d, &x);
+                else if (h==0)
+                {
+                    AVL_delete(t, d);
+                    AVL_insert(t, d);
+                }
+                else
+                    AVL_replace(t, d, &x);
+            }
+            s[k][h]=freezeSeconds(&t0);
+            calls[k][h]=hintCalls;
+            if (AVL_checkBalance((*t).top)!=(*t).height)
+            {
+                fprintf(stderr, "ERROR:  tree out of balance!\n");
+                return(1);
+            }
+            AVL_destroy(t);
+        }
+    }
+
+    fprintf(stdout, "%i operations    two steps          one descent\n", AVL_INDEX_KEYS);
+    for (k=0; k<2; k+=1)
+        fprintf(stdout, "%-14s %6.3fs %5.1f evals   %6.3fs %5.1f evals\n", (k==0 ? "get or create" : "update"),
+                s[k][0], (double)calls[k][0]/AVL_INDEX_KEYS, s[k][1], (double)calls[k][1]/AVL_INDEX_KEYS);
+
+    free(keys);
+    return(0);
+}
+
+//
+//  Sweep benchmark, run as 'avl_example sweep'.  A million keys, of which
+//  one in four has expired:  found in a scan with a cursor, and then taken
+//  out with 'delete', against 'cursorDelete' as the scan goes.  Counts
+//  the calls to 'eval' as well.
+//
+int sweepBenchmark(void)
+{
+    int *keys=(int*)malloc(AVL_INDEX_KEYS*sizeof(int));
+    void **expired=(void**)malloc(AVL_INDEX_KEYS*sizeof(void*));
+    double s[2];
+    long calls[2];
+    struct timespec t0;
+    unsigned seed=1;
+    int i, h, n=0;
+
+    for (i=0; i<AVL_INDEX_KEYS; i+=1)
+        keys[i]=i;
+    for (i=AVL_INDEX_KEYS-1; i>0; i-=1)
+    {
+        int j=rand_r(&seed)%(i+1);
+        int k=keys[i];
+        keys[i]=keys[j];
+        keys[j]=k;
+    }
+    for (h=0; h<2; h+=1)
+    {
+        AVL_TREE *t=AVL_newTree(128, hintEval, NULL);
+        AVL_CURSOR c;
+        int *d;
+
+        for (i=0; i<AVL_INDEX_KEYS; i+=1)
+            AVL_insert(t, &(keys[i]));
+        hintCalls=0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        d=(int*)AVL_cursorFirst(&c, t);
+        n=0;
+        while (d)
+        {
+            if (*d%4!=0)
+                d=(int*)AVL_cursorNext(&c);
+            else if (h==0)
+            {
+                expired[n]=d;
+                n+=1;
+                d=(int*)AVL_cursorNext(&c);
+            }
+            else
+            {
+                n+=1;
+                d=(int*)AVL_cursorDelete(&c);
+            }
+        }
+        for (i=0; i<n && h==0; i+=1)
+            AVL_delete(t, expired[i]);
+        s[h]=freezeSeconds(&t0);
+        calls[h]=hintCalls;
+        if (AVL_checkBalance((*t).top)!=(*t).height || (*t).size!=AVL_INDEX_KEYS-n)
+        {
+            fprintf(stderr, "ERROR:  tree out of balance!\n");
+            return(1);
+        }
+        AVL_destroy(t);
+    }
+
+    fprintf(stdout, "%i keys, %i expired\n", AVL_INDEX_KEYS, n);
+    fprintf(stdout, "scan, then delete   %6.3fs %5.2f evals\n", s[0], (double)calls[0]/n);
+    fprintf(stdout, "cursorDelete        %6.3fs %5.2f evals\n", s[1], (double)calls[1]/n);
+
+    free(expired);
+    free(keys);
+    return(0);
+}
+
 //
 //  Sample main and unit test:
 //
@@ -320,9 +1211,31 @@ int main(int argc, char **argv)
     void *retval;   //  Will be NULL.
     int i;
 
+    if (argc>1 && strcmp(argv[1], "scale")==0)
+        return(scaleBenchmark());
+    if (argc>1 && strcmp(argv[1], "freeze")==0)
+        return(freezeBenchmark());
+    if (argc>1 && strcmp(argv[1], "define")==0)
+        return(defineBenchmark());
+    if (argc>1 && strcmp(argv[1], "index")==0)
+        return(indexBenchmark());
+    if (argc>1 && strcmp(argv[1], "nodes")==0)
+        return(nodeBenchmark());
+    if (argc>1 && strcmp(argv[1], "many")==0)
+        return(manyBenchmark());
+    if (argc>1 && strcmp(argv[1], "hint")==0)
+        return(hintBenchmark());
+    if (argc>1 && strcmp(argv[1], "pop")==0)
+        return(popBenchmark());
+    if (argc>1 && strcmp(argv[1], "upsert")==0)
+        return(upsertBenchmark());
+    if (argc>1 && strcmp(argv[1], "sweep")==0)
+        return(sweepBenchmark());
+
     memset(&e, 0, sizeof(AVL_EXAMPLE_STRUCT));
     pthread_mutex_init(&e.rankLock, NULL);
     e.nt=16;
+    e.pool=AVL_newPool(32);
 
     //  Create the workers
     for (i=0; i<e.nt; i+=1)
@@ -333,6 +1246,7 @@ int main(int argc, char **argv)
         pthread_join(e.tid[i], &retval);
 
 
+    AVL_destroyPool(e.pool);
     pthread_mutex_destroy(&e.rankLock);
     return(0);
 }
@@ -0,0 +1,506 @@
+/*
+ *  Copyright (c) 2020 by Vincent H. Berk
+ *  All rights reserved.
+ *
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include "avl_ix.h"
+
+
+//
+//  The fields of a node.
+//
+//  'l':  Bits:     Mask:          Field:
+//          0-29      0x3fffffff     Index of the left subtree
+//          30-31     0xc0000000     Balance plus one:  0 left-heavy, 1 even, 2 right-heavy,
+//                                   3 for a node on the free list
+//  'r':    0-29      0x3fffffff     Index of the right subtree, or of the next free node
+//
+#define AVL_IX_INDEX        0x3fffffff
+#define AVL_IX_FREE         0xc0000000
+
+#define AVL_ixL(t,i)        ((*(t)).n[i].l&AVL_IX_INDEX)
+#define AVL_ixR(t,i)        ((*(t)).n[i].r)
+#define AVL_ixBal(t,i)      ((int)((*(t)).n[i].l>>30)-1)
+#define AVL_ixSetL(t,i,x)   ((*(t)).n[i].l=((*(t)).n[i].l&~AVL_IX_INDEX)|(x))
+#define AVL_ixSetR(t,i,x)   ((*(t)).n[i].r=(x))
+#define AVL_ixSetBal(t,i,v) ((*(t)).n[i].l=((*(t)).n[i].l&AVL_IX_INDEX)|((uint32_t)((v)+1)<<30))
+
+//  Child on side 'dir' (-1 left, +1 right):
+#define AVL_ixChild(t,i,dir)        ((dir)<0 ? AVL_ixL(t,i) : AVL_ixR(t,i))
+#define AVL_ixSetChild(t,i,dir,x)   ((dir)<0 ? AVL_ixSetL(t,i,x) : AVL_ixSetR(t,i,x))
+
+//  Longest path, an AVL tree of 2^30 nodes is at most 44 high:
+#define AVL_IX_MAX_DEPTH    64
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Memory management                                                  *
+ *                                                                      *
+ ************************************************************************/
+
+
+AVL_ITREE *AVL_ixNewTree(int allocAtOnce, int (*eval)(void *d1, void *d2, void *user), void *user)
+{
+    AVL_ITREE *t=(AVL_ITREE*)malloc(sizeof(AVL_ITREE));
+    if (t==NULL)
+        return(NULL);
+
+    memset(t, 0, sizeof(AVL_ITREE));
+    if (allocAtOnce<2)
+        allocAtOnce=2;
+    if (allocAtOnce>AVL_IX_MAX_NODES)
+        allocAtOnce=AVL_IX_MAX_NODES;
+    (*t).n=(AVL_INODE*)malloc(allocAtOnce*sizeof(AVL_INODE));
+    if ((*t).n==NULL)
+    {
+        free(t);
+        return(NULL);
+    }
+    (*t).allocAtOnce=allocAtOnce;
+    (*t).max=allocAtOnce;
+    (*t).used=1;
+    (*t).eval=eval;
+    (*t).user=user;
+    return(t);
+}
+
+
+void AVL_ixFlush(AVL_ITREE *t)
+{
+    (*t).used=1;
+    (*t).free=0;
+    (*t).top=0;
+    (*t).height=0;
+    (*t).size=0;
+}
+
+
+void AVL_ixDestroy(AVL_ITREE *t)
+{
+    free((*t).n);
+    free(t);
+}
+
+
+//
+//  Internal method:  takes a node off the free list, or the next one of
+//  the arena, which doubles when it is full.  Returns 0 if out of memory.
+//
+uint32_t AVL_ixNewNode(AVL_ITREE *t)
+{
+    uint32_t i=(*t).free;
+
+    if (i!=0)
+    {
+        (*t).free=(*t).n[i].r;
+        return(i);
+    }
+    if ((*t).used==(*t).max)
+    {
+        uint64_t max=(uint64_t)(*t).max*2;
+        AVL_INODE *n;
+
+        if (max>(uint64_t)AVL_IX_MAX_NODES+1)
+            max=(uint64_t)AVL_IX_MAX_NODES+1;
+        if (max<=(*t).max)
+            return(0);
+        n=(AVL_INODE*)realloc((*t).n, max*sizeof(AVL_INODE));
+        if (n==NULL)
+            return(0);
+        (*t).n=n;
+        (*t).max=(uint32_t)max;
+    }
+    i=(*t).used;
+    (*t).used+=1;
+    return(i);
+}
+
+
+//
+//  Internal method:  puts a node on the free list.
+//
+void AVL_ixFreeNode(AVL_ITREE *t, uint32_t i)
+{
+    (*t).n[i].l=AVL_IX_FREE;
+    (*t).n[i].r=(*t).free;
+    (*t).n[i].d=NULL;
+    (*t).free=i;
+}
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Rebalancing                                                        *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Internal method:  makes 'x' the subtree at position 'i' of the path,
+//  so the child of 'path[i-1]', or the top of the tree.
+//
+void AVL_ixReplace(AVL_ITREE *t, uint32_t *path, int8_t *dir, int i, uint32_t x)
+{
+    if (i==0)
+        (*t).top=x;
+    else
+        AVL_ixSetChild(t, path[i-1], dir[i-1], x);
+}
+
+
+/*
+ *  Internal method:  rotates the subtree under 'a', which has gone out of
+ *  balance to 'bal' (-2 or +2, not stored yet), and returns its new top.
+ *  With 's' the heavy side, and 'b' the child on that side:
+ *
+ *    single, when 'b' leans the same way or is even:
+ *
+ *          a                  b
+ *         / \                / \
+ *            b      -->     a
+ *           / \            / \
+ *         bx                 bx
+ *
+ *    double, when 'b' leans the other way, through its child 'c':
+ *
+ *          a                    c
+ *         / \                 /   \
+ *            b      -->      a     b
+ *           / \             / \   / \
+ *          c                  cx cy
+ *         / \
+ *       cx   cy
+ *
+ *  (drawn for s=+1, the other side is the mirror image).  After an insert
+ *  the new top is always even, and the subtree is as high as before the
+ *  insert.  After a delete that is only so if the new top is not even.
+ */
+uint32_t AVL_ixRotate(AVL_ITREE *t, uint32_t a, int bal)
+{
+    int s=(bal>0 ? +1 : -1);
+    uint32_t b=AVL_ixChild(t, a, s);
+    int bb=AVL_ixBal(t, b);
+
+    if (bb!=-s)
+    {
+        //  Single rotation:
+        AVL_ixSetChild(t, a, s, AVL_ixChild(t, b, -s));
+        AVL_ixSetChild(t, b, -s, a);
+        if (bb==0)
+        {
+            AVL_ixSetBal(t, a, s);
+            AVL_ixSetBal(t, b, -s);
+        }
+        else
+        {
+            AVL_ixSetBal(t, a, 0);
+            AVL_ixSetBal(t, b, 0);
+        }
+        return(b);
+    }
+    else
+    {
+        //  Double rotation:
+        uint32_t c=AVL_ixChild(t, b, -s);
+        int bc=AVL_ixBal(t, c);
+
+        AVL_ixSetChild(t, b, -s, AVL_ixChild(t, c, s));
+        AVL_ixSetChild(t, a, s, AVL_ixChild(t, c, -s));
+        AVL_ixSetChild(t, c, s, b);
+        AVL_ixSetChild(t, c, -s, a);
+        AVL_ixSetBal(t, a, (bc==s ? -s : 0));
+        AVL_ixSetBal(t, b, (bc==-s ? s : 0));
+        AVL_ixSetBal(t, c, 0);
+        return(c);
+    }
+}
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Tree operations                                                    *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  The arena is read through a local copy of its pointer, as the compiler
+//  can not know that 'eval' leaves (*t).n alone.
+//
+void *AVL_ixFind(AVL_ITREE *t, void *k)
+{
+    AVL_INODE *n=(*t).n;
+    uint32_t c=(*t).top;
+
+    while (c!=0)
+    {
+        int e=(*t).eval(n[c].d, k, (*t).user);
+        if (e==0)
+            return(n[c].d);
+        c=(e<0 ? n[c].l&AVL_IX_INDEX : n[c].r);
+    }
+    return(NULL);
+}
+
+
+//
+//  Insert records the path down, adds the new node at the bottom, and goes
+//  back up as long as the subtree it came from got higher.  A node that
+//  was even now leans, and the path goes on.  A node that leaned the other
+//  way is now even, and a node that leaned the same way is rotated, and
+//  either ends it.
+//
+int AVL_ixInsert(AVL_ITREE *t, void *d)
+{
+    uint32_t path[AVL_IX_MAX_DEPTH];
+    int8_t dir[AVL_IX_MAX_DEPTH];
+    uint32_t c=(*t).top;
+    int top=0;
+    int i;
+
+    while (c!=0 && top<AVL_IX_MAX_DEPTH)
+    {
+        int e=(*t).eval((*t).n[c].d, d, (*t).user);
+        if (e==0)
+            return(1);
+        path[top]=c;
+        dir[top]=(e<0 ? -1 : +1);
+        c=AVL_ixChild(t, c, dir[top]);
+        top+=1;
+    }
+
+    c=AVL_ixNewNode(t);
+    if (c==0)
+        return(2);
+    (*t).n[c].l=0;
+    (*t).n[c].r=0;
+    (*t).n[c].d=d;
+    AVL_ixSetBal(t, c, 0);
+    AVL_ixReplace(t, path, dir, top, c);
+    (*t).size+=1;
+
+    for (i=top-1; i>=0; i-=1)
+    {
+        int b=AVL_ixBal(t, path[i])+dir[i];
+        if (b==0)
+        {
+            AVL_ixSetBal(t, path[i], 0);
+            return(0);
+        }
+        if (b==-1 || b==+1)
+            AVL_ixSetBal(t, path[i], b);
+        else
+        {
+            AVL_ixReplace(t, path, dir, i, AVL_ixRotate(t, path[i], b));
+            return(0);
+        }
+    }
+
+    //  All the way up, the tree got higher:
+    (*t).height+=1;
+    return(0);
+}
+
+
+//
+//  Delete swaps a node with two children for its in-order successor, by
+//  moving the data pointer, so the node that leaves the tree has one child
+//  at most, which takes its place.  Then back up, as long as the subtree it
+//  came from got lower.  A node that was even now leans, which ends it,
+//  and one that leaned that way is now even, and the path goes on.  One
+//  that leaned the other way is rotated, and the path goes on if that
+//  left the subtree lower.
+//
+void *AVL_ixDelete(AVL_ITREE *t, void *k)
+{
+    uint32_t path[AVL_IX_MAX_DEPTH];
+    int8_t dir[AVL_IX_MAX_DEPTH];
+    uint32_t c=(*t).top;
+    uint32_t x;
+    void *d;
+    int top=0;
+    int i;
+
+    while (c!=0 && top<AVL_IX_MAX_DEPTH)
+    {
+        int e=(*t).eval((*t).n[c].d, k, (*t).user);
+        if (e==0)
+            break;
+        path[top]=c;
+        dir[top]=(e<0 ? -1 : +1);
+        c=AVL_ixChild(t, c, dir[top]);
+        top+=1;
+    }
+    if (c==0 || top==AVL_IX_MAX_DEPTH)
+        return(NULL);
+    d=(*t).n[c].d;
+
+    if (AVL_ixL(t, c)!=0 && AVL_ixR(t, c)!=0)
+    {
+        uint32_t s;
+
+        path[top]=c;
+        dir[top]=+1;
+        top+=1;
+        s=AVL_ixR(t, c);
+        while (AVL_ixL(t, s)!=0)
+        {
+            path[top]=s;
+            dir[top]=-1;
+            top+=1;
+            s=AVL_ixL(t, s);
+        }
+        (*t).n[c].d=(*t).n[s].d;
+        c=s;
+    }
+
+    x=AVL_ixL(t, c);
+    if (x==0)
+        x=AVL_ixR(t, c);
+    AVL_ixReplace(t, path, dir, top, x);
+    AVL_ixFreeNode(t, c);
+    (*t).size-=1;
+
+    for (i=top-1; i>=0; i-=1)
+    {
+        int b=AVL_ixBal(t, path[i])-dir[i];
+        if (b==-1 || b==+1)
+        {
+            AVL_ixSetBal(t, path[i], b);
+            return(d);
+        }
+        if (b==0)
+            AVL_ixSetBal(t, path[i], 0);
+        else
+        {
+            x=AVL_ixRotate(t, path[i], b);
+            AVL_ixReplace(t, path, dir, i, x);
+            if (AVL_ixBal(t, x)!=0)
+                return(d);
+        }
+    }
+
+    //  All the way up, the tree got lower:
+    (*t).height-=1;
+    return(d);
+}
+
+
+void AVL_ixWalk(AVL_ITREE *t, void (*callback)(void *d, void *user), void *user)
+{
+    uint32_t stack[AVL_IX_MAX_DEPTH];
+    uint32_t c=(*t).top;
+    int top=0;
+
+    while (c!=0 || top>0)
+    {
+        if (c!=0)
+        {
+            stack[top]=c;
+            top+=1;
+            c=AVL_ixL(t, c);
+        }
+        else
+        {
+            top-=1;
+            c=stack[top];
+            callback((*t).n[c].d, user);
+            c=AVL_ixR(t, c);
+        }
+    }
+}
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Testing and validation                                             *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Internal method:  checks the subtree under 'c', of which all data must
+//  lie between 'lo' and 'hi' (NULL for open), and counts its nodes.
+//  Returns its height, or -1.
+//
+int AVL_ixCheckNode(AVL_ITREE *t, uint32_t c, void *lo, void *hi, int *count)
+{
+    int hl, hr;
+
+    if (c==0)
+        return(0);
+    if (c>=(*t).used || ((*t).n[c].l&AVL_IX_FREE)==AVL_IX_FREE)
+    {
+        fprintf(stderr, "AVL_ixCheckBalance:  free or unused node %u in the tree\n", c);
+        return(-1);
+    }
+    if ((lo && (*t).eval(lo, (*t).n[c].d, (*t).user)<=0) || (hi && (*t).eval(hi, (*t).n[c].d, (*t).user)>=0))
+    {
+        fprintf(stderr, "AVL_ixCheckBalance:  order error\n");
+        return(-1);
+    }
+    *count+=1;
+    hl=AVL_ixCheckNode(t, AVL_ixL(t, c), lo, (*t).n[c].d, count);
+    hr=AVL_ixCheckNode(t, AVL_ixR(t, c), (*t).n[c].d, hi, count);
+    if (hl<0 || hr<0)
+        return(-1);
+    if (hr-hl!=AVL_ixBal(t, c))
+    {
+        fprintf(stderr, "AVL_ixCheckBalance:  balance error (%i vs %i, balance %i)\n", hl, hr, AVL_ixBal(t, c));
+        return(-1);
+    }
+    return(1+(hl>hr ? hl : hr));
+}
+
+
+int AVL_ixCheckBalance(AVL_ITREE *t)
+{
+    int count=0;
+    int h=AVL_ixCheckNode(t, (*t).top, NULL, NULL, &count);
+
+    if (h<0)
+        return(-1);
+    if (count!=(*t).size)
+    {
+        fprintf(stderr, "AVL_ixCheckBalance:  size error (%i, should be %i)\n", (*t).size, count);
+        return(-1);
+    }
+    if (h!=(*t).height)
+    {
+        fprintf(stderr, "AVL_ixCheckBalance:  height error (%i, should be %i)\n", (*t).height, h);
+        return(-1);
+    }
+    return(h);
+}
@@ -0,0 +1,178 @@
+/*
+ *  Copyright (c) 2020 by Vincent H. Berk
+ *  All rights reserved.
+ *
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ *  Compact AVL tree, for very large trees, with 16 byte nodes.
+ *
+ *  All nodes live in one array, the arena, and refer to their children by
+ *  32-bit index into it, rather than by pointer.  The balance of a node
+ *  goes into the top bits of its left index, so a node is two indices and
+ *  the data pointer:  16 bytes on a 64 bit system, half of an AVL_NODE,
+ *  and twice as many nodes fit in each cache line and page.  Index 0 is
+ *  not used, and stands for NULL.
+ *
+ *  The arena doubles when it is full, through 'realloc', which may move
+ *  it:  indices stay valid, pointers to nodes do not, so the tree never
+ *  hands them out.  Deleted nodes go onto a free list, and are reused
+ *  before the arena grows.  The arena does not shrink, other than by
+ *  'flush' or 'destroy'.  A tree holds at most AVL_IX_MAX_NODES items.
+ *
+ *  The evaluation method, and the return codes of insert/delete/find, are
+ *  the same as in avl.h, and so is the locking:  modifications must be
+ *  exclusive, searches and walks can be concurrent with each other.
+ *  None of the other features of AVL_TREE (cursors, order statistics,
+ *  shared allocation sets, concurrent readers...) apply to these trees.
+ *
+ */
+
+
+
+
+#ifndef _AVL_IX_TREE_H
+#define _AVL_IX_TREE_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//  The index takes the low 30 bits of 'l' and 'r', which leaves 2 bits
+//  in each for the balance and the free flag.
+#define AVL_IX_MAX_NODES 0x3fffffff
+
+
+//  A node of the compact tree, 16 bytes on a 64 bit system (12 on 32-bit).
+typedef struct
+{
+    uint32_t l;                 //  Left subtree, and the balance in the top 2 bits
+    uint32_t r;                 //  Right subtree, or the next free node
+    void *d;                    //  The user data pointer
+}
+AVL_INODE;
+
+
+//  Global tree structure:
+typedef struct
+{
+    AVL_INODE *n;               //  The arena, n[1..used-1] have been handed out
+    uint32_t max;               //  Size of the arena, in nodes
+    uint32_t used;              //  High-water mark
+    uint32_t free;              //  Free list, linked on 'r', 0 if empty
+    uint32_t top;               //  Top of the tree, 0 if empty
+    int allocAtOnce;            //  Size of the first arena
+    int height;                 //  Height to the deepest node
+    int size;                   //  Number of nodes in the tree
+
+    //  The method by which *data pointers are compared
+    int (*eval)(void *d1, void *d2, void *user);
+    void *user;
+}
+AVL_ITREE;
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Memory management                                                  *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Building a tree requires the evaluation method, as in 'AVL_newTree'.
+//  'allocAtOnce' is the number of nodes the arena starts with, and it
+//  doubles from there.  Returns NULL if out of memory.
+//
+AVL_ITREE *AVL_ixNewTree(int allocAtOnce, int (*eval)(void *d1, void *d2, void *user), void *user);
+
+//
+//  Empties the tree, but keeps the arena.
+//
+void AVL_ixFlush(AVL_ITREE *t);
+
+//
+//  Frees the arena and 't', which cannot be used again after.  The data
+//  in the tree is left alone.
+//
+void AVL_ixDestroy(AVL_ITREE *t);
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Tree operations                                                    *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  As 'AVL_insert', 'AVL_find', 'AVL_delete', and 'AVL_walk'.
+//
+//  Insert returns 0 when inserted, 1 if it already exists, 2 if unable
+//  to allocate memory (or the tree holds AVL_IX_MAX_NODES already).
+//  Delete and find return the data pointer, or NULL if not found.
+//
+int AVL_ixInsert(AVL_ITREE *t, void *d);
+void *AVL_ixFind(AVL_ITREE *t, void *k);
+void *AVL_ixDelete(AVL_ITREE *t, void *k);
+void AVL_ixWalk(AVL_ITREE *t, void (*callback)(void *d, void *user), void *user);
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Testing and validation                                             *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Regression testing method.  Returns the height of the tree, or -1 if
+//  there's a balance, order, or size error, printing an error message
+//  to 'stderr'.
+//
+int AVL_ixCheckBalance(AVL_ITREE *t);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1350 @@
+/*
+ *  Copyright (c) 2020 by Vincent H. Berk
+ *  All rights reserved.
+ *
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#include "avl_mt.h"
+#include <sched.h>
+
+
+//
+//  The version word of a node.
+//
+//  Bits:     Mask:       Field:
+//    0         0x01         Unlinked:  the node is no longer in the tree, final
+//    1         0x02         Shrinking:  a rotation is moving keys out of its subtree
+//    2-63                   Change count, bumped at the end of every rotation
+//
+#define AVL_MT_UNLINKED     0x01
+#define AVL_MT_SHRINKING    0x02
+
+#define AVL_mtBeginChange(v)    ((v)|AVL_MT_SHRINKING)
+#define AVL_mtEndChange(v)      (((v)|AVL_MT_SHRINKING)+2)
+
+//  Shared fields are always read and written through these:
+#define AVL_mtLoad(x)       __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define AVL_mtStore(x,v)    __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define AVL_mtHeight(n)     ((n)?AVL_mtLoad((*(n)).h):0)
+
+//  Outcomes of 'nodeCondition', other than a new height:
+#define AVL_MT_UNLINK       -1
+#define AVL_MT_REBALANCE    -2
+#define AVL_MT_NOTHING      -3
+
+//  Depth of the list of nodes to get back to while rebalancing:
+#define AVL_MT_PENDING      32
+
+//  Returned by the recursive searches when they must start over:
+static char AVL_mtRetryTag;
+#define AVL_MT_RETRY        ((void*)&AVL_mtRetryTag)
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Locking and reclamation                                            *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Node locks are held very briefly, a spin lock that yields will do:
+//
+void AVL_mtLock(AVL_MNODE *n)
+{
+    int i=0;
+    while (__atomic_exchange_n(&((*n).lock), 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&((*n).lock), __ATOMIC_RELAXED))
+        {
+            i+=1;
+            if (i%64==0)
+                sched_yield();
+        }
+    }
+    return;
+}
+
+void AVL_mtUnlock(AVL_MNODE *n)
+{
+    __atomic_store_n(&((*n).lock), 0, __ATOMIC_RELEASE);
+    return;
+}
+
+
+//
+//  Waits for a rotation around 'n' to finish.  The rotation holds
+//  the lock of 'n', so after a short spin, just take the lock.
+//
+void AVL_mtWait(AVL_MNODE *n)
+{
+    unsigned long v=AVL_mtLoad((*n).v);
+    int i;
+
+    if ((v&AVL_MT_SHRINKING)==0)
+        return;
+    for (i=0; i<100; i+=1)
+    {
+        if (AVL_mtLoad((*n).v)!=v)
+            return;
+    }
+    AVL_mtLock(n);
+    AVL_mtUnlock(n);
+    return;
+}
+
+
+//
+//  Internal method:  frees an unlinked node, and hands its data to 'release'.
+//
+void AVL_mtFreeNode(AVL_MTREE *t, AVL_MNODE *n)
+{
+    if ((*t).release && (*n).d)
+        (*t).release((*n).d, (*t).user);
+    free(n);
+    return;
+}
+
+
+//
+//  Internal method:  frees the limbo list 'i' of thread 'r'.
+//
+void AVL_mtReclaim(AVL_MTREE *t, AVL_MTHREAD *r, int i)
+{
+    AVL_MNODE *n=(*r).limbo[i];
+    (*r).limbo[i]=NULL;
+    while (n)
+    {
+        AVL_MNODE *x=n;
+        n=(*n).next;
+        AVL_mtFreeNode(t, x);
+        (*r).pending-=1;
+    }
+    return;
+}
+
+
+//
+//  Internal method:  moves the global epoch forward if every thread inside
+//  the tree has seen the current one.  Returns 1 if it moved.
+//
+int AVL_mtAdvance(AVL_MTREE *t)
+{
+    AVL_MTHREAD *r;
+    unsigned long g=__atomic_load_n(&((*t).epoch), __ATOMIC_SEQ_CST);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r=AVL_mtLoad((*t).threads); r; r=(*r).next)
+    {
+        unsigned long e=__atomic_load_n(&((*r).epoch), __ATOMIC_SEQ_CST);
+        if (e!=0 && e!=g)
+            return(0);
+    }
+    return(__atomic_compare_exchange_n(&((*t).epoch), &g, g+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+
+//
+//  Internal method:  the calling thread's record, registered on first use.
+//  Returns NULL if out of memory.
+//
+AVL_MTHREAD *AVL_mtThread(AVL_MTREE *t)
+{
+    AVL_MTHREAD *r=(AVL_MTHREAD*)pthread_getspecific((*t).key);
+
+    if (r)
+        return(r);
+
+    //  Take over the record of a thread that exited:
+    for (r=AVL_mtLoad((*t).threads); r; r=(*r).next)
+    {
+        if (__atomic_exchange_n(&((*r).used), 1, __ATOMIC_ACQ_REL)==0)
+            break;
+    }
+    if (r==NULL)
+    {
+        r=(AVL_MTHREAD*)malloc(sizeof(AVL_MTHREAD));
+        if (r==NULL)
+            return(NULL);
+        memset(r, 0, sizeof(AVL_MTHREAD));
+        (*r).used=1;
+        (*r).next=AVL_mtLoad((*t).threads);
+        while (!__atomic_compare_exchange_n(&((*t).threads), &((*r).next), r, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+    pthread_setspecific((*t).key, r);
+    return(r);
+}
+
+
+//
+//  Internal method:  destructor of the thread-specific key.  The limbo
+//  lists stay with the record, for the next thread that takes it over.
+//
+void AVL_mtThreadExit(void *p)
+{
+    AVL_MTHREAD *r=(AVL_MTHREAD*)p;
+    __atomic_store_n(&((*r).epoch), 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&((*r).used), 0, __ATOMIC_RELEASE);
+    return;
+}
+
+
+//
+//  Internal methods that bracket every operation.  On the way in, limbo
+//  lists that are at least two epochs old are freed.
+//
+void AVL_mtEnter(AVL_MTREE *t, AVL_MTHREAD *r)
+{
+    unsigned long g=__atomic_load_n(&((*t).epoch), __ATOMIC_SEQ_CST);
+    int i;
+
+    __atomic_store_n(&((*r).epoch), g, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i=0; i<3; i+=1)
+    {
+        if ((*r).limbo[i] && (*r).last[i]+2<=g)
+            AVL_mtReclaim(t, r, i);
+    }
+    return;
+}
+
+void AVL_mtExit(AVL_MTHREAD *r)
+{
+    __atomic_store_n(&((*r).epoch), 0, __ATOMIC_RELEASE);
+    return;
+}
+
+
+//
+//  Internal method:  puts an unlinked node in limbo.  It is tagged with
+//  the global epoch at this point, not the one the thread entered in.
+//
+void AVL_mtRetire(AVL_MTREE *t, AVL_MTHREAD *r, AVL_MNODE *n)
+{
+    unsigned long g=__atomic_load_n(&((*t).epoch), __ATOMIC_SEQ_CST);
+    int i=g%3;
+
+    //  A list from three epochs ago is certainly safe:
+    if ((*r).limbo[i] && (*r).last[i]!=g)
+        AVL_mtReclaim(t, r, i);
+    (*r).last[i]=g;
+    (*n).next=(*r).limbo[i];
+    (*r).limbo[i]=n;
+    (*r).pending+=1;
+    if ((*r).pending>=AVL_MT_BATCH)
+        AVL_mtAdvance(t);
+    return;
+}
+
+
+//
+//  Internal method:  a new, unlinked, node.
+//
+AVL_MNODE *AVL_mtNewNode(void *d, AVL_MNODE *p)
+{
+    AVL_MNODE *n=(AVL_MNODE*)malloc(sizeof(AVL_MNODE));
+    if (n)
+    {
+        memset(n, 0, sizeof(AVL_MNODE));
+        (*n).d=d;
+        (*n).p=p;
+        (*n).h=1;
+        (*n).live=1;
+    }
+    return(n);
+}
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Memory management                                                  *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+AVL_MTREE *AVL_mtNewTree(int (*eval)(void *d1, void *d2, void *user), void (*release)(void *d, void *user), void *user)
+{
+    AVL_MTREE *t=(AVL_MTREE*)malloc(sizeof(AVL_MTREE));
+    if (t)
+    {
+        memset(t, 0, sizeof(AVL_MTREE));
+        if (pthread_key_create(&((*t).key), AVL_mtThreadExit)!=0)
+        {
+            free(t);
+            return(NULL);
+        }
+        //  Epoch 0 is reserved for threads outside of the tree:
+        (*t).epoch=1;
+        (*t).eval=eval;
+        (*t).release=release;
+        (*t).user=user;
+    }
+    return(t);
+}
+
+
+void AVL_mtDestroy(AVL_MTREE *t)
+{
+    AVL_MNODE *n=(*t).root.r;
+    AVL_MTHREAD *r;
+    int i;
+
+    //  The nodes are taken down through the 'next' list, so there is no
+    //  need for a stack.  Routing nodes still hold deleted data:
+    if (n)
+        (*n).next=NULL;
+    while (n)
+    {
+        AVL_MNODE *x=n;
+        n=(*n).next;
+        if ((*x).l)
+        {
+            (*(*x).l).next=n;
+            n=(*x).l;
+        }
+        if ((*x).r)
+        {
+            (*(*x).r).next=n;
+            n=(*x).r;
+        }
+        if ((*x).live)
+            (*x).d=NULL;
+        AVL_mtFreeNode(t, x);
+    }
+
+    while ((r=(*t).threads)!=NULL)
+    {
+        (*t).threads=(*r).next;
+        for (i=0; i<3; i+=1)
+            AVL_mtReclaim(t, r, i);
+        free(r);
+    }
+    pthread_key_delete((*t).key);
+    free(t);
+    return;
+}
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Rebalancing                                                        *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Internal method:  what does 'n' need?  Either an unlink (a routing node
+//  with less than 2 children), a rotation, its new height, or nothing.
+//
+int AVL_mtNodeCondition(AVL_MNODE *n)
+{
+    AVL_MNODE *nl=AVL_mtLoad((*n).l);
+    AVL_MNODE *nr=AVL_mtLoad((*n).r);
+    int hn, hl, hr, hrepl, bal;
+
+    if ((nl==NULL || nr==NULL) && AVL_mtLoad((*n).live)==0)
+        return(AVL_MT_UNLINK);
+
+    hn=AVL_mtLoad((*n).h);
+    hl=AVL_mtHeight(nl);
+    hr=AVL_mtHeight(nr);
+    hrepl=1+(hl>hr?hl:hr);
+    bal=hl-hr;
+    if (bal<-1 || bal>1)
+        return(AVL_MT_REBALANCE);
+    return(hn!=hrepl ? hrepl : AVL_MT_NOTHING);
+}
+
+
+//
+//  Internal method, 'n' must be locked:  fixes the height of 'n', and
+//  returns the next node that needs attention, or NULL.
+//
+AVL_MNODE *AVL_mtFixHeight(AVL_MNODE *n, AVL_MNODE **f)
+{
+    int c=AVL_mtNodeCondition(n);
+    *f=NULL;
+    switch (c)
+    {
+        case AVL_MT_UNLINK:
+        case AVL_MT_REBALANCE:
+            return(n);
+        case AVL_MT_NOTHING:
+            return(NULL);
+        default:
+            AVL_mtStore((*n).h, c);
+            *f=n;
+            return(AVL_mtLoad((*n).p));
+    }
+}
+
+
+//
+//  Internal method, 'p' and 'n' must be locked:  takes 'n', which has
+//  at most one child, out of the tree.  Returns 0 if no longer possible.
+//
+int AVL_mtUnlink(AVL_MNODE *p, AVL_MNODE *n)
+{
+    AVL_MNODE *pl=AVL_mtLoad((*p).l);
+    AVL_MNODE *pr=AVL_mtLoad((*p).r);
+    AVL_MNODE *l, *r, *s;
+
+    if (pl!=n && pr!=n)
+        return(0);
+    l=AVL_mtLoad((*n).l);
+    r=AVL_mtLoad((*n).r);
+    if (l!=NULL && r!=NULL)
+        return(0);
+    s=(l ? l : r);
+
+    if (pl==n)
+        AVL_mtStore((*p).l, s);
+    else
+        AVL_mtStore((*p).r, s);
+    if (s)
+        AVL_mtStore((*s).p, p);
+
+    __atomic_store_n(&((*n).v), AVL_MT_UNLINKED, __ATOMIC_SEQ_CST);
+    AVL_mtStore((*n).live, 0);
+    return(1);
+}
+
+
+//
+//  Internal methods, the rotations.  'p', 'n', and the nodes moving up
+//  are locked.  'n' goes down and loses keys, so searches that passed it
+//  must wait, or start over.  The heights are those just read by the
+//  caller.  Each returns the next node that needs attention.
+//
+AVL_MNODE *AVL_mtRotateRight(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nl, int hr, int hll, AVL_MNODE *nlr, int hlr, AVL_MNODE **f)
+{
+    unsigned long v=AVL_mtLoad((*n).v);
+    AVL_MNODE *pl=AVL_mtLoad((*p).l);
+    int hnrepl, baln, ball;
+
+    __atomic_store_n(&((*n).v), AVL_mtBeginChange(v), __ATOMIC_SEQ_CST);
+
+    AVL_mtStore((*n).l, nlr);
+    if (nlr)
+        AVL_mtStore((*nlr).p, n);
+    AVL_mtStore((*nl).r, n);
+    AVL_mtStore((*n).p, nl);
+    if (pl==n)
+        AVL_mtStore((*p).l, nl);
+    else
+        AVL_mtStore((*p).r, nl);
+    AVL_mtStore((*nl).p, p);
+
+    hnrepl=1+(hlr>hr?hlr:hr);
+    AVL_mtStore((*n).h, hnrepl);
+    AVL_mtStore((*nl).h, 1+(hll>hnrepl?hll:hnrepl));
+
+    __atomic_store_n(&((*n).v), AVL_mtEndChange(v), __ATOMIC_SEQ_CST);
+
+    //  Does 'n' or 'nl' need more work?
+    baln=hlr-hr;
+    if (baln<-1 || baln>1)
+        return(n);
+    if ((nlr==NULL || hr==0) && AVL_mtLoad((*n).live)==0)
+        return(n);
+    ball=hll-hnrepl;
+    if (ball<-1 || ball>1)
+        return(nl);
+    if (hll==0 && AVL_mtLoad((*nl).live)==0)
+        return(nl);
+    return(AVL_mtFixHeight(p, f));
+}
+
+AVL_MNODE *AVL_mtRotateLeft(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nr, int hl, int hrr, AVL_MNODE *nrl, int hrl, AVL_MNODE **f)
+{
+    unsigned long v=AVL_mtLoad((*n).v);
+    AVL_MNODE *pl=AVL_mtLoad((*p).l);
+    int hnrepl, baln, balr;
+
+    __atomic_store_n(&((*n).v), AVL_mtBeginChange(v), __ATOMIC_SEQ_CST);
+
+    AVL_mtStore((*n).r, nrl);
+    if (nrl)
+        AVL_mtStore((*nrl).p, n);
+    AVL_mtStore((*nr).l, n);
+    AVL_mtStore((*n).p, nr);
+    if (pl==n)
+        AVL_mtStore((*p).l, nr);
+    else
+        AVL_mtStore((*p).r, nr);
+    AVL_mtStore((*nr).p, p);
+
+    hnrepl=1+(hl>hrl?hl:hrl);
+    AVL_mtStore((*n).h, hnrepl);
+    AVL_mtStore((*nr).h, 1+(hnrepl>hrr?hnrepl:hrr));
+
+    __atomic_store_n(&((*n).v), AVL_mtEndChange(v), __ATOMIC_SEQ_CST);
+
+    baln=hrl-hl;
+    if (baln<-1 || baln>1)
+        return(n);
+    if ((nrl==NULL || hl==0) && AVL_mtLoad((*n).live)==0)
+        return(n);
+    balr=hrr-hnrepl;
+    if (balr<-1 || balr>1)
+        return(nr);
+    if (hrr==0 && AVL_mtLoad((*nr).live)==0)
+        return(nr);
+    return(AVL_mtFixHeight(p, f));
+}
+
+
+//
+//  The double rotations.  Both 'n' and its child lose keys to the
+//  grandchild that moves up, so both are marked as changing.
+//
+AVL_MNODE *AVL_mtRotateRightOverLeft(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nl, int hr, int hll, AVL_MNODE *nlr, int hlrl, AVL_MNODE **f)
+{
+    unsigned long v=AVL_mtLoad((*n).v);
+    unsigned long vl=AVL_mtLoad((*nl).v);
+    AVL_MNODE *pl=AVL_mtLoad((*p).l);
+    AVL_MNODE *nlrl=AVL_mtLoad((*nlr).l);
+    AVL_MNODE *nlrr=AVL_mtLoad((*nlr).r);
+    int hlrr=AVL_mtHeight(nlrr);
+    int hnrepl, hlrepl, baln, ballr;
+
+    __atomic_store_n(&((*n).v), AVL_mtBeginChange(v), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&((*nl).v), AVL_mtBeginChange(vl), __ATOMIC_SEQ_CST);
+
+    AVL_mtStore((*n).l, nlrr);
+    if (nlrr)
+        AVL_mtStore((*nlrr).p, n);
+    AVL_mtStore((*nl).r, nlrl);
+    if (nlrl)
+        AVL_mtStore((*nlrl).p, nl);
+    AVL_mtStore((*nlr).l, nl);
+    AVL_mtStore((*nl).p, nlr);
+    AVL_mtStore((*nlr).r, n);
+    AVL_mtStore((*n).p, nlr);
+    if (pl==n)
+        AVL_mtStore((*p).l, nlr);
+    else
+        AVL_mtStore((*p).r, nlr);
+    AVL_mtStore((*nlr).p, p);
+
+    hnrepl=1+(hlrr>hr?hlrr:hr);
+    AVL_mtStore((*n).h, hnrepl);
+    hlrepl=1+(hll>hlrl?hll:hlrl);
+    AVL_mtStore((*nl).h, hlrepl);
+    AVL_mtStore((*nlr).h, 1+(hlrepl>hnrepl?hlrepl:hnrepl));
+
+    __atomic_store_n(&((*n).v), AVL_mtEndChange(v), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&((*nl).v), AVL_mtEndChange(vl), __ATOMIC_SEQ_CST);
+
+    baln=hlrr-hr;
+    if (baln<-1 || baln>1)
+        return(n);
+    if ((nlrr==NULL || hr==0) && AVL_mtLoad((*n).live)==0)
+        return(n);
+    if ((nlrl==NULL || hll==0) && AVL_mtLoad((*nl).live)==0)
+        return(nl);
+    ballr=hlrepl-hnrepl;
+    if (ballr<-1 || ballr>1)
+        return(nlr);
+    return(AVL_mtFixHeight(p, f));
+}
+
+AVL_MNODE *AVL_mtRotateLeftOverRight(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nr, int hl, int hrr, AVL_MNODE *nrl, int hrlr, AVL_MNODE **f)
+{
+    unsigned long v=AVL_mtLoad((*n).v);
+    unsigned long vr=AVL_mtLoad((*nr).v);
+    AVL_MNODE *pl=AVL_mtLoad((*p).l);
+    AVL_MNODE *nrll=AVL_mtLoad((*nrl).l);
+    AVL_MNODE *nrlr=AVL_mtLoad((*nrl).r);
+    int hrll=AVL_mtHeight(nrll);
+    int hnrepl, hrrepl, baln, balrl;
+
+    __atomic_store_n(&((*n).v), AVL_mtBeginChange(v), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&((*nr).v), AVL_mtBeginChange(vr), __ATOMIC_SEQ_CST);
+
+    AVL_mtStore((*n).r, nrll);
+    if (nrll)
+        AVL_mtStore((*nrll).p, n);
+    AVL_mtStore((*nr).l, nrlr);
+    if (nrlr)
+        AVL_mtStore((*nrlr).p, nr);
+    AVL_mtStore((*nrl).r, nr);
+    AVL_mtStore((*nr).p, nrl);
+    AVL_mtStore((*nrl).l, n);
+    AVL_mtStore((*n).p, nrl);
+    if (pl==n)
+        AVL_mtStore((*p).l, nrl);
+    else
+        AVL_mtStore((*p).r, nrl);
+    AVL_mtStore((*nrl).p, p);
+
+    hnrepl=1+(hl>hrll?hl:hrll);
+    AVL_mtStore((*n).h, hnrepl);
+    hrrepl=1+(hrlr>hrr?hrlr:hrr);
+    AVL_mtStore((*nr).h, hrrepl);
+    AVL_mtStore((*nrl).h, 1+(hnrepl>hrrepl?hnrepl:hrrepl));
+
+    __atomic_store_n(&((*n).v), AVL_mtEndChange(v), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&((*nr).v), AVL_mtEndChange(vr), __ATOMIC_SEQ_CST);
+
+    baln=hrll-hl;
+    if (baln<-1 || baln>1)
+        return(n);
+    if ((nrll==NULL || hl==0) && AVL_mtLoad((*n).live)==0)
+        return(n);
+    if ((nrlr==NULL || hrr==0) && AVL_mtLoad((*nr).live)==0)
+        return(nr);
+    balrl=hrrepl-hnrepl;
+    if (balrl<-1 || balrl>1)
+        return(nrl);
+    return(AVL_mtFixHeight(p, f));
+}
+
+
+AVL_MNODE *AVL_mtRebalanceToLeft(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nr, int hl0, AVL_MNODE **f);
+
+
+//
+//  Internal method, 'p' and 'n' are locked, 'n' is too heavy on the left.
+//  Picks a single or a double rotation, locking the nodes that move up.
+//  Returns 'n' if the heights changed in the meantime, to try again.
+//
+AVL_MNODE *AVL_mtRebalanceToRight(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nl, int hr0, AVL_MNODE **f)
+{
+    AVL_MNODE *ret;
+    AVL_MNODE *nlr;
+    int hll0, hlr0;
+
+    AVL_mtLock(nl);
+    if (AVL_mtLoad((*nl).h)-hr0<=1)
+    {
+        AVL_mtUnlock(nl);
+        return(n);
+    }
+    nlr=AVL_mtLoad((*nl).r);
+    hll0=AVL_mtHeight(AVL_mtLoad((*nl).l));
+    hlr0=AVL_mtHeight(nlr);
+    if (hll0>=hlr0)
+    {
+        ret=AVL_mtRotateRight(p, n, nl, hr0, hll0, nlr, hlr0, f);
+        AVL_mtUnlock(nl);
+        return(ret);
+    }
+
+    AVL_mtLock(nlr);
+    {
+        int hlr=AVL_mtLoad((*nlr).h);
+        if (hll0>=hlr)
+        {
+            ret=AVL_mtRotateRight(p, n, nl, hr0, hll0, nlr, hlr, f);
+            AVL_mtUnlock(nlr);
+            AVL_mtUnlock(nl);
+            return(ret);
+        }
+        else
+        {
+            int hlrl=AVL_mtHeight(AVL_mtLoad((*nlr).l));
+            int b=hll0-hlrl;
+            if (b>=-1 && b<=1)
+            {
+                ret=AVL_mtRotateRightOverLeft(p, n, nl, hr0, hll0, nlr, hlrl, f);
+                AVL_mtUnlock(nlr);
+                AVL_mtUnlock(nl);
+                return(ret);
+            }
+        }
+    }
+    AVL_mtUnlock(nlr);
+
+    //  The double rotation would leave 'nl' unbalanced, so that one first:
+    ret=AVL_mtRebalanceToLeft(n, nl, nlr, hll0, f);
+    AVL_mtUnlock(nl);
+    return(ret);
+}
+
+AVL_MNODE *AVL_mtRebalanceToLeft(AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE *nr, int hl0, AVL_MNODE **f)
+{
+    AVL_MNODE *ret;
+    AVL_MNODE *nrl;
+    int hrr0, hrl0;
+
+    AVL_mtLock(nr);
+    if (AVL_mtLoad((*nr).h)-hl0<=1)
+    {
+        AVL_mtUnlock(nr);
+        return(n);
+    }
+    nrl=AVL_mtLoad((*nr).l);
+    hrl0=AVL_mtHeight(nrl);
+    hrr0=AVL_mtHeight(AVL_mtLoad((*nr).r));
+    if (hrr0>=hrl0)
+    {
+        ret=AVL_mtRotateLeft(p, n, nr, hl0, hrr0, nrl, hrl0, f);
+        AVL_mtUnlock(nr);
+        return(ret);
+    }
+
+    AVL_mtLock(nrl);
+    {
+        int hrl=AVL_mtLoad((*nrl).h);
+        if (hrr0>=hrl)
+        {
+            ret=AVL_mtRotateLeft(p, n, nr, hl0, hrr0, nrl, hrl, f);
+            AVL_mtUnlock(nrl);
+            AVL_mtUnlock(nr);
+            return(ret);
+        }
+        else
+        {
+            int hrlr=AVL_mtHeight(AVL_mtLoad((*nrl).r));
+            int b=hrr0-hrlr;
+            if (b>=-1 && b<=1)
+            {
+                ret=AVL_mtRotateLeftOverRight(p, n, nr, hl0, hrr0, nrl, hrlr, f);
+                AVL_mtUnlock(nrl);
+                AVL_mtUnlock(nr);
+                return(ret);
+            }
+        }
+    }
+    AVL_mtUnlock(nrl);
+
+    ret=AVL_mtRebalanceToRight(n, nr, nrl, hrr0, f);
+    AVL_mtUnlock(nr);
+    return(ret);
+}
+
+
+//
+//  Internal method, 'p' and 'n' are locked:  unlinks, rotates, or fixes
+//  the height of 'n'.  Returns the next node that needs attention.
+//
+AVL_MNODE *AVL_mtRebalance(AVL_MTREE *t, AVL_MTHREAD *r, AVL_MNODE *p, AVL_MNODE *n, AVL_MNODE **f)
+{
+    AVL_MNODE *nl=AVL_mtLoad((*n).l);
+    AVL_MNODE *nr=AVL_mtLoad((*n).r);
+    int hn, hl0, hr0, hrepl, bal;
+
+    if ((nl==NULL || nr==NULL) && AVL_mtLoad((*n).live)==0)
+    {
+        if (AVL_mtUnlink(p, n))
+        {
+            AVL_mtRetire(t, r, n);
+            return(AVL_mtFixHeight(p, f));
+        }
+        return(n);
+    }
+
+    hn=AVL_mtLoad((*n).h);
+    hl0=AVL_mtHeight(nl);
+    hr0=AVL_mtHeight(nr);
+    hrepl=1+(hl0>hr0?hl0:hr0);
+    bal=hl0-hr0;
+
+    if (bal>1)
+        return(AVL_mtRebalanceToRight(p, n, nl, hr0, f));
+    else if (bal<-1)
+        return(AVL_mtRebalanceToLeft(p, n, nr, hl0, f));
+    else if (hrepl!=hn)
+    {
+        AVL_mtStore((*n).h, hrepl);
+        return(AVL_mtFixHeight(p, f));
+    }
+    return(NULL);
+}
+
+
+//
+//  Internal method:  repairs heights and balance from 'n' up, until
+//  nothing changes anymore.  'f' is the child of 'n' whose height just
+//  changed, if any.  The holder at the root has no parent.
+//
+void AVL_mtFixAndRebalance(AVL_MTREE *t, AVL_MTHREAD *r, AVL_MNODE *n, AVL_MNODE *f)
+{
+    AVL_MNODE *pend[AVL_MT_PENDING];    //  Parents of rotations that need a look later
+    int np=0;
+
+    while (1)
+    {
+        AVL_MNODE *p;
+        int c;
+
+        if (n==NULL || AVL_mtLoad((*n).p)==NULL)
+        {
+            if (np==0)
+                return;
+            np-=1;
+            n=pend[np];
+            f=NULL;
+            continue;
+        }
+
+        //  An unlinked node passes the damage on to its last parent:
+        if (AVL_mtLoad((*n).v)&AVL_MT_UNLINKED)
+        {
+            f=n;
+            n=AVL_mtLoad((*n).p);
+            continue;
+        }
+
+        AVL_mtLock(n);
+        if (f && AVL_mtLoad((*n).l)!=f && AVL_mtLoad((*n).r)!=f && !((AVL_mtLoad((*f).v)&AVL_MT_UNLINKED) && AVL_mtLoad((*f).p)==n))
+        {
+            //  A rotation moved 'f' away (without its lock) after we
+            //  read its parent, go to the new one:
+            AVL_mtUnlock(n);
+            n=AVL_mtLoad((*f).p);
+            continue;
+        }
+
+        //  Another thread may be fixing 'n' with a height of a child from
+        //  before it changed.  Whoever takes the lock of 'n' last sees both,
+        //  so the condition is only trusted under the lock:
+        c=AVL_mtNodeCondition(n);
+        if (c==AVL_MT_NOTHING || (AVL_mtLoad((*n).v)&AVL_MT_UNLINKED))
+        {
+            AVL_mtUnlock(n);
+            n=NULL;
+            continue;
+        }
+        if (c!=AVL_MT_UNLINK && c!=AVL_MT_REBALANCE)
+        {
+            AVL_MNODE *x=n;
+            n=AVL_mtFixHeight(x, &f);
+            AVL_mtUnlock(x);
+            continue;
+        }
+        AVL_mtUnlock(n);
+
+        //  Unlinks and rotations need the parent as well, locked first:
+        p=AVL_mtLoad((*n).p);
+        AVL_mtLock(p);
+        if ((AVL_mtLoad((*p).v)&AVL_MT_UNLINKED)==0 && AVL_mtLoad((*n).p)==p)
+        {
+            AVL_MNODE *x=n;
+            AVL_mtLock(x);
+            f=NULL;
+            n=AVL_mtRebalance(t, r, p, x, &f);
+            AVL_mtUnlock(x);
+
+            //  A rotation that left work below also changed the heights
+            //  under 'p' and 'x', which are looked at once that is done:
+            if (n!=NULL && f==NULL && np+2<=AVL_MT_PENDING)
+            {
+                pend[np]=p;
+                np+=1;
+                if (n!=x)
+                {
+                    pend[np]=x;
+                    np+=1;
+                }
+            }
+        }
+        //  Otherwise, try again with the new parent.
+        AVL_mtUnlock(p);
+    }
+    return;
+}
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Tree operations                                                    *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Internal method:  searches below 'n', which had version 'v' when the
+//  search arrived.  'e' is the direction to take from 'n'.  Every child
+//  pointer is only trusted after checking that 'n' did not change.
+//
+void *AVL_mtAttemptFind(AVL_MTREE *t, void *k, AVL_MNODE *n, int e, unsigned long v)
+{
+    while (1)
+    {
+        AVL_MNODE *c=(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r));
+        unsigned long cv;
+        int ce;
+
+        if (c==NULL)
+        {
+            if (AVL_mtLoad((*n).v)!=v)
+                return(AVL_MT_RETRY);
+            return(NULL);
+        }
+
+        ce=(*t).eval(AVL_mtLoad((*c).d), k, (*t).user);
+        if (ce==0)
+            return(AVL_mtLoad((*c).live) ? AVL_mtLoad((*c).d) : NULL);
+
+        cv=AVL_mtLoad((*c).v);
+        if (cv&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+        {
+            AVL_mtWait(c);
+            if (AVL_mtLoad((*n).v)!=v)
+                return(AVL_MT_RETRY);
+        }
+        else if (c!=(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r)))
+        {
+            if (AVL_mtLoad((*n).v)!=v)
+                return(AVL_MT_RETRY);
+        }
+        else
+        {
+            void *d;
+            if (AVL_mtLoad((*n).v)!=v)
+                return(AVL_MT_RETRY);
+            d=AVL_mtAttemptFind(t, k, c, ce, cv);
+            if (d!=AVL_MT_RETRY)
+                return(d);
+        }
+    }
+}
+
+
+void *AVL_mtFind(AVL_MTREE *t, void *k)
+{
+    AVL_MTHREAD *r=AVL_mtThread(t);
+    void *d=NULL;
+
+    if (r==NULL)
+        return(NULL);
+    AVL_mtEnter(t, r);
+    while (1)
+    {
+        AVL_MNODE *n=AVL_mtLoad((*t).root.r);
+        unsigned long v;
+        int e;
+
+        if (n==NULL)
+        {
+            d=NULL;
+            break;
+        }
+        e=(*t).eval(AVL_mtLoad((*n).d), k, (*t).user);
+        if (e==0)
+        {
+            d=(AVL_mtLoad((*n).live) ? AVL_mtLoad((*n).d) : NULL);
+            break;
+        }
+        v=AVL_mtLoad((*n).v);
+        if (v&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+            AVL_mtWait(n);
+        else if (n==AVL_mtLoad((*t).root.r))
+        {
+            d=AVL_mtAttemptFind(t, k, n, e, v);
+            if (d!=AVL_MT_RETRY)
+                break;
+        }
+    }
+    AVL_mtExit(r);
+    return(d);
+}
+
+
+//
+//  Internal method:  'n' holds a key equal to 'd'.  If it is a routing node
+//  it becomes live again with the new data, the old data goes into limbo
+//  on a node of its own.  Returns as 'AVL_mtAttemptInsert'.
+//
+int AVL_mtReviveNode(AVL_MTREE *t, AVL_MTHREAD *r, AVL_MNODE *n, void *d)
+{
+    AVL_MNODE *x;
+    void *old;
+
+    AVL_mtLock(n);
+    if (AVL_mtLoad((*n).v)&AVL_MT_UNLINKED)
+    {
+        AVL_mtUnlock(n);
+        return(-1);
+    }
+    if (AVL_mtLoad((*n).live))
+    {
+        AVL_mtUnlock(n);
+        return(1);
+    }
+    AVL_mtUnlock(n);
+
+    //  Allocate outside of the lock, and check again:
+    x=AVL_mtNewNode(NULL, NULL);
+    if (x==NULL)
+        return(2);
+    AVL_mtLock(n);
+    if ((AVL_mtLoad((*n).v)&AVL_MT_UNLINKED) || AVL_mtLoad((*n).live))
+    {
+        AVL_mtUnlock(n);
+        free(x);
+        return(-1);
+    }
+    old=(*n).d;
+    AVL_mtStore((*n).d, d);
+    AVL_mtStore((*n).live, 1);
+    AVL_mtUnlock(n);
+
+    __atomic_add_fetch(&((*t).size), 1, __ATOMIC_RELAXED);
+    (*x).d=old;
+    AVL_mtRetire(t, r, x);
+    return(0);
+}
+
+
+//
+//  Internal method:  inserts below 'n', which had version 'v' when the
+//  search arrived.  Returns -1 to start over, otherwise the return code
+//  of 'AVL_mtInsert'.
+//
+int AVL_mtAttemptInsert(AVL_MTREE *t, AVL_MTHREAD *r, void *d, AVL_MNODE *n, unsigned long v)
+{
+    int e=(*t).eval(AVL_mtLoad((*n).d), d, (*t).user);
+
+    if (e==0)
+        return(AVL_mtReviveNode(t, r, n, d));
+
+    while (1)
+    {
+        AVL_MNODE *c=(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r));
+
+        if (AVL_mtLoad((*n).v)!=v)
+            return(-1);
+
+        if (c==NULL)
+        {
+            AVL_MNODE *x=AVL_mtNewNode(d, n);
+            AVL_MNODE *damaged, *f;
+
+            if (x==NULL)
+                return(2);
+            AVL_mtLock(n);
+            if (AVL_mtLoad((*n).v)!=v)
+            {
+                AVL_mtUnlock(n);
+                free(x);
+                return(-1);
+            }
+            if ((e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r))!=NULL)
+            {
+                //  Someone else got there first, look again:
+                AVL_mtUnlock(n);
+                free(x);
+                continue;
+            }
+            if (e<0)
+                AVL_mtStore((*n).l, x);
+            else
+                AVL_mtStore((*n).r, x);
+            damaged=AVL_mtFixHeight(n, &f);
+            AVL_mtUnlock(n);
+
+            __atomic_add_fetch(&((*t).size), 1, __ATOMIC_RELAXED);
+            AVL_mtFixAndRebalance(t, r, damaged, f);
+            return(0);
+        }
+        else
+        {
+            unsigned long cv=AVL_mtLoad((*c).v);
+            if (cv&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+                AVL_mtWait(c);
+            else if (c==(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r)))
+            {
+                int rc;
+                if (AVL_mtLoad((*n).v)!=v)
+                    return(-1);
+                rc=AVL_mtAttemptInsert(t, r, d, c, cv);
+                if (rc!=-1)
+                    return(rc);
+            }
+        }
+    }
+}
+
+
+int AVL_mtInsert(AVL_MTREE *t, void *d)
+{
+    AVL_MTHREAD *r=AVL_mtThread(t);
+    int rc=-1;
+
+    if (r==NULL)
+        return(2);
+    AVL_mtEnter(t, r);
+    while (rc==-1)
+    {
+        AVL_MNODE *n=AVL_mtLoad((*t).root.r);
+        if (n==NULL)
+        {
+            //  Empty tree:
+            AVL_MNODE *x=AVL_mtNewNode(d, &((*t).root));
+            if (x==NULL)
+            {
+                rc=2;
+                break;
+            }
+            AVL_mtLock(&((*t).root));
+            if (AVL_mtLoad((*t).root.r)==NULL)
+            {
+                AVL_mtStore((*t).root.r, x);
+                AVL_mtStore((*t).root.h, 2);
+                __atomic_add_fetch(&((*t).size), 1, __ATOMIC_RELAXED);
+                rc=0;
+            }
+            else
+                free(x);
+            AVL_mtUnlock(&((*t).root));
+        }
+        else
+        {
+            unsigned long v=AVL_mtLoad((*n).v);
+            if (v&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+                AVL_mtWait(n);
+            else if (n==AVL_mtLoad((*t).root.r))
+                rc=AVL_mtAttemptInsert(t, r, d, n, v);
+        }
+    }
+    AVL_mtExit(r);
+    return(rc);
+}
+
+
+//
+//  Internal method:  deletes the data of 'n', a child of 'p'.  A node with
+//  two children stays in the tree as a routing node, any other node is
+//  unlinked right away.
+//
+void *AVL_mtDeleteNode(AVL_MTREE *t, AVL_MTHREAD *r, AVL_MNODE *p, AVL_MNODE *n)
+{
+    void *d;
+
+    if (AVL_mtLoad((*n).live)==0)
+        return(NULL);
+
+    if (AVL_mtLoad((*n).l)==NULL || AVL_mtLoad((*n).r)==NULL)
+    {
+        AVL_MNODE *damaged, *f;
+
+        AVL_mtLock(p);
+        if ((AVL_mtLoad((*p).v)&AVL_MT_UNLINKED) || AVL_mtLoad((*n).p)!=p)
+        {
+            AVL_mtUnlock(p);
+            return(AVL_MT_RETRY);
+        }
+        AVL_mtLock(n);
+        d=(*n).d;
+        if (AVL_mtLoad((*n).live)==0)
+        {
+            AVL_mtUnlock(n);
+            AVL_mtUnlock(p);
+            return(NULL);
+        }
+        if (!AVL_mtUnlink(p, n))
+        {
+            AVL_mtUnlock(n);
+            AVL_mtUnlock(p);
+            return(AVL_MT_RETRY);
+        }
+        AVL_mtUnlock(n);
+        damaged=AVL_mtFixHeight(p, &f);
+        AVL_mtUnlock(p);
+
+        __atomic_sub_fetch(&((*t).size), 1, __ATOMIC_RELAXED);
+        AVL_mtRetire(t, r, n);
+        AVL_mtFixAndRebalance(t, r, damaged, f);
+        return(d);
+    }
+
+    AVL_mtLock(n);
+    if (AVL_mtLoad((*n).v)&AVL_MT_UNLINKED)
+    {
+        AVL_mtUnlock(n);
+        return(AVL_MT_RETRY);
+    }
+    if (AVL_mtLoad((*n).live)==0)
+    {
+        AVL_mtUnlock(n);
+        return(NULL);
+    }
+    if (AVL_mtLoad((*n).l)==NULL || AVL_mtLoad((*n).r)==NULL)
+    {
+        //  Lost a child in the meantime, can be unlinked after all:
+        AVL_mtUnlock(n);
+        return(AVL_MT_RETRY);
+    }
+    d=(*n).d;
+    AVL_mtStore((*n).live, 0);
+    AVL_mtUnlock(n);
+    __atomic_sub_fetch(&((*t).size), 1, __ATOMIC_RELAXED);
+    return(d);
+}
+
+
+//
+//  Internal method:  the search part of delete, like 'AVL_mtAttemptInsert'.
+//
+void *AVL_mtAttemptDelete(AVL_MTREE *t, AVL_MTHREAD *r, void *k, AVL_MNODE *p, AVL_MNODE *n, unsigned long v)
+{
+    int e=(*t).eval(AVL_mtLoad((*n).d), k, (*t).user);
+
+    if (e==0)
+        return(AVL_mtDeleteNode(t, r, p, n));
+
+    while (1)
+    {
+        AVL_MNODE *c=(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r));
+
+        if (AVL_mtLoad((*n).v)!=v)
+            return(AVL_MT_RETRY);
+        if (c==NULL)
+            return(NULL);
+        else
+        {
+            unsigned long cv=AVL_mtLoad((*c).v);
+            if (cv&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+                AVL_mtWait(c);
+            else if (c==(e<0 ? AVL_mtLoad((*n).l) : AVL_mtLoad((*n).r)))
+            {
+                void *d;
+                if (AVL_mtLoad((*n).v)!=v)
+                    return(AVL_MT_RETRY);
+                d=AVL_mtAttemptDelete(t, r, k, n, c, cv);
+                if (d!=AVL_MT_RETRY)
+                    return(d);
+            }
+        }
+    }
+}
+
+
+void *AVL_mtDelete(AVL_MTREE *t, void *k)
+{
+    AVL_MTHREAD *r=AVL_mtThread(t);
+    void *d=AVL_MT_RETRY;
+
+    if (r==NULL)
+        return(NULL);
+    AVL_mtEnter(t, r);
+    while (d==AVL_MT_RETRY)
+    {
+        AVL_MNODE *n=AVL_mtLoad((*t).root.r);
+        if (n==NULL)
+            d=NULL;
+        else
+        {
+            unsigned long v=AVL_mtLoad((*n).v);
+            if (v&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+                AVL_mtWait(n);
+            else if (n==AVL_mtLoad((*t).root.r))
+                d=AVL_mtAttemptDelete(t, r, k, &((*t).root), n, v);
+        }
+    }
+    AVL_mtExit(r);
+    return(d);
+}
+
+
+int AVL_mtSize(AVL_MTREE *t)
+{
+    return(__atomic_load_n(&((*t).size), __ATOMIC_RELAXED));
+}
+
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Testing and validation                                             *
+ *                                                                      *
+ ************************************************************************/
+
+
+
+//
+//  Internal method:  checks the subtree of 'n', where all keys lie between
+//  'lo' and 'hi' (if not NULL).  Returns the height, or -1.
+//
+int AVL_mtCheckNode(AVL_MTREE *t, AVL_MNODE *n, AVL_MNODE *p, void *lo, void *hi)
+{
+    int hl, hr;
+
+    if (n==NULL)
+        return(0);
+    if ((*n).p!=p)
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  wrong parent pointer\n");
+        return(-1);
+    }
+    if ((*n).v&(AVL_MT_SHRINKING|AVL_MT_UNLINKED))
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  node in the tree is unlinked or changing\n");
+        return(-1);
+    }
+    if ((lo && (*t).eval(lo, (*n).d, (*t).user)<=0) || (hi && (*t).eval(hi, (*n).d, (*t).user)>=0))
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  order error\n");
+        return(-1);
+    }
+    if ((*n).live==0 && ((*n).l==NULL || (*n).r==NULL))
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  routing node with less than 2 children\n");
+        return(-1);
+    }
+    hl=AVL_mtCheckNode(t, (*n).l, n, lo, (*n).d);
+    hr=AVL_mtCheckNode(t, (*n).r, n, (*n).d, hi);
+    if (hl<0 || hr<0)
+        return(-1);
+    if (hl-hr<-1 || hl-hr>1)
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  balance error (%i vs %i)\n", hl, hr);
+        return(-1);
+    }
+    if ((*n).h!=1+(hl>hr?hl:hr))
+    {
+        fprintf(stderr, "AVL_mtCheckBalance:  height error (%i, should be %i)\n", (*n).h, 1+(hl>hr?hl:hr));
+        return(-1);
+    }
+    return((*n).h);
+}
+
+
+int AVL_mtCheckBalance(AVL_MTREE *t)
+{
+    return(AVL_mtCheckNode(t, (*t).root.r, &((*t).root), NULL, NULL));
+}
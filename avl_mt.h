@@ -0,0 +1,200 @@
+/*
+ *  Copyright (c) 2020 by Vincent H. Berk
+ *  All rights reserved.
+ *
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice, this
+ *     list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ *  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ *  Concurrent AVL tree for many writers, after Bronson, Casper, Chafi and
+ *  Olukotun, "A Practical Concurrent Binary Search Tree" (PPoPP 2010).
+ *
+ *  Every node carries a version word.  Searches take no locks:  they move
+ *  hand-over-hand down the tree, and check that the version of the node
+ *  they came from did not change while they read the child pointer.  A
+ *  rotation marks the node that loses part of its subtree as 'shrinking'
+ *  while it runs, and bumps its version after.  Writers lock only the nodes
+ *  they change:  the parent for an insert, parent and node for an unlink,
+ *  and at most four nodes for a rotation.
+ *
+ *  Balance is relaxed:  heights are repaired, and rotations done, after the
+ *  insert or delete itself, and may lag behind briefly under contention.
+ *  A deleted node that still has two children stays in the tree as a
+ *  routing node, and is unlinked as soon as it has one child or less.
+ *
+ *  The evaluation method, and the return codes of insert/delete/find, are
+ *  the same as in avl.h.  Because a routing node keeps its data pointer as
+ *  the key, and searches may still be on an unlinked node, the data of a
+ *  deleted item can be passed to 'eval' after 'delete' has returned it.
+ *  Deleted data is therefore handed to the 'release' method once it is no
+ *  longer used, and that is where it can be freed.
+ *
+ *  Nodes are allocated one at a time, and reclaimed through epochs:  each
+ *  thread keeps its own limbo lists, which are freed once every thread
+ *  inside the tree has moved two epochs on.
+ *
+ */
+
+
+
+
+#ifndef _AVL_MT_TREE_H
+#define _AVL_MT_TREE_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//  Number of retired nodes a thread collects before trying to move
+//  the epoch forward.
+#define AVL_MT_BATCH 64
+
+
+//  A node of the concurrent tree, 56 bytes on a 64 bit system.
+typedef struct AVL_MNODE_S
+{
+    struct AVL_MNODE_S *l, *r;  //  Left and right sub-trees
+    struct AVL_MNODE_S *p;      //  Parent
+    void *d;                    //  The user data pointer, the routing key once deleted
+    unsigned long v;            //  Version:  unlinked, shrinking, and change count
+    int h;                      //  Height of this subtree, may lag during rebalancing
+    int8_t lock;                //  Spin lock
+    int8_t live;                //  0 for a routing node
+    struct AVL_MNODE_S *next;   //  Limbo list, once unlinked
+}
+AVL_MNODE;
+
+
+//  Per thread state, found through a thread-specific key:
+typedef struct AVL_MTHREAD_S
+{
+    unsigned long epoch;        //  Epoch in which the thread entered, 0 when outside
+    int used;                   //  Records of exited threads are reused
+    int pending;                //  Number of nodes in limbo
+    AVL_MNODE *limbo[3];        //  Retired nodes per epoch (mod 3), linked on 'next'
+    unsigned long last[3];      //  The epoch each limbo list belongs to
+    struct AVL_MTHREAD_S *next;
+}
+AVL_MTHREAD;
+
+
+//  Global tree structure:
+typedef struct
+{
+    AVL_MNODE root;             //  Holder, the actual top of the tree is (*root).r
+    int size;                   //  Number of items in the tree
+    unsigned long epoch;        //  Global epoch
+    AVL_MTHREAD *threads;       //  All thread records, linked on 'next'
+    pthread_key_t key;          //  Finds the record of the calling thread
+
+    //  The method by which *data pointers are compared
+    int (*eval)(void *d1, void *d2, void *user);
+    //  Called once deleted data is no longer used by the tree, may be NULL
+    void (*release)(void *d, void *user);
+    void *user;
+}
+AVL_MTREE;
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Memory management                                                  *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Building a tree requires the evaluation method, as in 'AVL_newTree'.
+//  'release' is optional:  without it, deleted data must be kept until
+//  the tree is destroyed.  Returns NULL if out of memory.
+//
+AVL_MTREE *AVL_mtNewTree(int (*eval)(void *d1, void *d2, void *user), void (*release)(void *d, void *user), void *user);
+
+//
+//  No other thread may be using the tree.  Data still in the tree is
+//  left alone, deleted data still held by the tree is released.
+//
+void AVL_mtDestroy(AVL_MTREE *t);
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Tree operations                                                    *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  All three are safe to call from any number of threads at once.
+//
+//  Insert returns 0 when inserted, 1 if it already exists, 2 if
+//  unable to allocate memory.  Delete and find return the data
+//  pointer, or NULL if not found.
+//
+int AVL_mtInsert(AVL_MTREE *t, void *d);
+void *AVL_mtDelete(AVL_MTREE *t, void *k);
+void *AVL_mtFind(AVL_MTREE *t, void *k);
+
+//
+//  Number of items in the tree, exact only when no writer is active.
+//
+int AVL_mtSize(AVL_MTREE *t);
+
+
+
+
+/************************************************************************
+ *                                                                      *
+ *   Testing and validation                                             *
+ *                                                                      *
+ ************************************************************************/
+
+
+//
+//  Regression testing method, for a tree without active writers.  Returns
+//  the height of the tree, or -1 if there's a balance, height, parent or
+//  order error, printing an error message to 'stderr'.
+//
+int AVL_mtCheckBalance(AVL_MTREE *t);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif